@@ -3,6 +3,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
 #include "disk_emu.h"
 
 
@@ -10,6 +11,11 @@ FILE* fp = NULL;
 double L, p;
 double r;
 int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY, lru;
+int write_calls = 0;    /*write_blocks calls since the last set_crash_point*/
+int blocks_read = 0;    /*Blocks read by read_blocks so far*/
+int crash_point = -1;   /*First write_blocks call that does not reach the disk (-1: none)*/
+int crash_torn = 0;     /*Does the crash_point call write half of its bytes?*/
+pthread_mutex_t disk_lock = PTHREAD_MUTEX_INITIALIZER; /*File position and writes (one thread at a time)*/
 
 /*----------------------------------------------------------*/
 /*Close the disk file filled when you don't need it anymore. */
@@ -109,9 +115,6 @@ int read_blocks(int start_address, int nblocks, void *buffer)
         return -1;
     }
 
-    /*Goto the data requested from the disk*/
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
-
     /*For every block requested*/
     for (i = 0; i < nblocks; ++i)
     {
@@ -119,7 +122,12 @@ int read_blocks(int start_address, int nblocks, void *buffer)
         // usleep(L);
 
         s++;
+        /*Goto the data requested from the disk (the copy below runs outside the lock)*/
+        pthread_mutex_lock(&disk_lock);
+        blocks_read++;
+        fseek(fp, (start_address + i) * BLOCK_SIZE, SEEK_SET);
         fread(blockRead, BLOCK_SIZE, 1, fp);
+        pthread_mutex_unlock(&disk_lock);
 
        for (j = 0; j < BLOCK_SIZE; j++)
         {
@@ -155,6 +163,23 @@ int write_blocks(int start_address, int nblocks, void *buffer)
         return -1;
     }
 
+    pthread_mutex_lock(&disk_lock);
+
+    /*Power is gone: nothing reaches the disk, the caller does not know*/
+    write_calls++;
+    if (crash_point >= 0 && write_calls > crash_point)
+    {
+        if (write_calls == crash_point + 1 && crash_torn)
+        {
+            fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+            fwrite(buffer, nblocks * BLOCK_SIZE / 2, 1, fp);
+            fflush(fp);
+        }
+        pthread_mutex_unlock(&disk_lock);
+        free(blockWrite);
+        return nblocks;
+    }
+
     /*Goto where the data is to be written on the disk*/        
     fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
 
@@ -170,6 +195,7 @@ int write_blocks(int start_address, int nblocks, void *buffer)
         fflush(fp);
         s++;
     }
+    pthread_mutex_unlock(&disk_lock);
     free(blockWrite);
 
     /*If no failure return the number of blocks written, else return the negative number of failures*/
@@ -178,3 +204,33 @@ int write_blocks(int start_address, int nblocks, void *buffer)
     else
         return e;
 }
+
+/*------------------------------------------------------------------*/
+/*Crash injection: from the n-th write_blocks call on (0 is the next */
+/*one), writes are dropped as if power was lost. With torn set, the  */
+/*n-th call writes the first half of its bytes first. n < 0 turns it */
+/*off. Either way, write_blocks calls are counted from 0 again.      */
+/*------------------------------------------------------------------*/
+void set_crash_point(int n, int torn)
+{
+    crash_point = n;
+    crash_torn = torn;
+    write_calls = 0;
+}
+
+/*--------------------------------------------------------------*/
+/*Number of write_blocks calls since the last set_crash_point,  */
+/*dropped ones included                                         */
+/*--------------------------------------------------------------*/
+int get_write_calls()
+{
+    return write_calls;
+}
+
+/*--------------------------------------------------------------*/
+/*Number of blocks read by read_blocks so far                   */
+/*--------------------------------------------------------------*/
+int get_blocks_read()
+{
+    return blocks_read;
+}
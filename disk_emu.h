@@ -3,3 +3,6 @@ int init_disk(char *filename, int block_size, int num_blocks);
 int read_blocks(int start_address, int nblocks, void *buffer);
 int write_blocks(int start_address, int nblocks, void *buffer);
 int close_disk();
+void set_crash_point(int n, int torn);
+int get_write_calls();
+int get_blocks_read();
@@ -3,25 +3,97 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
 
 #define BLOCK_SIZE 1024             // Block size in bytes
 #define NUM_BLOCKS 1024             // Number of block in the file system
-#define MAGIC 0xACBD0005            // Magic number
-#define NUM_SHADOW_ROOTS 14         // Maximum number of shadow roots
+#define MAGIC 0xACBD000D            // Magic number
 
 #define MAX_DIRECT_PTR 14           // Maximum number of direct pointers in an i/j-node stuct
+#define MAX_FILE_SIZE ((MAX_DIRECT_PTR + BLOCK_SIZE/sizeof(b_ptr_t))*BLOCK_SIZE) // Direct + indirect blocks
+#define MAX_FILE_BLOCKS (MAX_DIRECT_PTR + BLOCK_SIZE/sizeof(b_ptr_t)) // Pointer file not included
 
-#define SUPER_BLOCK 0               // Location of superblock on disk
+#define SUPER_BLOCK 0               // Location of superblock on disk (first slot)
+#define SUPER_BLOCK_B 7             // Second superblock slot: writes alternate, the newest valid slot wins
 #define DEFAULT_FBM_BLOCK 1         // Location of file bit mask on disk
-#define DEFAULT_WM_BLOCK 2          // Location of write mask on disk
 #define DEFAULT_INODE_TABLE_BLOCK 3 // Location of the very first inode table
 #define DEFAULT_ROOT_DIR_BLOCK 4    // Location of root dir on disk init
+#define DEFAULT_REFCNT_BLOCK 5      // Location of the block reference counts (REFCNT_BLOCKS blocks)
+#define REFCNT_BLOCKS (NUM_BLOCKS*sizeof(unsigned short)/BLOCK_SIZE)
+#define DEFAULT_LOG_BLOCK 8         // Location of the metadata log (LOG_BLOCKS blocks)
+#define LOG_BLOCKS 16               // Size of the metadata log: a checkpoint happens when it is full
+#define LOG_SUPER -1                // Log record block number of the superblock
+#define LOG_COMMIT -2               // Log record block number of the end of a sync (replay stops at the last one)
+#define LOG_PAYLOAD (BLOCK_SIZE - sizeof(log_record_t)) // Maximum number of bytes of a log record
+#define DEFAULT_CRC_BLOCK 24        // Location of the block checksums (CRC_BLOCKS blocks, logged like metadata)
+#define CRC_BLOCKS (NUM_BLOCKS*sizeof(uint32_t)/BLOCK_SIZE)
+#define CRCS_PER_BLOCK (BLOCK_SIZE/sizeof(uint32_t))
+#ifndef SSFS_FLUSH_DEFAULT
+#define SSFS_FLUSH_DEFAULT 1        // Is the flusher on after mkssfs? (see ssfs_set_flush)
+#endif
+#ifndef SSFS_VERIFY_DEFAULT
+#define SSFS_VERIFY_DEFAULT SSFS_VERIFY_FIRST // Verification mode after mkssfs (see ssfs_set_verify)
+#endif
+
+#if defined(__x86_64__) && !defined(SSFS_NO_HW_CRC)
+#include <nmmintrin.h>              // SSE4.2 CRC32 (only used if the CPU has it)
+#define CRC32C_HW
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32) && !defined(SSFS_NO_HW_CRC)
+#include <arm_acle.h>               // ARMv8 CRC32
+#define CRC32C_HW
+#endif
+
+#define BLOCK_OLD 0                 // FBM: used, born before the last commit (read-only)
+#define BLOCK_FREE 1                // FBM: unused
+#define FIRST_EPOCH 2               // FBM: values from FIRST_EPOCH to LAST_EPOCH are the birth epoch of a used block
+#define LAST_EPOCH 255
 
 #define DIR_ENTRY_SIZE 16           // Max size for a directory entry
 #define FILENAME_SIZE 10            // Max size for the filename (includes extensions)
 
 #define J_NODE 0              // j-node position in fdt
 #define ROOT_DIR 1                 // root dir position in fdt
+#define FD_SLOT_BITS 20             // A fd is the slot of its fd_t in the slab, tagged with the slot's generation
+#define FD_SLOT_MASK ((1 << FD_SLOT_BITS) - 1)
+#define FD_TAG_MASK ((1 << (31 - FD_SLOT_BITS)) - 1) // Generations wrap around (fds stay positive)
+#define FD_CHUNK 1024               // fd_t per slab chunk (the slab grows a chunk at a time)
+#define FD_CHUNKS ((1 << FD_SLOT_BITS)/FD_CHUNK) // Most chunks the slab can have
+#define FD_NONE -1                  // End of the free list of slots
+#define FILE_BUCKETS 1024           // Hash buckets of the open files (by shadow root and inode_id)
+#define FILE_LOCKS 64               // Locks of the files' data (a file uses inode_id % FILE_LOCKS)
+#define ALLOC_GROUPS 16             // Allocation groups: each one owns a segment of the FBM, with its own lock
+#define GROUP_BLOCKS (NUM_BLOCKS/ALLOC_GROUPS) // Blocks per allocation group
+#define RETIRE_BATCH 64             // Inode copies replaced before the readers are waited for and they are freed
+#define FLUSH_INTERVAL 30           // Milliseconds between two runs of the flusher (at most)
+#define FLUSH_BYTES (LOG_BLOCKS*BLOCK_SIZE/8)        // Unsynced log bytes that wake the flusher early
+#define DIRTY_LIMIT (LOG_BLOCKS*BLOCK_SIZE*5/8)      // Log bytes from which writers are slowed down
+#define DIRTY_HARD_LIMIT (LOG_BLOCKS*BLOCK_SIZE*3/4) // Log bytes from which writers sync it themselves
+#define MAX_PAUSE 2000              // Longest pause of a writer below DIRTY_HARD_LIMIT (microseconds)
+
+#define SNAP_LIVE 0                 // Shadow root can be restored
+#define SNAP_DELETED 1              // Shadow root deleted, its blocks are not reclaimed yet
+#define SNAP_RECLAIMED 2            // Shadow root deleted and reclaimed
+#define SNAP_BRANCH 3               // Writable clone of a shadow root (not a commit)
+#define RECLAIM_BATCH 64            // Inodes of a deleted shadow root released per reclaim step
+#define RECONCILE_SLOTS 8           // Roots swapped out or in (restore, checkout) whose counts are not walked yet
+
+#define STREAM_MAGIC "SSFSSTRM"     // Send/receive stream magic
+#define STREAM_VERSION 2            // Send/receive stream format version
+#define STREAM_HEADER_SIZE 36       // Bytes of a packed stream_header_t (fields little-endian, no padding)
+#define STREAM_RECORD_SIZE 32       // Bytes of a packed stream_record_t (before its data)
+#define STREAM_MAX (2*NUM_BLOCKS*BLOCK_SIZE) // Longest stream ssfs_receive takes (more than a disk holds)
+#define SEND_BATCH 64               // Maximum number of blocks per data record
+#define REC_FILE 1                  // Created or modified file: name and new size
+#define REC_DATA 2                  // Blocks of the file of the last REC_FILE
+#define REC_DELETE 3                // Deleted file
+#define REC_END 4                   // End of stream
+
+#define FSCK_UNUSED 0               // fsck: inode is free (size -1)
+#define FSCK_USED 1                 // fsck: inode is in use and checks out
+#define FSCK_BAD 2                  // fsck: inode has a bad size or pointers
 
 /**************************************************************************/
 
@@ -42,31 +114,87 @@ typedef struct _inode {
    b_ptr_t i_ptr;                   // Indirect pointer
 } inode_t;
 
-typedef struct _fd_t {              // File descriptor used in FDT
+typedef struct _file_t {            // Open file, shared by all the fds on the same inode of the same root
    inode_t inode;                   // The file's inode (not sure it's necessary; is a shortcut)
    int inode_id;                    // The id of the file's inode
+   int snap;                        // Shadow root of a read-only file (-1: current root)
+   int gen;                         // Root generation the inode copy was taken from
+   inode_t *pub;                    // Copy of inode published to the lock-free reads (see read_begin)
+   int refs;                        // Number of fds open on it
+   b_ptr_t last;                    // Last block allocated to it (its next blocks go to the same group)
+   int seq;                         // Sync point that covers the last call that wrote it (ssfs_fsync)
+   struct _fd_t *fds;               // Those fds
+   struct _file_t *next;            // Next file of the same hash bucket
+} file_t;
+
+typedef struct _fd_t {              // File descriptor used in FDT
+   file_t *file;                    // The open file
    virt_addr_t read_ptr;            // Read pointer   (offset in bytes)
    virt_addr_t write_ptr;           // Write pointer  (offset in bytes)
+   int handle;                      // fd of the slot while it is open (-1: free)
+   int tag;                         // Generation of the slot (bumped by every close: older fds go stale)
+   int slot;                        // Index of the slot in the slab
+   int next_free;                   // Next slot of the free list
+   struct _fd_t *next_fd;           // Next fd on the same file
+   struct _fd_t *prev_fd;           // Previous fd on the same file
 } fd_t;
 
+typedef struct _reconcile_t {       // Reference counts a root swap still owes (see reclaim_step)
+   inode_t root;                    // j-node of the root swapped out or in (its blocks stay as they are meanwhile)
+   int delta;                       // Added to the count of each of its blocks
+   int pos;                         // Next inode of it to walk (-1: the j-node itself)
+} reconcile_t;
+
+typedef struct _compact_t {         // Progress of an ssfs_compact run (see compact_step)
+   time_t now;                      // Arguments of the call
+   int age;
+   int interval;
+   int pos;                         // Next shadow root to look at (-1: done)
+   int first;                       // Newest shadow root kept so far in the current interval (-1: none)
+   long bucket;                     // Its interval
+} compact_t;
+
 typedef struct _super_block {
    int magic;                       // Magic number
    int block_size;                  // 
    int num_blocks;                  //
    int num_inodes;                  //
-   int current_root;                //
-   inode_t roots[NUM_SHADOW_ROOTS]; // Array of shadow roots
-   b_ptr_t wm_ptrs[NUM_SHADOW_ROOTS];
-   b_ptr_t fbm_ptrs[NUM_SHADOW_ROOTS];
+   int num_roots;                   // Number of committed shadow roots
+   inode_t root;                    // Current (writable) root
+   b_ptr_t fbm_ptr;                 // FBM of the current root (allocation and birth epochs)
+   b_ptr_t snap_table;              // First block of the snapshot table (0 if no commit yet)
+   int reclaim_cnum;                // Shadow root being reclaimed (-1 if none)
+   int reclaim_pos;                 // Next inode of it to release (-1: the j-node itself)
+   int branch;                      // Checked out branch (-1: main line). Its entry holds the main line meanwhile
+   b_ptr_t refcnt_ptr;              // First of the REFCNT_BLOCKS blocks of reference counts
+   int sweep;                       // Shadow roots were released since the last sweep
+   int epoch;                       // Birth epoch of the blocks allocated since the last commit
+   int commits;                     // Number of commits so far (see refcnt)
+   b_ptr_t log_ptr;                 // First of the LOG_BLOCKS blocks of the metadata log
+   int log_gen;                     // Generation of the log records to replay (bumped by checkpoints)
+   b_ptr_t crc_ptr;                 // First of the CRC_BLOCKS blocks of block checksums
+   int num_reconcile;               // Walks pending in reconcile, oldest first
+   reconcile_t reconcile[RECONCILE_SLOTS];
+   int seq;                         // Incremented by every checkpoint (newest slot wins)
+   uint32_t crc;                    // CRC32C of the superblock (crc field set to 0)
 } super_block_t;
 
-typedef struct _fbm_t {             // File Bit Mask
-   char mask[NUM_BLOCKS];           // Because ints are too big
-} fbm_t;
+typedef struct _snap_entry_t {      // A committed shadow root
+   inode_t root;                    // Its j-node
+   int state;                       // SNAP_LIVE, SNAP_DELETED, SNAP_RECLAIMED or SNAP_BRANCH
+   time_t time;                     // Commit (or clone) time
+} snap_entry_t;
+
+#define SNAPS_PER_BLOCK ((BLOCK_SIZE-sizeof(b_ptr_t))/sizeof(snap_entry_t))
 
-typedef struct _wm_t {              // Write Mask
-   char mask[NUM_BLOCKS];
-} wm_t;
+typedef struct _snap_table_t {      // A block of the snapshot table (blocks are chained)
+   b_ptr_t next;                    // Next block of the table (0 if last)
+   snap_entry_t entries[SNAPS_PER_BLOCK];
+} snap_table_t;
+
+typedef struct _fbm_t {             // File Bit Mask, with the birth epoch of every used block
+   unsigned char mask[NUM_BLOCKS];  // BLOCK_FREE, BLOCK_OLD or a birth epoch (ints are too big)
+} fbm_t;
 
 typedef struct _dir_entry_t {       // A directory entry (default: 16 bytes)
    char filename[FILENAME_SIZE+1];  // Null terminated?
@@ -81,548 +209,3440 @@ typedef struct _inode_block_t {
    inode_t inodes[BLOCK_SIZE/sizeof(inode_t)];
 } inode_block_t;
 
+typedef struct _stream_header_t {   // Start of a send/receive stream (pack_header gives its layout)
+   char magic[8];                   // STREAM_MAGIC (not null terminated)
+   int version;                     // STREAM_VERSION
+   int block_size;                  // Must match on the receiving side
+   int from;                        // Base shadow root (-1: full stream)
+   int to;                          // Shadow root sent
+   uint32_t base;                   // root_fingerprint of the base (0 for a full stream: no files)
+   uint32_t result;                 // root_fingerprint of the shadow root sent
+   uint32_t crc;                    // CRC32C of the packed header (crc field set to 0)
+} stream_header_t;
+
+typedef struct _stream_record_t {   // Record of a stream (pack_record), followed by num_blocks*BLOCK_SIZE bytes for REC_DATA
+   int type;                        // REC_*
+   char name[FILENAME_SIZE+2];      // File name (REC_FILE, REC_DELETE)
+   int size;                        // New file size (REC_FILE)
+   int first_block;                 // Index of the first block in the file (REC_DATA)
+   int num_blocks;                  // Number of blocks (REC_DATA)
+   uint32_t crc;                    // CRC32C of the packed record (crc field set to 0) and its data
+} stream_record_t;
+
+typedef struct _send_ctx_t {        // State of ssfs_send between diff callbacks
+   int out_fd;                      // Where the stream goes
+   int pass;                        // 0: deletions, 1: creations and modifications
+   inode_t *root;                   // j-node being sent
+   dir_entry_t *dir;                // Its root dir
+   char name[FILENAME_SIZE+1];      // File of the last REC_FILE record
+   inode_t inode;                   // Its inode
+   char *buf;                       // Data of one record (SEND_BATCH blocks)
+} send_ctx_t;
+
+typedef struct _log_record_t {      // Metadata log record, followed by length bytes (never spans blocks)
+   int gen;                         // Log generation (records of older generations are stale)
+   b_ptr_t block;                   // Home block of the bytes (LOG_SUPER: the superblock, LOG_COMMIT: end of a sync)
+   short offset;                    // Where the bytes go in the block
+   short length;                    // Number of bytes (0: nothing else in this log block)
+   uint32_t crc;                    // CRC32C of the record (crc field set to 0) and its bytes
+} log_record_t;
+
+typedef struct _cow_batch_t {       // Pending updates of a run of copy-on-write'd blocks
+   fbm_t *FBM;                      // In-memory FBM (NULL if no run is pending)
+   ptr_file_t *ptr_file;            // In-memory pointer file (NULL if not touched by the run)
+} cow_batch_t;
+
+typedef struct _iov_cursor_t {      // Position in an iovec array (vectored calls copy to and from it directly)
+   const struct iovec *iov;         // Current iovec
+   int offset;                      // Bytes of it already copied
+} iov_cursor_t;
+
+typedef struct _group_t {           // Allocation group: blocks [g*GROUP_BLOCKS, (g+1)*GROUP_BLOCKS)
+   pthread_mutex_t lock;            // Taking and freeing its blocks (its segment of the FBM)
+   int free;                        // BLOCK_FREE entries of its segment in the current FBM
+} group_t;
+
+typedef struct _fsck_job_t {        // An inode table block checked by ssfs_fsck (once, whatever the roots sharing it)
+   b_ptr_t block;                   // The table block
+   int first_id;                    // Id of its first inode (in the first root using it)
+   int limit;                       // Number of inodes to check in it (the most any root uses)
+   int status[BLOCK_SIZE/sizeof(inode_t)]; // FSCK_* of each inode
+   int counts[BLOCK_SIZE/sizeof(inode_t)]; // Number of entries of each inode in blocks
+   b_ptr_t *blocks;                 // MAX_FILE_BLOCKS+1 entries per inode (see fsck_blocks)
+   int problems;                    // Problems found in it
+} fsck_job_t;
+
+typedef struct _fsck_root_t {       // A root checked by ssfs_fsck
+   inode_t root;                    // Its j-node
+   int cnum;                        // Shadow root number (-1: current root, -2: root swap not reconciled yet)
+   int writable;                    // Current root or branch
+   int counted;                     // First position counted in refcnt (-1: the j-node too, num_inodes: none)
+   unsigned short weight;           // What each use of a counted block adds to refcnt (current root: -commits)
+   b_ptr_t *blocks;                 // Its inode table blocks and pointer file (see fsck_blocks)
+   int num_blocks;                  // Number of entries in blocks
+   int *jobs;                       // Job of each inode table block (-1 if the pointer is bad)
+   int num_tables;                  // Number of inode table blocks
+} fsck_root_t;
+
+typedef struct _fsck_worker_t {     // A thread of ssfs_fsck
+   pthread_t thread;
+   char *disk;                      // In-memory image
+   fsck_job_t *jobs;                // Inode table blocks (first pass)
+   int num_jobs;
+   char *check;                     // Blocks whose checksum needs checking (second pass), 2 if bad
+   int first;                       // Index of the thread: it takes every stride-th job or block
+   int stride;                      // Number of threads
+   int pass;                        // 0: inode tables, 1: checksums
+   int problems;                    // Checksums that do not match
+} fsck_worker_t;
+
 /*************************************************************************/
 
-b_ptr_t get_unused_block();// Gets an unused block (according to some strategy)
+b_ptr_t get_unused_block(int);// Gets an unused block, from a group (-1: the thread's) first. Its group stays locked
 int add_new_block(inode_t*, int, int, b_ptr_t, super_block_t*, int); // Adds specified block to pointed sb
-int new_fdt_entry(inode_t, int);    // Creates a new entry in the FDT
+int new_fdt_entry(inode_t, int, int); // Creates a new entry in the FDT (on the open file of the inode)
+fd_t *get_fd(int);                  // Checks a file ID and revalidates its inode (NULL if invalid)
+fd_t *fd_at(int);                   // Slot of an open fd (NULL if the fd is closed or was never handed out)
+fd_t *fd_slot(int);                 // Slot by index (NULL past the end of the slab)
+fd_t *fd_alloc();                   // Pops a free slot off the free list (grows the slab if it is empty)
+void fd_release(fd_t*);             // Pushes a closed slot back on the free list
+int fd_grow();                      // Adds a chunk of free slots to the slab (-1 if it is at its largest)
+void fd_reset();                    // Closes every fd and frees the open files (mkssfs)
+int file_hash(int, int);            // Bucket of the open file of an inode in a shadow root
+void open_file(fd_t*, inode_t, int, int); // Puts a fd on the open file of an inode (created if it has no fd yet)
+void unhash_file(file_t*);          // Takes an open file out of files
+file_t *close_file(fd_t*);          // Takes a fd off its file. Returns the file if it was the last one (to free)
+file_t *detach_file(int, int);      // Takes an open file and all its fds out of the tables (NULL: not open)
+void free_file(file_t*);            // Frees a detached file and its fds (after a grace period)
 int get_free_inode();               // Gets a free inode (according to some strategy)
 int get_inode_id(char*, super_block_t*);// Retrieves the ID of the inode of the file
 
 int virt_addr_to_bytes(virt_addr_t);// Converts a virtual address it's bytes number
 virt_addr_t bytes_to_virt_addr(int);// Converts a byte number to a virtual address
 b_ptr_t get_block_id(inode_t*, int);// Safe conversion of pointer index to block pointer
+b_ptr_t take_unused_block(fbm_t*, int);// Gets an unused block from an in-memory FBM and marks it used
+b_ptr_t take_free(fbm_t*, int, int, int, int*); // take_unused_block within a range of blocks, without checkpointing (meta_lock held)
+b_ptr_t alloc_block(fbm_t*, b_ptr_t, int, int); // take_unused_block for the calls that run in parallel: locks the group it uses
+int lock_group(int, int);           // Locks an allocation group unless the thread holds it (0 if busy and not waiting)
+void unlock_group(int);             // Unlocks one
+void lock_groups();                 // Locks all of them (in order): the whole FBM
+void unlock_groups();               // Unlocks the groups the thread holds
+void log_groups(b_ptr_t, fbm_t*);   // Logs the segments of an FBM copy that belong to the groups the thread holds
+void count_free();                  // Recounts the free blocks of every group from the current FBM (mount)
+int home_group(file_t*, b_ptr_t);   // Group a file's next block should come from
+int is_writable(fbm_t*, b_ptr_t, super_block_t*); // Was the block born since the last commit?
+int next_epoch(super_block_t*, fbm_t*); // Makes every block in use read-only (returns 1 if the FBM changed)
+void read_super(super_block_t*);    // Reads the current superblock
+void write_super(super_block_t*);   // Logs the changes made to the superblock
+void flush_super();                 // Checksums the current superblock and writes it to the other slot
+int pick_super(super_block_t*);     // Finds the newest valid superblock slot (mount)
+int cow_block(file_t*, int, b_ptr_t, int, char*, int, cow_batch_t*, fbm_t*, super_block_t*); // Copy on write of one block
+void cow_flush(file_t*, cow_batch_t*, super_block_t*); // Writes the pending pointer and FBM updates of a CoW run
+void free_replaced(b_ptr_t*, int, super_block_t*); // Frees the writable blocks a write moved its data away from
+void update_root(inode_t*);         // Writes the in-memory j-node back to the current root
+int load_snap_table(super_block_t*);// Fills the snapshot table lookup cache by walking the chain
+int get_snapshot(int, snap_entry_t*);// Retrieves a committed shadow root
+int set_snapshot_state(int, int);   // Updates the state of a committed shadow root
+int swap_root(super_block_t*, int); // Exchanges the current root with the root of a branch entry
+int inode_blocks(inode_t*, b_ptr_t*);// Lists every block of a file (data blocks and pointer file)
+int walk_root(inode_t*, int, int, void (*)(b_ptr_t, void*), void*); // Visits the blocks of a range of inodes (-1: corrupt)
+void visit_ref(b_ptr_t, void*);     // Adds *(int*)arg to the reference count of a block
+void visit_mark(b_ptr_t, void*);    // Sets the block's entry in the char array arg
+void visit_own(b_ptr_t, void*);     // Counts the writable roots using a block in the char array arg
+void visit_live(b_ptr_t, void*);    // Marks the blocks of the current root in the char array arg (see sweep_blocks)
+void ref_live(b_ptr_t, int, super_block_t*); // A block joins (1) or leaves (0) the current root: updates refcnt
+int swap_counts(inode_t*, inode_t*, super_block_t*); // Queues the count changes of a root swap for reclaim_step
+int reconcile_step(super_block_t*); // Walks a batch of the oldest queued root swap (-1: the root is corrupt)
+void log_refcnt(super_block_t*);    // Logs the reference counts changed in memory
+void reload_refcnt(super_block_t*); // Drops them: back to the logged counts
+int reclaim_step(super_block_t*);   // Does a bounded amount of reclamation work
+int sweep_blocks(super_block_t*);   // Frees the blocks released by deleted shadow roots (-1: a root is corrupt)
+dir_entry_t *load_dir(inode_t*);    // Reads the root dir of a (shadow) root (one entry per inode)
+int diff_roots(inode_t*, inode_t*, ssfs_diff_cb, void*); // Diffs two j-nodes (see ssfs_snapshot_diff)
+int send_cb(int, const char*, int, int, void*); // Turns diff results into stream records
+int send_record(int, stream_record_t*, char*); // Checksums and writes a stream record
+void pack_header(stream_header_t*, char*); // Stream header as it is sent (sets its crc)
+int unpack_header(char*, stream_header_t*); // Reads one back (-1: not a stream this disk can take)
+void pack_record(stream_record_t*, char*); // Stream record as it is sent (crc as it is)
+void unpack_record(char*, stream_record_t*); // Reads one back
+void put32(char*, uint32_t);        // Stores a 32-bit value little-endian
+uint32_t get32(char*);              // Loads one
+int root_fingerprint(inode_t*, uint32_t*); // Checksum of the files of a root: names, sizes and data
+int snapshot_fingerprint(int, uint32_t*); // Same for shadow root cnum (takes the commit barrier)
+int receive_apply(int, stream_header_t*); // Reads, checks and applies the records of a stream, one at a time
+int receive_clear();                // Removes every file of the current root (full stream)
+int receive_file(char*, int);       // Opens the file of a REC_FILE record, cut to its size
+int write_full(int, void*, int);    // write() that retries short writes
+int read_full(int, void*, int);     // read() that retries short reads
+uint32_t crc32c(uint32_t, const void*, int); // Extends a CRC32C with more data
+void crc32c_init();                 // Table (and hardware check) of crc32c, once
+int read_logged(b_ptr_t, int, void*); // read_blocks that sees the logged metadata not checkpointed yet
+int read_data(b_ptr_t, char*);      // Reads a block of file data (never logged) without a lock
+char *log_image(b_ptr_t);           // Newest image of a logged block (loads the home copy first)
+void log_block(b_ptr_t, void*);     // Logs the bytes of a metadata block that changed (instead of writing it)
+int log_append(b_ptr_t, int, char*, int); // Appends a record to the in-memory log (-1 if full)
+void log_sync();                    // Writes the records of whole calls appended since the last sync (one atomic, sequential write)
+void log_checkpoint();              // Writes the logged blocks home and starts a new log generation
+void log_drop();                    // Forgets the logged images and records in memory (the disk keeps its own)
+int log_replay();                   // Applies the records of the current log generation (mount)
+int write_checked(b_ptr_t, int, void*); // write_blocks that also updates the checksums of the blocks
+void set_crc(b_ptr_t, char*);       // Records the checksum of a block's new content (logged by log_mark)
+void log_crcs();                    // Logs the checksum tables changed since the last sync point
+void crcs_home();                   // Same for a checkpoint: into the images that go home
+int take_crcs(int, uint32_t*);      // Copies a checksum table if it changed since the last copy (0 if not)
+int checksummed(b_ptr_t);           // Does the block have an entry in block_crc? (not self-checked ones)
+#ifdef CRC32C_HW
+uint32_t crc32c_hw(uint32_t, const void*, int); // crc32c with the CPU's CRC32 instructions
+int crc32c_hw_supported();          // Can crc32c_hw run on this CPU?
+#endif
+char *fsck_block(char*, b_ptr_t);   // Newest image of a block during ssfs_fsck (logged or home copy)
+int fsck_blocks(char*, inode_t*, b_ptr_t*, int*); // inode_blocks on the image that keeps going past bad pointers
+void *fsck_worker(void*);           // Runs one pass of ssfs_fsck on a share of the jobs or blocks
+int fsck_run(fsck_worker_t*, int, int); // Runs a pass on every thread and returns the problems they found
+int fsck_dir(char*, fsck_root_t*, fsck_job_t*); // Checks the root dir of a root against its inodes
+int get_root_inode(inode_t*, int, inode_t*); // Reads an inode of any (shadow) root
+int find_file(inode_t*, dir_entry_t*, const char*, inode_t*); // Looks a file up by name in a root
+int write_at(int, virt_addr_t*, char*, int); // Writes at the given pointer (moves it)
+int write_iov(int, virt_addr_t*, const struct iovec*, int); // Same, gathering the bytes from iovecs
+int read_at(inode_t*, virt_addr_t*, char*, int); // Reads a file at the given pointer (moves it)
+int read_iov(inode_t*, virt_addr_t*, const struct iovec*, int, int); // Same, scattering the bytes to iovecs (1: file may be logged)
+void iov_copy(iov_cursor_t*, char*, int, int); // Copies bytes between a block and the iovecs (moves the cursor)
+int iov_length(const struct iovec*, int);// Total length of an iovec array (-1 if invalid)
+char *pin_block(b_ptr_t);           // Pins a block in the block cache and returns its data
+void unpin_block(b_ptr_t);          // Releases a pin (drops the cached copy on the last one)
+void cache_update(b_ptr_t, char*);  // Keeps a pinned copy in sync with a block written to disk
+int map_blocks(inode_t*, int, int, b_ptr_t*); // Resolves a range of pointer indices at once
+void init_locks();                  // Initializes the locks without a static initializer (once)
+pthread_rwlock_t *lock_file(int, int); // Takes the commit barrier (shared) and a file's lock (NULL: bad fd)
+void unlock_file(pthread_rwlock_t*);// Releases what lock_file took
+int file_pread(int, char*, int, int); // ssfs_pread for callers holding the locks (takes itable_lock for the j-node)
+int file_pwrite(int, char*, int, int); // ssfs_pwrite for callers holding the locks (same)
+int read_begin();                   // Enters a lock-free read (returns the counter to give read_end)
+void read_end(int);                 // Leaves a lock-free read
+void wait_readers();                // Returns once the lock-free reads in progress are over (grace period)
+void publish_inode(file_t*);        // Makes the lock-free reads see the file's inode as it is now
+void reclaim_inodes(int);           // Frees the replaced inode copies (1: even if there are only a few)
+int read_lockless(int, int, const struct iovec*, int); // ssfs_pread/ssfs_fread without locking the file (-2: take the locks)
+void start_flusher();               // Starts the flusher thread (once)
+void *flusher(void*);               // Syncs the log, writes the logged blocks home and checkpoints, in the background
+void flush_step(int);               // One run of the flusher (forced: even with SSFS_FLUSH_MANUAL)
+void flush_at_exit();               // Syncs what the calls made since the last run of the flusher
+void wait_home_writes();            // Waits for the flusher's home writes in progress (none start without the commit barrier)
+void call_begin();                  // Start of a call that logs (commit barrier held shared)
+void call_end();                    // End of it, still holding the barrier: marks a sync point if no other call is open
+void call_done();                   // After call_end, without locks: syncs the call now or leaves it to the flusher
+void sync_to(int);                  // Waits until a sync point is on disk (called without any lock)
+void log_mark();                    // Ends the records of whole calls with a commit record (no call open)
+void throttle();                    // Slows down a writer as the log fills up (called without any lock)
+void time_after(struct timespec*, int); // Absolute CLOCK_REALTIME time some milliseconds from now
+void mkssfs_locked(int);            // The API calls of the same name, called with the commit barrier held
+int commit_locked();
+int snapshot_delete_locked(int);
+int snapshot_merge_locked(int, int);
+int compact_step(compact_t*);       // Compacts the shadow roots of one table block (returns the number merged)
+int fsck_locked(char*, int, int, int*);
+int restore_locked(int);
+int clone_locked(int);
+int checkout_locked(int);
+int fopen_at_locked(int, char*);
+int snapshot_diff_locked(int, int, ssfs_diff_cb, void*);
+int send_locked(int, int, int);
+int receive_locked(int, stream_header_t*);
+int fopen_locked(char*);
+int fclose_locked(int);
+int remove_locked(char*);
+int fread_view_locked(int, int, int, ssfs_view_t*);
 
 /**************************************************************************/
 
-fd_t *fdt[NUM_BLOCKS];              // File descriptor table
+fd_t *fd_chunks[FD_CHUNKS];         // File descriptor table: slab of fd_t, in chunks that never move
+int num_fd_chunks = 0;              // Chunks allocated so far
+uint64_t fd_free = (uint32_t) FD_NONE; // Free list of slots: head slot (low half) and a pop count against ABA
+file_t *files[FILE_BUCKETS];        // Open files, by hash of their shadow root and inode_id
+int root_gen = 0;                   // Bumped whenever the current root is swapped (restore)
+b_ptr_t super_slot = SUPER_BLOCK;   // Slot holding the newest superblock
+int super_seq = 0;                  // Sequence number of the newest superblock
+int snap_gen = 0;                   // Bumped whenever a shadow root is deleted
+char unwritten[NUM_BLOCKS];         // Blocks allocated but never written (their content is all 0s)
+int freed[NUM_BLOCKS];              // Sync point that frees each block on disk (> synced_seq: the disk still uses it)
+char *block_cache[NUM_BLOCKS];      // In-memory copies of the blocks pinned by read views
+int block_pins[NUM_BLOCKS];         // Number of views pinning each block
+b_ptr_t *snap_blocks = NULL;        // Blocks of the snapshot table, in chain order (lookup cache)
+int num_snap_blocks = 0;            // Number of blocks in snap_blocks
+int snap_blocks_cap = 0;            // Allocated size of snap_blocks
+unsigned short refcnt[NUM_BLOCKS];  // Number of live shadow roots referencing each block, minus sb->commits for the
+                                    // blocks of the current root: a commit references all of them without a walk.
+                                    // Root swaps leave their changes to reclaim_step (sb->reconcile).
+super_block_t *super_image = NULL;  // Current superblock (the slots are only written by checkpoints)
+char *log_cache[NUM_BLOCKS];        // Newest image of the blocks with log records (home copy is behind)
+char *log_buf = NULL;               // In-memory copy of the metadata log
+int log_used = 0;                   // Bytes of log_buf holding records of the current generation
+int log_synced = 0;                 // Bytes of log_buf already on disk
+// Calls share the log: a sync only goes up to the last point where none of them was half done. The
+// call that leaves no other one open ends the records so far with a commit record (log_mark), and
+// replay stops at the last commit record on disk.
+int calls_open = 0;                 // Calls between call_begin and call_end
+int log_quiet = 0;                  // Bytes of log_buf up to the last commit record (whole calls)
+int quiet_seq = 0;                  // Number of sync points marked so far
+int synced_seq = 0;                 // Last sync point on disk
+int quiet_wanted = 0;               // Sync point a sync_to waits for (new calls hold back until it is marked)
+__thread int call_seq;              // Sync point that covers the thread's last call
+uint32_t block_crc[NUM_BLOCKS];     // CRC32C of the content of every checksummed block (atomic: set_crc takes no lock)
+char crc_dirty[CRC_BLOCKS];         // Tables of block_crc changed since they were last logged (atomic too)
+char verified[NUM_BLOCKS];          // Blocks checked (or written) since mkssfs (atomic: reads set it unlocked)
+pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+uint32_t crc_table[256];            // crc32c without the CRC instruction
+int crc_hw = 0;                     // CPU has the CRC instruction (CRC32C_HW builds)
+int verify_mode = SSFS_VERIFY_DEFAULT; // SSFS_VERIFY_*
+
+// Lock order: commit_lock, dir_lock, file_locks, itable_lock, group locks, meta_lock, home_lock
+// (fdt_lock and files_lock are never held with another one). itable_lock and meta_lock are recursive:
+// writing a file writes the j-node, which may allocate, which logs. Group locks are taken in increasing
+// order; a thread holding one may only try the lower ones (see alloc_block).
+pthread_once_t locks_once = PTHREAD_ONCE_INIT;
+pthread_rwlock_t commit_lock = PTHREAD_RWLOCK_INITIALIZER; // Commit barrier: shadow root calls run alone, the others share it (not the lock-free reads)
+pthread_rwlock_t dir_lock = PTHREAD_RWLOCK_INITIALIZER;    // Root dir: lookups share it, creating or removing a file does not
+pthread_rwlock_t file_locks[FILE_LOCKS];   // Data of the files: reads share a lock, writes do not
+pthread_mutex_t fdt_lock = PTHREAD_MUTEX_INITIALIZER;      // Growing the fd slab
+pthread_mutex_t files_lock = PTHREAD_MUTEX_INITIALIZER;    // files, and the fds of every open file
+pthread_mutex_t itable_lock;        // j-node: inode table and current root
+group_t groups[ALLOC_GROUPS];       // FBM: allocating and freeing blocks, a segment at a time
+int next_group = 0;                 // Allocation group of the next thread that allocates
+__thread int thread_group = -1;     // Where a thread allocates when the file's group is busy (spreads the threads)
+__thread unsigned int held_groups;  // Allocation groups the thread has locked (bit g: group g)
+pthread_mutex_t meta_lock;          // Log, superblock and block cache
+int dir_gen = 0;                    // Bumped whenever a file is created or removed (under dir_lock)
+
+// Reads take no lock: they count themselves in readers[reader_gen & 1], use the inode copy the fd
+// has published and read the data blocks straight from the disk (data is never logged nor written
+// over). Writers publish a new copy; the old one is freed after a grace period (no read that could
+// still see it is left). Blocks are never freed under a read: removing the file, the overwrites that
+// move data and the sweep of deleted roots all wait for the grace period too.
+unsigned int reader_gen = 0;        // Flipped by wait_readers
+int readers[2];                     // Lock-free reads in progress, by reader_gen parity
+pthread_mutex_t grace_lock = PTHREAD_MUTEX_INITIALIZER;   // One grace period at a time
+pthread_mutex_t retire_lock = PTHREAD_MUTEX_INITIALIZER;  // retired
+inode_t *retired[RETIRE_BATCH];     // Published inode copies replaced since the last grace period
+int num_retired = 0;
+
+// With the flusher on, writes and opens leave their log records to the flusher: it syncs them every
+// FLUSH_INTERVAL ms (as one group), writes the logged blocks home in address order, and checkpoints.
+// It runs with the commit barrier held, between calls (if a stream of calls keeps it from getting
+// it, it only syncs the calls done so far). The calls that free blocks, and ssfs_fsync, still sync
+// right away.
+int flush_background = SSFS_FLUSH_DEFAULT; // ssfs_set_flush
+char dirty[NUM_BLOCKS];             // Logged blocks whose home copy is behind their image
+int reclaim_left = 0;               // Deleted shadow roots (or a sweep) may be waiting: the flusher reclaims them
+pthread_once_t flusher_once = PTHREAD_ONCE_INIT;
+pthread_mutex_t home_lock = PTHREAD_MUTEX_INITIALIZER;    // Home copies of logged blocks (after meta_lock)
+pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;   // flush_cond
+pthread_cond_t flush_cond = PTHREAD_COND_INITIALIZER;     // Wakes the flusher up early
+pthread_cond_t quiet_cond = PTHREAD_COND_INITIALIZER;     // A sync point was marked (with meta_lock)
 
 /**************************************************************************/
 
 int ssfs_commit() {
+   pthread_rwlock_wrlock(&commit_lock);            // Waits for the calls in progress, holds off new ones
+   int res = commit_locked();
+   pthread_rwlock_unlock(&commit_lock);
+   return res;
+}
+
+int commit_locked() {
    super_block_t *sb = calloc(BLOCK_SIZE, 1);
-   read_blocks(SUPER_BLOCK, 1, sb);
-   if(sb->current_root >= NUM_SHADOW_ROOTS) {
-      printf("[DEBUG|ssfs_commit] Max number of shadow roots exceeded. Aborting\n");
-      free(sb);
-      return -1;
-   }
+   read_super(sb);
 
-   wm_t *WM = calloc(BLOCK_SIZE, 1);
-   read_blocks(sb->wm_ptrs[sb->current_root], 1, WM);
-   fbm_t *FBM = calloc(BLOCK_SIZE, 1);
-   read_blocks(sb->fbm_ptrs[sb->current_root], 1, FBM);
-   
-   b_ptr_t new_WM_block = get_unused_block();
-   if(new_WM_block == -1) {
-      printf("[DEBUG|ssfs_commit] Block allocation for new WM block failed. Aborting\n");
+   // Everything below goes to the log as one sync: the superblock update is the commit point,
+   // a crash before it leaves the previous state intact. The reference counts stay as they are
+   // (see refcnt), and the FBM only changes for a new table block or when the epochs wrap.
+   fbm_t *FBM = malloc(BLOCK_SIZE);
+   read_logged(sb->fbm_ptr, 1, FBM);
+   b_ptr_t new_table_block = 0;                    // Only needed when the last table block is full
+   if(sb->num_roots % SNAPS_PER_BLOCK == 0) new_table_block = take_unused_block(FBM, BLOCK_OLD);
+   if(new_table_block == -1) {
+      printf("[DEBUG|ssfs_commit] Block allocation for new table block failed. Aborting\n");
+      free(sb);
+      free(FBM);
       return -1;
    }
-   FBM->mask[new_WM_block] = 0;
-   write_blocks(sb->fbm_ptrs[sb->current_root], 1, FBM);
 
-   b_ptr_t new_FBM_block = get_unused_block();
-   if(new_FBM_block == -1) {
-      printf("[DEBUG|ssfs_commit] Block allocation for new FBM block failed. Aborting\n");
-      return -1;
+   // Append the current root to the snapshot table (invisible until num_roots covers it)
+   snap_table_t *table = calloc(BLOCK_SIZE, 1);
+   if(new_table_block != 0) {                      // Chain a fresh table block
+      if(num_snap_blocks == 0) {
+         sb->snap_table = new_table_block;
+      } else {
+         read_logged(snap_blocks[num_snap_blocks-1], 1, table);
+         table->next = new_table_block;
+         log_block(snap_blocks[num_snap_blocks-1], table);
+         memset(table, 0, BLOCK_SIZE);
+      }
+      if(num_snap_blocks == snap_blocks_cap) {     // Grow the lookup cache
+         snap_blocks_cap = snap_blocks_cap == 0 ? 8 : 2*snap_blocks_cap;
+         snap_blocks = realloc(snap_blocks, snap_blocks_cap*sizeof(b_ptr_t));
+      }
+      snap_blocks[num_snap_blocks++] = new_table_block;
+   } else {
+      read_logged(snap_blocks[num_snap_blocks-1], 1, table);
    }
-   FBM->mask[new_FBM_block] = 0;
-   write_blocks(sb->fbm_ptrs[sb->current_root], 1, FBM);
-
-   sb->wm_ptrs[sb->current_root+1] = new_WM_block;
-   sb->fbm_ptrs[sb->current_root+1] = new_FBM_block;
+   snap_entry_t *entry = &table->entries[sb->num_roots % SNAPS_PER_BLOCK];
+   entry->root = sb->root;
+   entry->state = SNAP_LIVE;
+   entry->time = time(NULL);
+   log_block(snap_blocks[num_snap_blocks-1], table);
+   free(table);
 
-   // Procede to mark all currently used blocks as read-only
-   for(int i=0; i<BLOCK_SIZE; i++) {
-      if(FBM->mask[i] == 0) WM->mask[i] = 0; 
-   }
+   if(next_epoch(sb, FBM) || new_table_block != 0) log_block(sb->fbm_ptr, FBM); // Every block in use is now read-only
+   free(FBM);
+   sb->commits++;                                  // The new shadow root references the current root (see refcnt)
+   int num = sb->num_roots++;                      // Update number of shadow roots
+   write_super(sb);                                // Commit point
 
-   sb->roots[sb->current_root+1] = sb->roots[sb->current_root]; // Copy current root
-   sb->current_root++;              // Update current root number
-   write_blocks(sb->wm_ptrs[sb->current_root], 1, WM);   // Write new WM
-   write_blocks(sb->fbm_ptrs[sb->current_root], 1, FBM); // Write new FBM
-   write_blocks(SUPER_BLOCK, 1, sb);
-   
-   int num = sb->current_root-1;
+   if(!flush_background) reclaim_step(sb);         // Make progress on deleted shadow roots (else the flusher does)
+   log_sync();
    free(sb);
-   free(WM);
-   free(FBM);
    return num;
 }
 
-int ssfs_restore(int cnum) {
-   if(cnum < 0 || cnum > NUM_SHADOW_ROOTS) {
-      printf("[DEBUG|ssfs_restore] cnum is out of bounds... wtf are you trying to do?\n");
-      return -1;
-   }
+int ssfs_snapshot_delete(int cnum) {
+   pthread_rwlock_wrlock(&commit_lock);
+   int res = snapshot_delete_locked(cnum);
+   pthread_rwlock_unlock(&commit_lock);
+   return res;
+}
 
+int snapshot_delete_locked(int cnum) {
    super_block_t *sb = calloc(BLOCK_SIZE, 1);
-   read_blocks(SUPER_BLOCK, 1, sb);
-   if(sb->roots[cnum].size <= 0) {
-      printf("[DEBUG|ssfs_restore] This version does not exist yet.\n");
+   read_super(sb);
+   snap_entry_t entry;
+   if(cnum < 0 || cnum >= sb->num_roots || get_snapshot(cnum, &entry) == -1
+      || (entry.state != SNAP_LIVE && entry.state != SNAP_BRANCH) || cnum == sb->branch) {
+      printf("[DEBUG|ssfs_snapshot_delete] No such shadow root (or branch is checked out).\n");
       free(sb);
       return -1;
    }
-   sb->current_root = cnum;
-   write_blocks(SUPER_BLOCK, 1, sb);
-   fdt[0]->inode = sb->roots[sb->current_root];
-   ssfs_frseek(J_NODE, 0);
-   for(int i=0; i<sb->roots[sb->current_root].size/sizeof(inode_t); i++) {
-      inode_t *inode = malloc(sizeof(inode_t));
-      ssfs_fread(J_NODE, (char*)inode, sizeof(inode_t));
-      if(inode->size >= 0) {
-         for(int j=0; j<NUM_BLOCKS; j++) {
-            if(fdt[j] == NULL) continue;
-            if(fdt[j]->inode_id == i) {
-               fdt[j]->inode = *inode;
-            }
-         }
+   if(entry.state == SNAP_BRANCH) {                // Not referenced by refcnt: free its own blocks now
+      char *mark = calloc(NUM_BLOCKS, 1);
+      if(walk_root(&entry.root, -1, entry.root.size/sizeof(inode_t)+1, visit_mark, mark) == -1) { // +1: the j-node itself
+         printf("[DEBUG|ssfs_snapshot_delete] Branch is corrupt. Aborting\n");
+         free(mark);
+         free(sb);
+         return -1;
+      }
+      fbm_t *FBM = malloc(BLOCK_SIZE);
+      read_logged(sb->fbm_ptr, 1, FBM);
+      for(int i=0; i<NUM_BLOCKS; i++) {
+         if(mark[i] && FBM->mask[i] != sb->epoch) sb->sweep = 1; // Read-only blocks are left to the reclaim sweep
+         if(!mark[i] || FBM->mask[i] != sb->epoch) continue;
+         FBM->mask[i] = BLOCK_FREE;
+         unwritten[i] = 0;
+         freed[i] = quiet_seq+1;
       }
-      free(inode);
+      log_block(sb->fbm_ptr, FBM);
+      free(FBM);
+      free(mark);
+      set_snapshot_state(cnum, SNAP_RECLAIMED);
+      if(sb->sweep) {
+         write_super(sb);
+         reclaim_left = 1;
+      }
+      log_sync();
+      free(sb);
+      return 0;
    }
+   set_snapshot_state(cnum, SNAP_DELETED);         // Blocks are released later, a batch at a time
+   __atomic_fetch_add(&snap_gen, 1, __ATOMIC_RELEASE); // Read-only fds on it become invalid
+   if(!flush_background) reclaim_step(sb);
+   reclaim_left = 1;
+   log_sync();
    free(sb);
-   
    return 0;
 }
 
-void mkssfs(int fresh){
-   if(fresh == 1) {              // Fresh disk -> need to perform first time setup
-      if(init_fresh_disk("placeholder", BLOCK_SIZE, NUM_BLOCKS) == -1)
-         exit(-1);
+int ssfs_snapshot_merge(int first, int last) {
+   pthread_rwlock_wrlock(&commit_lock);
+   int res = snapshot_merge_locked(first, last);
+   pthread_rwlock_unlock(&commit_lock);
+   return res;
+}
 
-      // Creating superblock
-      super_block_t *sb = calloc(BLOCK_SIZE, 1);   // Allocate a block to hold the superblock (1)
+int snapshot_merge_locked(int first, int last) {
+   super_block_t *sb = calloc(BLOCK_SIZE, 1);
+   read_super(sb);
+   snap_entry_t entry;
+   if(first < 0 || first > last || last >= sb->num_roots || get_snapshot(last, &entry) == -1 || entry.state != SNAP_LIVE) {
+      printf("[DEBUG|ssfs_snapshot_merge] No such shadow root range.\n");
+      free(sb);
+      return -1;
+   }
+   free(sb);
 
-      sb->magic = MAGIC;
-      sb->block_size = BLOCK_SIZE;
-      sb->num_blocks = NUM_BLOCKS;
-      sb->num_inodes = 1;                          // We start with 1 i-node for the root dir
-      sb->roots[sb->current_root].size = sizeof(inode_t);     // Root is thus of size inode_t ??????
+   // Shadow roots are complete trees: merging into last only means dropping the ones before it.
+   // Reclamation is left to the flusher (or ssfs_reclaim and commits), a bounded step at a time.
+   int merged = 0;
+   snap_table_t *table = malloc(BLOCK_SIZE);
+   for(int i=first; i<last; ) {                    // One read and write per table block
+      int block = i/SNAPS_PER_BLOCK;
+      int end = (block+1)*SNAPS_PER_BLOCK < last ? (block+1)*SNAPS_PER_BLOCK : last;
+      read_logged(snap_blocks[block], 1, table);
+      for(; i<end; i++) {
+         snap_entry_t *e = &table->entries[i % SNAPS_PER_BLOCK];
+         if(e->state != SNAP_LIVE) continue;       // Branches are not versions of this line
+         e->state = SNAP_DELETED;
+         merged++;
+      }
+      log_block(snap_blocks[block], table);
+   }
+   free(table);
+   if(merged > 0) {
+      __atomic_fetch_add(&snap_gen, 1, __ATOMIC_RELEASE); // Read-only fds on them become invalid
+      reclaim_left = 1;
+   }
+   log_sync();
+   return merged;
+}
 
-      // Creating root dir inode and placing it in first i-node block
-      inode_block_t *ib = calloc(BLOCK_SIZE, 1);   // Allocate a block for the inodes         (4)
-      ib->inodes[0].d_ptrs[0] = DEFAULT_ROOT_DIR_BLOCK; // inode 0 now points to root dir
-//    ib->inodes[0].size = 0;                           // Not necessary (calloc)
-      write_blocks(DEFAULT_INODE_TABLE_BLOCK, 1, ib);   // Write inode table
+int ssfs_compact(time_t now, int age, int interval) {
+   if(age < 0 || interval <= 0) return -1;
+   compact_t run = { .now = now, .age = age, .interval = interval, .pos = 0, .first = -1, .bucket = 0 };
+   int merged = 0;
+   while(run.pos != -1) {                          // One table block per hold of the barrier: the other calls go on in between
+      pthread_rwlock_wrlock(&commit_lock);
+      merged += compact_step(&run);
+      pthread_rwlock_unlock(&commit_lock);
+   }
+   return merged;
+}
 
-      sb->roots[sb->current_root].d_ptrs[0] = DEFAULT_INODE_TABLE_BLOCK; // Point to first inode table block
+int compact_step(compact_t *run) {
+   super_block_t *sb = calloc(BLOCK_SIZE, 1);
+   read_super(sb);
+   int num_roots = sb->num_roots;
+   free(sb);
+   if(run->pos >= num_roots || run->pos/SNAPS_PER_BLOCK >= num_snap_blocks) {
+      run->pos = -1;
+      return 0;
+   }
 
-      // Write current root to fdt[0]. It's a special entry, so we don't care if id is 0
-      new_fdt_entry(sb->roots[sb->current_root], -1);         // Add root in FDT (at index 0)
+   // Every run of consecutive shadow roots older than age that share an interval is merged
+   // into its newest member. The table may have changed since the last step: states are read again.
+   int block = run->pos/SNAPS_PER_BLOCK;
+   int end = (block+1)*SNAPS_PER_BLOCK < num_roots ? (block+1)*SNAPS_PER_BLOCK : num_roots;
+   int merged = 0;
+   snap_entry_t kept;
+   snap_table_t *table = malloc(BLOCK_SIZE);
+   read_logged(snap_blocks[block], 1, table);
+   for(; run->pos < end; run->pos++) {
+      snap_entry_t *e = &table->entries[run->pos % SNAPS_PER_BLOCK];
+      if(e->state != SNAP_LIVE) continue;
+      if(e->time > run->now - run->age) {          // Too recent, and so are the next ones
+         run->pos = -1;
+         break;
+      }
+      if(run->first != -1 && e->time/run->interval == run->bucket) {
+         if(run->first/SNAPS_PER_BLOCK == block) {
+            table->entries[run->first % SNAPS_PER_BLOCK].state = SNAP_DELETED;
+            merged++;
+         } else if(get_snapshot(run->first, &kept) == 0 && kept.state == SNAP_LIVE) { // Deleted by another call meanwhile?
+            set_snapshot_state(run->first, SNAP_DELETED);
+            merged++;
+         }
+      } else {
+         run->bucket = e->time/run->interval;
+      }
+      run->first = run->pos;
+   }
+   if(run->pos >= num_roots) run->pos = -1;
+   if(merged > 0) {                                // Reclamation is left to the flusher, like a merge
+      log_block(snap_blocks[block], table);
+      __atomic_fetch_add(&snap_gen, 1, __ATOMIC_RELEASE); // Read-only fds on them become invalid
+      reclaim_left = 1;
+      log_sync();
+   }
+   free(table);
+   return merged;
+}
 
-      new_fdt_entry(ib->inodes[0], 0);             // Add root dir in FDT (at index 1)
-      free(ib);                                    // Free                                    (4)
+int ssfs_reclaim() {
+   pthread_rwlock_wrlock(&commit_lock);
+   super_block_t *sb = calloc(BLOCK_SIZE, 1);
+   read_super(sb);
+   int res = reclaim_step(sb);
+   log_sync();
+   free(sb);
+   pthread_rwlock_unlock(&commit_lock);
+   return res;
+}
 
-      sb->wm_ptrs[sb->current_root] = DEFAULT_WM_BLOCK;
-      sb->fbm_ptrs[sb->current_root] = DEFAULT_FBM_BLOCK;
+int ssfs_set_flush(int background) {
+   pthread_rwlock_wrlock(&commit_lock);            // Between calls
+   int old = flush_background;
+   __atomic_store_n(&flush_background, background == SSFS_FLUSH_MANUAL ? SSFS_FLUSH_MANUAL : background != 0, __ATOMIC_RELAXED);
+   if(!flush_background && super_image != NULL) log_sync(); // Nothing is left for the flusher
+   wait_home_writes();
+   pthread_rwlock_unlock(&commit_lock);
+   if(flush_background == SSFS_FLUSH_BACKGROUND) pthread_once(&flusher_once, start_flusher);
+   return old;
+}
 
-      write_blocks(SUPER_BLOCK, 1, sb);            // Write the superblock
-      free(sb);                                    // Free                                    (1)
+int ssfs_flush() {
+   if(!flush_background) return -1;                // Calls sync themselves
+   flush_step(1);
+   return 0;
+}
 
-      // Create FBM
-      fbm_t *FBM = calloc(BLOCK_SIZE, 1);          // Allocate a whole block for the FBM      (2)
+int ssfs_fsync(int fileID) {
+   pthread_rwlock_t *lock = lock_file(fileID, 0);
+   if(lock == NULL) return -1;
+   int seq = fd_at(fileID)->file->seq;             // Writes to it hold the lock exclusively
+   unlock_file(lock);
+   sync_to(seq);                                   // The blocks written home later are not needed
+   return 0;
+}
 
-      memset(FBM->mask, 1, NUM_BLOCKS);            // Set the whole FBM to 1
-      FBM->mask[SUPER_BLOCK] = 0;
-      FBM->mask[DEFAULT_FBM_BLOCK] = 0;
-      FBM->mask[DEFAULT_WM_BLOCK] = 0;             // This is not yet used, but will be shortly!
-      FBM->mask[DEFAULT_INODE_TABLE_BLOCK] = 0;
-      FBM->mask[DEFAULT_ROOT_DIR_BLOCK] = 0;
+int ssfs_set_verify(int mode) {
+   if(mode < SSFS_VERIFY_ALWAYS || mode > SSFS_VERIFY_SCRUB) return -1;
+   return __atomic_exchange_n(&verify_mode, mode, __ATOMIC_RELAXED); // Calls may be reading it
+}
 
-      write_blocks(DEFAULT_FBM_BLOCK, 1, FBM);     // Write the FBM
-      free(FBM);                                   // Free                                    (2)
+int ssfs_scrub() {
+   pthread_rwlock_wrlock(&commit_lock);
+   super_block_t *sb = calloc(BLOCK_SIZE, 1);
+   read_super(sb);
+   fbm_t *FBM = malloc(BLOCK_SIZE);
+   read_logged(sb->fbm_ptr, 1, FBM);
+   free(sb);
 
-      // Create WM
-      wm_t *WM = calloc(BLOCK_SIZE, 1);            // Allocate a whole block for the WM       (3)
+   int bad = 0;
+   char *block = malloc(BLOCK_SIZE);
+   for(int i=0; i<NUM_BLOCKS; i++) {            // Blocks in the log are checked when they go home
+      if(FBM->mask[i] == BLOCK_FREE || unwritten[i] || log_cache[i] != NULL || !checksummed(i)) continue;
+      read_blocks(i, 1, block);
+      if(crc32c(0, block, BLOCK_SIZE) != block_crc[i]) {
+         printf("[DEBUG|ssfs_scrub] Block %d does not match its checksum.\n", i);
+         bad++;
+         continue;
+      }
+      __atomic_store_n(&verified[i], 1, __ATOMIC_RELAXED);
+   }
+   free(block);
+   free(FBM);
+   pthread_rwlock_unlock(&commit_lock);
+   return bad;
+}
 
-      memset(WM->mask, 1, NUM_BLOCKS);             // Set the whole WM to 1
-//    WM->mask[DEFAULT_ROOT_DIR_BLOCK] = 0;        // Set the root dir to be read-only
+int ssfs_fsck(char *image, int repair, int threads, int *repaired) {
+   pthread_once(&locks_once, init_locks);          // Can be called without mkssfs
+   pthread_rwlock_wrlock(&commit_lock);
+   if(super_image != NULL) log_sync();             // The image has to hold the calls made so far
+   wait_home_writes();
+   int res = fsck_locked(image, repair, threads, repaired);
+   pthread_rwlock_unlock(&commit_lock);
+   return res;
+}
 
-      write_blocks(DEFAULT_WM_BLOCK, 1, WM);       // Write the WM
-      free(WM);                                    // Free                                    (3)
-   } else {                      // Else assume it's already setup
-      if(init_disk("placeholder", BLOCK_SIZE, NUM_BLOCKS) == -1)
-         exit(-1);
+int fsck_locked(char *image, int repair, int threads, int *repaired) {
+   if(repaired != NULL) *repaired = 0;
+   if(image == NULL || init_disk(image, BLOCK_SIZE, NUM_BLOCKS) == -1) return -1;
+   if(threads <= 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+   if(threads <= 0) threads = 1;
 
-      super_block_t *sb = calloc(BLOCK_SIZE, 1);                                             //2
-      read_blocks(SUPER_BLOCK, 1, sb);
+   // Offline: whatever was mounted before is dropped (mkssfs has to be called again)
+   num_snap_blocks = 0;
+   reclaim_left = 0;                            // Nor is there anything for the flusher to reclaim
+   memset(verified, 0, NUM_BLOCKS);
+   if(super_image == NULL) super_image = calloc(BLOCK_SIZE, 1);
+   if(log_buf == NULL) log_buf = calloc(LOG_BLOCKS, BLOCK_SIZE);
+   log_drop();                                  // The synced log has them
 
-      // Write current root to fdt[0]. It's a special entry, so we don't care if id is 0
-      new_fdt_entry(sb->roots[sb->current_root], -1);  // Add root in FDT (at index 0)
+   super_block_t *sb = calloc(BLOCK_SIZE, 1);                                                //1
+   if(pick_super(sb) == -1) {
+      printf("[DEBUG|ssfs_fsck] No valid superblock. Aborting\n");
+      free(sb);                                                                              //1
+      log_drop();
+      close_disk();
+      return -1;
+   }
+   memcpy(super_image, sb, BLOCK_SIZE);
+   log_replay();                                // Metadata as a mount would see it (in memory only)
+   read_super(sb);
+   if(sb->block_size != BLOCK_SIZE || sb->num_blocks != NUM_BLOCKS || sb->num_roots < 0 || sb->root.size < 0
+      || sb->fbm_ptr <= 0 || sb->fbm_ptr > NUM_BLOCKS-1 || sb->snap_table < 0 || sb->snap_table > NUM_BLOCKS-1
+      || sb->refcnt_ptr <= 0 || sb->refcnt_ptr + REFCNT_BLOCKS > NUM_BLOCKS
+      || sb->log_ptr <= 0 || sb->log_ptr + LOG_BLOCKS > NUM_BLOCKS || sb->crc_ptr <= 0 || sb->crc_ptr + CRC_BLOCKS > NUM_BLOCKS
+      || sb->epoch < FIRST_EPOCH || sb->epoch > LAST_EPOCH || sb->branch < -1 || sb->branch >= sb->num_roots
+      || sb->reclaim_cnum < -1 || sb->reclaim_cnum >= sb->num_roots
+      || sb->num_reconcile < 0 || sb->num_reconcile > RECONCILE_SLOTS) {
+      printf("[DEBUG|ssfs_fsck] Superblock does not describe this disk. Aborting\n");
+      free(sb);                                                                              //1
+      log_drop();
+      close_disk();
+      return -1;
+   }
 
-      // Retrieve root dir inode
-      inode_t *root_dir_inode = calloc(sizeof(inode_t), 1);                                  //1
-      ssfs_frseek(J_NODE, 0);
-      ssfs_fread(J_NODE, (char*) root_dir_inode, sizeof(inode_t));
+   // Every block is read once, up front: the threads only look at memory
+   char *disk = malloc(NUM_BLOCKS*BLOCK_SIZE);                                                //2
+   read_blocks(0, NUM_BLOCKS, disk);
+   for(int i=0; i<CRC_BLOCKS; i++)
+      memcpy((char*) block_crc + i*BLOCK_SIZE, fsck_block(disk, sb->crc_ptr+i), BLOCK_SIZE);
 
-      new_fdt_entry(*root_dir_inode, 0);           // Add root dir in FDT (at index 1)
-      free(root_dir_inode);                                                                  //1
-      free(sb);                                                                              //2
-   }
-}
+   int problems = 0;
+   int incomplete = 0;                          // Some references are unknown: nothing gets freed
+   char *meta = calloc(NUM_BLOCKS, 1);          // Blocks of the file system itself                  //3
+   meta[SUPER_BLOCK] = 1;
+   meta[SUPER_BLOCK_B] = 1;
+   meta[sb->fbm_ptr] = 1;
+   for(int i=0; i<REFCNT_BLOCKS; i++) meta[sb->refcnt_ptr+i] = 1;
+   for(int i=0; i<LOG_BLOCKS; i++) meta[sb->log_ptr+i] = 1;
+   for(int i=0; i<CRC_BLOCKS; i++) meta[sb->crc_ptr+i] = 1;
 
-int ssfs_fopen(char *name){
-   if(name == NULL) return -1;
+   // Roots: the current one, then every shadow root and branch not reclaimed yet
+   fsck_root_t *roots = calloc(sb->num_roots+1+RECONCILE_SLOTS, sizeof(fsck_root_t));         //4
+   int num_roots = 1;
+   roots[0].root = sb->root;
+   roots[0].cnum = -1;
+   roots[0].writable = 1;
+   int cnum = 0;
+   for(b_ptr_t block = sb->snap_table; block != 0 && cnum < sb->num_roots; ) {
+      if(block < 0 || block > NUM_BLOCKS-1 || meta[block]) {
+         printf("[DEBUG|ssfs_fsck] Snapshot table block %d is out of range or used twice.\n", block);
+         problems++;
+         break;
+      }
+      meta[block] = 1;
+      snap_table_t *table = (snap_table_t*) fsck_block(disk, block);
+      for(int i=0; i<SNAPS_PER_BLOCK && cnum < sb->num_roots; i++, cnum++) {
+         snap_entry_t *entry = &table->entries[i];
+         if(entry->state == SNAP_RECLAIMED) continue;
+         if(entry->state < SNAP_LIVE || entry->state > SNAP_BRANCH) {
+            printf("[DEBUG|ssfs_fsck] Shadow root %d has an unknown state (%d).\n", cnum, entry->state);
+            problems++;
+            incomplete = 1;
+            continue;
+         }
+         fsck_root_t *root = &roots[num_roots++];
+         root->root = entry->root;
+         root->cnum = cnum;
+         root->writable = entry->state == SNAP_BRANCH;
+         root->counted = -1;                    // Live and deleted shadow roots are in refcnt...
+         root->weight = 1;
+         if(entry->state == SNAP_BRANCH) root->counted = entry->root.size/sizeof(inode_t);
+         if(entry->state == SNAP_DELETED && cnum == sb->reclaim_cnum) root->counted = sb->reclaim_pos; // ...until released
+      }
+      block = table->next;
+   }
+   if(cnum < sb->num_roots) {
+      printf("[DEBUG|ssfs_fsck] Snapshot table is missing shadow roots %d to %d.\n", cnum, sb->num_roots-1);
+      problems++;
+      incomplete = 1;
+   }
+   roots[0].counted = -1;                       // So is the current root, once per commit made before it got a block
+   roots[0].weight = -sb->commits;
+   for(int i=0; i<sb->num_reconcile; i++) {     // Root swaps: refcnt lacks what their walks did not reach yet
+      fsck_root_t *root = &roots[num_roots++];
+      root->root = sb->reconcile[i].root;
+      root->cnum = -2;
+      root->counted = sb->reconcile[i].pos;
+      root->weight = -sb->reconcile[i].delta;
+   }
 
-   inode_t *inode = calloc(sizeof(inode_t), 1);    // Initialize an inode                     (7)
-   super_block_t *sb = malloc(BLOCK_SIZE);         // malloc                                  (5)
-   read_blocks(SUPER_BLOCK, 1, sb);                // Retrieve super block
+   // Inode table blocks of every root. Shadow roots share most of them: each one is a single job.
+   int *job_of = malloc(NUM_BLOCKS*sizeof(int));                                              //5
+   for(int i=0; i<NUM_BLOCKS; i++) job_of[i] = -1;
+   fsck_job_t *jobs = calloc(NUM_BLOCKS, sizeof(fsck_job_t));                                 //6
+   int num_jobs = 0;
+   int inodes_per_block = BLOCK_SIZE/sizeof(inode_t);
+   for(int r=0; r<num_roots; r++) {
+      fsck_root_t *root = &roots[r];
+      int bad = 0;
+      root->blocks = malloc((MAX_FILE_BLOCKS+1)*sizeof(b_ptr_t));
+      root->num_blocks = fsck_blocks(disk, &root->root, root->blocks, &bad);
+      if(root->root.size < 0 || root->root.size % sizeof(inode_t) != 0) bad++;
+      if(bad > 0) {
+         printf("[DEBUG|ssfs_fsck] Root %d: j-node has a bad size or %d bad pointer(s).\n", root->cnum, bad);
+         problems++;
+         incomplete = 1;
+      }
+      root->num_tables = root->root.size <= 0 ? 0 : (root->root.size + BLOCK_SIZE-1)/BLOCK_SIZE;
+      if(root->num_tables > MAX_FILE_BLOCKS) root->num_tables = MAX_FILE_BLOCKS;
+      root->jobs = malloc((root->num_tables+1)*sizeof(int));
+      int num_inodes = root->root.size/sizeof(inode_t);
+      for(int t=0; t<root->num_tables; t++) {
+         b_ptr_t block = root->blocks[t];
+         root->jobs[t] = block == 0 ? -1 : job_of[block];
+         if(block == 0) continue;
+         if(job_of[block] == -1) {
+            fsck_job_t *job = &jobs[num_jobs];
+            job->block = block;
+            job->first_id = t*inodes_per_block;
+            job->blocks = malloc(inodes_per_block*(MAX_FILE_BLOCKS+1)*sizeof(b_ptr_t));
+            root->jobs[t] = job_of[block] = num_jobs++;
+         }
+         int limit = num_inodes - t*inodes_per_block < inodes_per_block ? num_inodes - t*inodes_per_block : inodes_per_block;
+         if(jobs[root->jobs[t]].limit < limit) jobs[root->jobs[t]].limit = limit;
+      }
+   }
 
-   int inode_id = get_inode_id(name, sb);          // Check if file exists
+   // First pass, in parallel: inodes of every table block
+   fsck_worker_t *workers = calloc(threads, sizeof(fsck_worker_t));                           //7
+   for(int i=0; i<threads; i++) {
+      workers[i].disk = disk;
+      workers[i].jobs = jobs;
+      workers[i].num_jobs = num_jobs;
+      workers[i].first = i;
+      workers[i].stride = threads;
+   }
+   fsck_run(workers, threads, 0);
+   for(int j=0; j<num_jobs; j++) {
+      problems += jobs[j].problems;
+      for(int k=0; k<jobs[j].limit; k++) if(jobs[j].status[k] == FSCK_BAD) incomplete = 1;
+   }
 
-   if(inode_id == -1) {                            // If file does not exist
-      if(get_unused_block() == -1) {               // Check if there is still room
-         printf("[DEBUG|ssfs_fopen] No more free blocks. Aborting\n");
-         free(sb);                                 // Free                                    (5)
-         free(inode);                              // Free                                    (7)
-         return -1;
+   // References of every root, one root at a time
+   unsigned short *uses = malloc(NUM_BLOCKS*sizeof(unsigned short));                          //8
+   unsigned short *expected = calloc(NUM_BLOCKS, sizeof(unsigned short)); // refcnt as it should be   //9
+   char *referenced = calloc(NUM_BLOCKS, 1);    // By any root                                       //10
+   char *committed = calloc(NUM_BLOCKS, 1);     // By a shadow root: never writable again            //11
+   char *owners = calloc(NUM_BLOCKS, 1);        // Number of writable roots using it (2: several)    //12
+   char *twice = calloc(NUM_BLOCKS, 1);         // Used twice by the same root                       //13
+   int *dir_checked = calloc(NUM_BLOCKS, sizeof(int)); // Root dirs already checked (by first table block) //14
+   for(int r=0; r<num_roots; r++) {
+      fsck_root_t *root = &roots[r];
+      int num_inodes = root->root.size/sizeof(inode_t);
+      memset(uses, 0, NUM_BLOCKS*sizeof(unsigned short));
+      for(int i=0; i<root->num_blocks; i++) {   // Position -1: the j-node itself
+         if(root->blocks[i] == 0) continue;
+         uses[root->blocks[i]]++;
+         if(root->counted == -1) expected[root->blocks[i]] += root->weight;
       }
-      
-      inode_id = get_free_inode();                 // Creating a dir entry and an inode. Not allocating any blocks yet
-      if(inode_id == -1)                           // Means inode is appended at the end
-         inode_id = sb->num_inodes;
+      for(int id=0; id<num_inodes && id/inodes_per_block < root->num_tables; id++) {
+         if(root->jobs[id/inodes_per_block] == -1) continue;
+         fsck_job_t *job = &jobs[root->jobs[id/inodes_per_block]];
+         b_ptr_t *blocks = job->blocks + (id % inodes_per_block)*(MAX_FILE_BLOCKS+1);
+         for(int i=0; i<job->counts[id % inodes_per_block]; i++) {
+            if(blocks[i] == 0) continue;
+            uses[blocks[i]]++;
+            if(id >= root->counted) expected[blocks[i]] += root->weight;
+         }
+      }
+      if(root->num_tables > 0 && root->jobs[0] != -1 && dir_checked[root->blocks[0]] != num_inodes+1) {
+         problems += fsck_dir(disk, root, jobs);
+         dir_checked[root->blocks[0]] = num_inodes+1;
+      }
+      for(int i=0; i<NUM_BLOCKS; i++) {
+         if(uses[i] == 0) continue;
+         referenced[i] = 1;
+         if(root->writable && owners[i] < 2) owners[i]++;
+         if(!root->writable) committed[i] = 1;
+         if(meta[i]) {
+            printf("[DEBUG|ssfs_fsck] Root %d: block %d belongs to the file system metadata.\n", root->cnum, i);
+            problems++;
+         }
+         if(uses[i] > 1 && !twice[i]) {
+            printf("[DEBUG|ssfs_fsck] Root %d: block %d is used %d times.\n", root->cnum, i, uses[i]);
+            problems++;
+            twice[i] = 1;
+         }
+      }
+   }
 
-      sb->roots[sb->current_root].size += sizeof(inode_t);    //
-      if(ssfs_fwseek(J_NODE, inode_id*sizeof(inode_t)) < 0) return -1;
-      if(ssfs_fwrite(J_NODE, (char*) inode, sizeof(inode_t)) <= 0) return -1;// Write inode to appropriate block
-      sb->num_inodes++;                            // Update inode count
+   // Second pass, in parallel: checksums of every block in use (bad ones end up as 2 in check)
+   char *check = calloc(NUM_BLOCKS, 1);                                                       //15
+   for(int i=0; i<NUM_BLOCKS; i++)
+      check[i] = (meta[i] || referenced[i]) && checksummed(i);
+   for(int i=0; i<threads; i++) workers[i].check = check;
+   problems += fsck_run(workers, threads, 1);
 
-      dir_entry_t *entry = calloc(DIR_ENTRY_SIZE, 1);// Calloc                               (18)
-      entry->inode_id = inode_id;
-      strcpy(entry->filename, name);
-      ssfs_fwseek(ROOT_DIR, (inode_id-1)*DIR_ENTRY_SIZE); // Seek to appropriate dir entry
-      ssfs_fwrite(ROOT_DIR, (char*) entry, DIR_ENTRY_SIZE);
-      free(entry);                                 // Free                                   (18)
-   } else {                                        // If file exists
-      ssfs_frseek(J_NODE, inode_id*sizeof(inode_t));
-      ssfs_fread(J_NODE, (char*) inode, sizeof(inode_t));
+   // Allocation state against the references
+   fbm_t *FBM = malloc(BLOCK_SIZE);                                                          //16
+   memcpy(FBM, fsck_block(disk, sb->fbm_ptr), BLOCK_SIZE);
+   unsigned short *counts = malloc(REFCNT_BLOCKS*BLOCK_SIZE);                                 //17
+   for(int i=0; i<REFCNT_BLOCKS; i++)
+      memcpy((char*) counts + i*BLOCK_SIZE, fsck_block(disk, sb->refcnt_ptr+i), BLOCK_SIZE);
+   int fixed = 0;
+   for(int i=0; i<NUM_BLOCKS; i++) {
+      unsigned char mask = FBM->mask[i];
+      if(mask > sb->epoch) {                    // Born in an epoch that did not start yet
+         printf("[DEBUG|ssfs_fsck] Block %d has an unknown birth epoch (%d).\n", i, mask);
+         problems++;
+         fixed++;
+         mask = BLOCK_OLD;
+      }
+      if((meta[i] || referenced[i]) && mask == BLOCK_FREE) {
+         printf("[DEBUG|ssfs_fsck] Block %d is in use but free in the FBM.\n", i);
+         problems++;
+         fixed++;
+         mask = BLOCK_OLD;                      // Read-only: copy-on-write gives every user its own copy
+      } else if(mask == sb->epoch && (committed[i] || owners[i] > 1)) {
+         printf("[DEBUG|ssfs_fsck] Block %d is writable but shared with another root.\n", i);
+         problems++;
+         fixed++;
+         mask = BLOCK_OLD;
+      } else if(mask == sb->epoch && twice[i]) {
+         fixed++;                               // Reported above
+         mask = BLOCK_OLD;
+      } else if(!meta[i] && !referenced[i] && mask != BLOCK_FREE) {
+         printf("[DEBUG|ssfs_fsck] Block %d is allocated but nothing uses it.\n", i);
+         problems++;
+         if(!incomplete) {
+            fixed++;
+            mask = BLOCK_FREE;
+         }
+      }
+      FBM->mask[i] = mask;
+      if(counts[i] != expected[i]) {
+         printf("[DEBUG|ssfs_fsck] Block %d has a reference count of %d instead of %d.\n", i, counts[i], expected[i]);
+         problems++;
+         if(!incomplete) {
+            fixed++;
+            counts[i] = expected[i];
+         }
+      }
    }
-   int fd = new_fdt_entry(*inode, inode_id);       // Create FDT entry
-   write_blocks(SUPER_BLOCK, 1, sb);
-   free(sb);                                       // Free                                    (5)
-   free(inode);                                    // Free                                    (7)
 
-   return fd;
+   if(check[sb->fbm_ptr] == 2) fixed++;         // Rewritten below with the right checksum
+   for(int i=0; i<REFCNT_BLOCKS; i++) if(check[sb->refcnt_ptr+i] == 2) fixed++;
+   if(repair && fixed > 0) {                    // Through the log, so the checksums follow
+      log_block(sb->fbm_ptr, FBM);
+      for(int i=0; i<REFCNT_BLOCKS; i++)
+         log_block(sb->refcnt_ptr+i, (char*) counts + i*BLOCK_SIZE);
+      log_checkpoint();                         // Replayed records go home too
+      if(repaired != NULL) *repaired = fixed;
+   }
+
+   for(int j=0; j<num_jobs; j++) free(jobs[j].blocks);
+   for(int r=0; r<num_roots; r++) {
+      free(roots[r].blocks);
+      free(roots[r].jobs);
+   }
+   free(counts);                                                                              //17
+   free(FBM);                                                                                 //16
+   free(check);                                                                               //15
+   free(dir_checked);                                                                         //14
+   free(twice);                                                                               //13
+   free(owners);                                                                              //12
+   free(committed);                                                                           //11
+   free(referenced);                                                                          //10
+   free(expected);                                                                            //9
+   free(uses);                                                                                //8
+   free(workers);                                                                             //7
+   free(jobs);                                                                                //6
+   free(job_of);                                                                              //5
+   free(roots);                                                                               //4
+   free(meta);                                                                                //3
+   free(disk);                                                                                //2
+   free(sb);                                                                                  //1
+   log_drop();                                  // Nothing of the image is left for the flusher to write
+   close_disk();
+   return problems;
 }
 
-int ssfs_fclose(int fileID){
-   if(fileID == J_NODE || fileID == ROOT_DIR || fileID < 0 || fileID > NUM_BLOCKS || fdt[fileID] == NULL )// Bounds checking
-      return -1;
-   free(fdt[fileID]);                              // Free
-   fdt[fileID] = NULL;                             // Reset pointer
-   return 0;
+int ssfs_restore(int cnum) {
+   pthread_rwlock_wrlock(&commit_lock);
+   int res = restore_locked(cnum);
+   pthread_rwlock_unlock(&commit_lock);
+   return res;
 }
 
-int ssfs_frseek(int fileID, int loc){
-   if(fileID < 0 || fileID > NUM_BLOCKS || fdt[fileID] == NULL || loc < 0) // Bounds checking
-      return -1;
-   if(fdt[fileID]->inode.size < loc-1) {           // If seek is too big, seek up to end of file but return -1
-      fdt[fileID]->read_ptr = bytes_to_virt_addr(fdt[fileID]->inode.size);
+int restore_locked(int cnum) {
+   super_block_t *sb = calloc(BLOCK_SIZE, 1);
+   read_super(sb);
+   snap_entry_t entry;
+   if(cnum < 0 || cnum >= sb->num_roots || get_snapshot(cnum, &entry) == -1 || entry.state != SNAP_LIVE) {
+      printf("[DEBUG|ssfs_restore] This version does not exist (yet or anymore).\n");
+      free(sb);
       return -1;
    }
-   virt_addr_t addr = bytes_to_virt_addr(loc);
-   fdt[fileID]->read_ptr = addr;                   
-   return 0;
-}
 
-int ssfs_fwseek(int fileID, int loc){
-   if(fileID < 0 || fileID > NUM_BLOCKS || fdt[fileID] == NULL || fdt[fileID]->inode.size < loc || loc < 0)// Bounds checking
+   if(swap_counts(&sb->root, &entry.root, sb) == -1) {
+      printf("[DEBUG|ssfs_restore] A root is corrupt. Aborting\n");
+      free(sb);
       return -1;
-   virt_addr_t addr = bytes_to_virt_addr(loc);
-   fdt[fileID]->write_ptr = addr; 
+   }
+
+   // Every block in use might belong to the shadow root: none of them can be written in place.
+   // This also keeps both roots as they are until reclaim_step has walked them.
+   fbm_t *FBM = calloc(BLOCK_SIZE, 1);
+   read_logged(sb->fbm_ptr, 1, FBM);
+   if(next_epoch(sb, FBM)) log_block(sb->fbm_ptr, FBM);
+   free(FBM);
+
+   sb->root = entry.root;                          // Shadow root becomes the current root
+   sb->num_inodes = sb->root.size/sizeof(inode_t);
+   write_super(sb);
+   fd_at(J_NODE)->file->inode = sb->root;
+   __atomic_fetch_add(&root_gen, 1, __ATOMIC_RELEASE); // Other fds reload their inode on next access
+   fd_at(J_NODE)->file->gen = root_gen;
+   reclaim_left = 1;
+   log_sync();
+   free(sb);
+   
    return 0;
 }
 
-int ssfs_fwrite(int fileID, char *buf, int length){
-   if(fileID < 0 || fileID > NUM_BLOCKS || fdt[fileID] == NULL) return -1;
-   int total_bytes_written = 0;
+int ssfs_clone(int cnum) {
+   pthread_rwlock_wrlock(&commit_lock);
+   int res = clone_locked(cnum);
+   pthread_rwlock_unlock(&commit_lock);
+   return res;
+}
 
-   super_block_t *sb = malloc(BLOCK_SIZE);         // malloc                                    (10)
-   read_blocks(SUPER_BLOCK, 1, sb);                // Retrieve super block: sb
-   wm_t *WM = malloc(BLOCK_SIZE);                  // malloc                                    (11)
-   read_blocks(sb->wm_ptrs[sb->current_root], 1, WM);   // Retrieve WM:          WM
-   wm_t *FBM = malloc(BLOCK_SIZE);                 // malloc                                    (12)
-   read_blocks(sb->fbm_ptrs[sb->current_root], 1, FBM); // Retrieve FBM:         FBM
-   int inode_id = fdt[fileID]->inode_id;           // Get inode ID
+int clone_locked(int cnum) {
+   super_block_t *sb = calloc(BLOCK_SIZE, 1);
+   read_super(sb);
+   snap_entry_t entry;
+   if(cnum < 0 || cnum >= sb->num_roots || get_snapshot(cnum, &entry) == -1 || entry.state != SNAP_LIVE) {
+      printf("[DEBUG|ssfs_clone] No such shadow root.\n");
+      free(sb);
+      return -1;
+   }
 
-   while(length > 0) {                             // While there are bytes to write
-      int *d_ptr_id = &fdt[fileID]->write_ptr.d_ptr;// Index of direct pointer
-      b_ptr_t b_id = get_block_id(&fdt[fileID]->inode, *d_ptr_id);// Convert it to block pointer
-      int *offset = &fdt[fileID]->write_ptr.offset;// Get offset
-      if(b_id == -1) {
-         free(sb);                                 // Free           (10)
-         free(WM);                                 // Free           (11)
-         free(FBM);                                // Free           (12)
+   b_ptr_t new_table_block = 0;                    // Only needed when the last table block is full
+   if(sb->num_roots % SNAPS_PER_BLOCK == 0) {
+      fbm_t *FBM = calloc(BLOCK_SIZE, 1);
+      read_logged(sb->fbm_ptr, 1, FBM);
+      new_table_block = take_unused_block(FBM, BLOCK_OLD);
+      if(new_table_block == -1) {
+         printf("[DEBUG|ssfs_clone] Block allocation for new table block failed. Aborting\n");
+         free(FBM);
+         free(sb);
          return -1;
       }
-      // bytes to write = min(length, BLOCK_SIZE - offset of current write pointer)
-      int bytes_to_write = length < BLOCK_SIZE-*offset ? length : BLOCK_SIZE-*offset;
+      log_block(sb->fbm_ptr, FBM);
+      free(FBM);
+   }
 
-      if(b_id == 0) {                              // This means we need to wrio a new block
-         b_ptr_t new_block = get_unused_block();   // Get a free block to write the rest
-         if(new_block == -1) {
-            free(sb);                              // Free           (10)
-            free(WM);                              // Free           (11)
-            free(FBM);                             // Free           (12)
-            return -1;
-         }
-         add_new_block(&fdt[fileID]->inode, inode_id, *d_ptr_id, new_block, sb, bytes_to_write);
-         b_id = new_block;
-         if(b_id == -1) {
-            free(sb);                              // Free           (10)
-            free(WM);                              // Free           (11)
-            free(FBM);                             // Free           (12)
-            return -1;
-         }
+   // The branch starts as the shadow root's j-node: every block of it is read-only, so the
+   // first write to any of them goes through copy-on-write. Nothing is copied here.
+   snap_table_t *table = calloc(BLOCK_SIZE, 1);
+   if(new_table_block != 0) {                      // Chain a fresh table block
+      read_logged(snap_blocks[num_snap_blocks-1], 1, table);
+      table->next = new_table_block;
+      log_block(snap_blocks[num_snap_blocks-1], table);
+      memset(table, 0, BLOCK_SIZE);
+      if(num_snap_blocks == snap_blocks_cap) {     // Grow the lookup cache
+         snap_blocks_cap = 2*snap_blocks_cap;
+         snap_blocks = realloc(snap_blocks, snap_blocks_cap*sizeof(b_ptr_t));
       }
-      if(WM->mask[b_id] == 0) {                    // If block is not writable
-         b_ptr_t new_block = get_unused_block();
-         if(new_block == -1) {
-            free(sb);                              // Free           (10)
-            free(WM);                              // Free           (11)
-            free(FBM);                             // Free           (12)
-            return -1;
-         }
-         char *old_block = calloc(BLOCK_SIZE, 1);
-         ssfs_frseek(fileID, (*d_ptr_id)*BLOCK_SIZE);
-         ssfs_fread(fileID, old_block, BLOCK_SIZE);// Retrieve old block
-         add_new_block(&fdt[fileID]->inode, inode_id, *d_ptr_id, new_block, sb, bytes_to_write);
-
-         memcpy(&old_block[*offset], buf, bytes_to_write);// Copy on write
-         write_blocks(new_block, 1, old_block);    // Write to new block
-         free(old_block);
-      } else {
-         char *current_block = calloc(BLOCK_SIZE, 1); // Allocate a whole block                     (9)
-         read_blocks(b_id, 1, current_block);         // Retrieve current_block
+      snap_blocks[num_snap_blocks++] = new_table_block;
+   } else {
+      read_logged(snap_blocks[num_snap_blocks-1], 1, table);
+   }
+   snap_entry_t *branch = &table->entries[sb->num_roots % SNAPS_PER_BLOCK];
+   branch->root = entry.root;                      // Branches use the current FBM
+   branch->state = SNAP_BRANCH;
+   branch->time = time(NULL);
+   log_block(snap_blocks[num_snap_blocks-1], table);
+   free(table);
 
-         memcpy(&current_block[*offset], buf, bytes_to_write);// Write to block
-         write_blocks(b_id, 1, current_block);        // Write block to disk
-         free(current_block);                         // Free                                       (9)
-      }
+   int num = sb->num_roots++;
+   write_super(sb);
+   log_sync();
+   free(sb);
+   return num;
+}
 
-      // Need to update offset, block num, length, buf
-      buf = buf + bytes_to_write;                  // Update buf
-      length -= bytes_to_write;                    // Update length of buf
-      total_bytes_written += bytes_to_write;
+int ssfs_checkout(int branch) {
+   pthread_rwlock_wrlock(&commit_lock);
+   int res = checkout_locked(branch);
+   pthread_rwlock_unlock(&commit_lock);
+   return res;
+}
 
-      // Increment size of file before moving wptr (maximum of filesize and write ptr+bytes written)
-      fdt[fileID]->inode.size = fdt[fileID]->inode.size < virt_addr_to_bytes(fdt[fileID]->write_ptr) + bytes_to_write ? virt_addr_to_bytes(fdt[fileID]->write_ptr) + bytes_to_write : fdt[fileID]->inode.size;
-      ssfs_fwseek(fileID, virt_addr_to_bytes(fdt[fileID]->write_ptr) + bytes_to_write);// move wptr
+int checkout_locked(int branch) {
+   super_block_t *sb = calloc(BLOCK_SIZE, 1);
+   read_super(sb);
+   snap_entry_t entry;
+   if(branch != -1 && (branch < 0 || branch >= sb->num_roots || get_snapshot(branch, &entry) == -1 || entry.state != SNAP_BRANCH)) {
+      printf("[DEBUG|ssfs_checkout] No such branch.\n");
+      free(sb);
+      return -1;
    }
-   if(fileID != J_NODE) {                          // If not the j-node
-      ssfs_fwseek(J_NODE, fdt[fileID]->inode_id*sizeof(inode_t));
-      ssfs_fwrite(J_NODE, (char*) &fdt[fileID]->inode, sizeof(inode_t)); // Update inode
+   if(branch == sb->branch) {
+      free(sb);
+      return 0;
    }
 
-   free(sb);                                       // Free                                      (10)
-   free(WM);                                       // Free                                      (11)
-   free(FBM);                                      // Free                                      (12)
-   return total_bytes_written;
+   sb->root = fd_at(J_NODE)->file->inode;            // Park the current root in the branch table
+   if((branch == -1 && get_snapshot(sb->branch, &entry) == -1) // Root that becomes current: the branch or the parked main line
+      || swap_counts(&sb->root, &entry.root, sb) == -1) {
+      printf("[DEBUG|ssfs_checkout] A root is corrupt. Aborting\n");
+      free(sb);
+      return -1;
+   }
+   fbm_t *FBM = calloc(BLOCK_SIZE, 1);             // Both roots stay as they are until reclaim_step has walked them
+   read_logged(sb->fbm_ptr, 1, FBM);
+   if(next_epoch(sb, FBM)) log_block(sb->fbm_ptr, FBM);
+   free(FBM);
+   if(sb->branch != -1) swap_root(sb, sb->branch); // Main line back in sb->root
+   if(branch != -1) swap_root(sb, branch);         // Main line parked in the branch's entry
+   sb->branch = branch;
+   sb->num_inodes = sb->root.size/sizeof(inode_t);
+   write_super(sb);
+   fd_at(J_NODE)->file->inode = sb->root;
+   __atomic_fetch_add(&root_gen, 1, __ATOMIC_RELEASE); // Other fds reload their inode on next access
+   fd_at(J_NODE)->file->gen = root_gen;
+   reclaim_left = 1;
+   log_sync();
+   free(sb);
+   return 0;
 }
 
-int ssfs_fread(int fileID, char *buf, int length){
-   if(fileID < 0 || fileID > NUM_BLOCKS || fdt[fileID] == NULL)
-      return -1;
+int ssfs_fopen_at(int cnum, char *name) {
+   pthread_rwlock_rdlock(&commit_lock);            // Shadow roots do not change under it
+   int res = fopen_at_locked(cnum, name);
+   pthread_rwlock_unlock(&commit_lock);
+   return res;
+}
 
-   int total_bytes_read = 0;
-   if(fdt[fileID]->inode.size < virt_addr_to_bytes(fdt[fileID]->read_ptr) + length) // Truncate length if length too big
-      length = fdt[fileID]->inode.size - virt_addr_to_bytes(fdt[fileID]->read_ptr);
+int fopen_at_locked(int cnum, char *name) {
+   super_block_t *sb = calloc(BLOCK_SIZE, 1);
+   read_super(sb);
+   snap_entry_t entry;
+   if(name == NULL || cnum < 0 || cnum >= sb->num_roots || get_snapshot(cnum, &entry) == -1 || entry.state != SNAP_LIVE) {
+      printf("[DEBUG|ssfs_fopen_at] No such shadow root.\n");
+      free(sb);
+      return -1;
+   }
+   free(sb);
+
+   inode_t inode;                                  // Resolved against the shadow root only
+   dir_entry_t *dir = load_dir(&entry.root);
+   int inode_id = dir == NULL ? -1 : find_file(&entry.root, dir, name, &inode);
+   free(dir);
+   if(inode_id == -1) {
+      printf("[DEBUG|ssfs_fopen_at] File not found. Aborting\n");
+      return -1;
+   }
+   return new_fdt_entry(inode, inode_id, cnum);
+}
+
+int ssfs_snapshot_diff(int a, int b, ssfs_diff_cb callback, void *arg) {
+   pthread_rwlock_rdlock(&commit_lock);
+   int res = snapshot_diff_locked(a, b, callback, arg);
+   pthread_rwlock_unlock(&commit_lock);
+   return res;
+}
+
+int snapshot_diff_locked(int a, int b, ssfs_diff_cb callback, void *arg) {
+   super_block_t *sb = calloc(BLOCK_SIZE, 1);
+   read_super(sb);
+   snap_entry_t entry_a, entry_b;
+   if(callback == NULL || a < 0 || b < 0 || a >= sb->num_roots || b >= sb->num_roots
+      || get_snapshot(a, &entry_a) == -1 || get_snapshot(b, &entry_b) == -1
+      || entry_a.state != SNAP_LIVE || entry_b.state != SNAP_LIVE) {
+      printf("[DEBUG|ssfs_snapshot_diff] No such shadow root.\n");
+      free(sb);
+      return -1;
+   }
+   free(sb);
+   return diff_roots(&entry_a.root, &entry_b.root, callback, arg);
+}
+
+int diff_roots(inode_t *root_a, inode_t *root_b, ssfs_diff_cb callback, void *arg) {
+   int inodes_per_block = BLOCK_SIZE/sizeof(inode_t);
+   int num_a = root_a->size/sizeof(inode_t), num_b = root_b->size/sizeof(inode_t);
+   int tables_a = (num_a + inodes_per_block-1)/inodes_per_block;
+   int tables_b = (num_b + inodes_per_block-1)/inodes_per_block;
+   int max_blocks = MAX_DIRECT_PTR + BLOCK_SIZE/sizeof(b_ptr_t) + 1;
+
+   b_ptr_t *table_a = calloc(tables_a+1, sizeof(b_ptr_t)), *table_b = calloc(tables_b+1, sizeof(b_ptr_t));
+   inode_block_t *block_a = malloc(BLOCK_SIZE), *block_b = malloc(BLOCK_SIZE);
+   b_ptr_t *blocks_a = malloc(max_blocks*sizeof(b_ptr_t)), *blocks_b = malloc(max_blocks*sizeof(b_ptr_t));
+   dir_entry_t *dir_a = NULL, *dir_b = NULL;
+   int res = 0;
+   if(map_blocks(root_a, 0, tables_a, table_a) == -1 || map_blocks(root_b, 0, tables_b, table_b) == -1
+      || (dir_b = load_dir(root_b)) == NULL)
+      res = -1;
+   else if(table_a[0] == table_b[0])               // Shared first inode table block: same root dir
+      dir_a = dir_b;
+   else if((dir_a = load_dir(root_a)) == NULL)
+      res = -1;
+
+   for(int t=0; res == 0 && (t < tables_a || t < tables_b); t++) {
+      if(t < tables_a && t < tables_b && table_a[t] == table_b[t])
+         continue;                                 // Shared inode table block: nothing changed in it
+      if((t < tables_a && read_logged(table_a[t], 1, block_a) == -1) || (t < tables_b && read_logged(table_b[t], 1, block_b) == -1)) {
+         res = -1;
+         break;
+      }
+
+      for(int i=t*inodes_per_block; i<(t+1)*inodes_per_block && res == 0; i++) {
+         if(i == 0) continue;                      // Root dir: changes show up as files
+         inode_t *inode_a = i < num_a ? &block_a->inodes[i % inodes_per_block] : NULL;
+         inode_t *inode_b = i < num_b ? &block_b->inodes[i % inodes_per_block] : NULL;
+         if(inode_a != NULL && inode_a->size < 0) inode_a = NULL;
+         if(inode_b != NULL && inode_b->size < 0) inode_b = NULL;
+         if(inode_a == NULL && inode_b == NULL) continue;
+         char *name_a = dir_a[i-1].filename, *name_b = dir_b[i-1].filename;
+
+         // Same inode id but another file: report it as a deletion and a creation
+         if(inode_a != NULL && inode_b != NULL && strncmp(name_a, name_b, FILENAME_SIZE) != 0) {
+            res = callback(SSFS_DIFF_DELETED, name_a, 0, (inode_a->size + BLOCK_SIZE-1)/BLOCK_SIZE, arg);
+            if(res == 0)
+               res = callback(SSFS_DIFF_CREATED, name_b, 0, (inode_b->size + BLOCK_SIZE-1)/BLOCK_SIZE, arg);
+            continue;
+         }
+         if(inode_a == NULL) {
+            res = callback(SSFS_DIFF_CREATED, name_b, 0, (inode_b->size + BLOCK_SIZE-1)/BLOCK_SIZE, arg);
+            continue;
+         }
+         if(inode_b == NULL) {
+            res = callback(SSFS_DIFF_DELETED, name_a, 0, (inode_a->size + BLOCK_SIZE-1)/BLOCK_SIZE, arg);
+            continue;
+         }
+         if(memcmp(inode_a, inode_b, sizeof(inode_t)) == 0) continue; // Same pointers: same data
+
+         // Modified: report the ranges of block indices whose pointers differ
+         int count_a = (inode_a->size + BLOCK_SIZE-1)/BLOCK_SIZE, count_b = (inode_b->size + BLOCK_SIZE-1)/BLOCK_SIZE;
+         if(map_blocks(inode_a, 0, count_a, blocks_a) == -1 || map_blocks(inode_b, 0, count_b, blocks_b) == -1) {
+            res = -1;
+            break;
+         }
+         int reported = 0, first = -1;
+         for(int j=0; j <= count_a || j <= count_b; j++) {
+            int changed = j < count_a || j < count_b;
+            if(j < count_a && j < count_b && blocks_a[j] == blocks_b[j]) changed = 0;
+            if(changed && first == -1) first = j;
+            if(!changed && first != -1) {         // End of a changed range
+               res = callback(SSFS_DIFF_MODIFIED, name_b, first, j-first, arg);
+               reported = 1;
+               first = -1;
+               if(res != 0) break;
+            }
+         }
+         if(!reported && res == 0)                 // Only the inode itself changed
+            res = callback(SSFS_DIFF_MODIFIED, name_b, 0, 0, arg);
+      }
+   }
+
+   if(dir_a != dir_b) free(dir_a);
+   free(dir_b);
+   free(table_a);
+   free(table_b);
+   free(block_a);
+   free(block_b);
+   free(blocks_a);
+   free(blocks_b);
+   return res;
+}
+
+int ssfs_send(int from_cnum, int to_cnum, int out_fd) {
+   pthread_rwlock_rdlock(&commit_lock);
+   int res = send_locked(from_cnum, to_cnum, out_fd);
+   pthread_rwlock_unlock(&commit_lock);
+   return res;
+}
+
+int send_locked(int from_cnum, int to_cnum, int out_fd) {
+   super_block_t *sb = calloc(BLOCK_SIZE, 1);
+   read_super(sb);
+   snap_entry_t from, to;
+   memset(&from, 0, sizeof(snap_entry_t));         // No base: every file is sent (full stream)
+   if(out_fd < 0 || to_cnum < 0 || to_cnum >= sb->num_roots || get_snapshot(to_cnum, &to) == -1 || to.state != SNAP_LIVE
+      || (from_cnum != -1 && (from_cnum < 0 || from_cnum >= sb->num_roots || get_snapshot(from_cnum, &from) == -1 || from.state != SNAP_LIVE))) {
+      printf("[DEBUG|ssfs_send] No such shadow root.\n");
+      free(sb);
+      return -1;
+   }
+   free(sb);
+
+   stream_header_t header = { .magic = STREAM_MAGIC, .version = STREAM_VERSION, .block_size = BLOCK_SIZE,
+                              .from = from_cnum, .to = to_cnum, .base = 0 };
+   if((from_cnum != -1 && root_fingerprint(&from.root, &header.base) == -1) || root_fingerprint(&to.root, &header.result) == -1) {
+      printf("[DEBUG|ssfs_send] Shadow root is corrupt. Aborting\n");
+      return -1;
+   }
+   char packed[STREAM_HEADER_SIZE];
+   pack_header(&header, packed);
+   if(write_full(out_fd, packed, STREAM_HEADER_SIZE) == -1) return -1;
+
+   send_ctx_t ctx = { .out_fd = out_fd, .root = &to.root };
+   ctx.dir = load_dir(&to.root);
+   ctx.buf = malloc(SEND_BATCH*BLOCK_SIZE);        // The only buffer, whatever the amount of data
+   int res = ctx.dir == NULL ? -1 : 0;
+   for(ctx.pass = 0; ctx.pass < 2 && res == 0; ctx.pass++) // Deletions first: names can be reused
+      res = diff_roots(&from.root, &to.root, send_cb, &ctx);
+   if(res == 0) {
+      stream_record_t end = { .type = REC_END, .size = to_cnum };
+      res = send_record(out_fd, &end, NULL);
+   }
+   free(ctx.dir);
+   free(ctx.buf);
+   return res == 0 ? 0 : -1;
+}
+
+int ssfs_receive(int in_fd) {
+   char packed[STREAM_HEADER_SIZE];
+   stream_header_t header;
+   if(in_fd < 0 || read_full(in_fd, packed, STREAM_HEADER_SIZE) == -1 || unpack_header(packed, &header) == -1) {
+      printf("[DEBUG|ssfs_receive] Not a valid stream. Aborting\n");
+      return -1;
+   }
+   pthread_rwlock_wrlock(&commit_lock);            // No call sees the stream half applied
+   int res = receive_locked(in_fd, &header);
+   pthread_rwlock_unlock(&commit_lock);
+   return res;
+}
+
+int receive_locked(int in_fd, stream_header_t *header) {
+   super_block_t *sb = calloc(BLOCK_SIZE, 1);
+   read_super(sb);
+   uint32_t sum = 0;                               // Checked before anything changes
+   if(header->from != -1 && (root_fingerprint(&sb->root, &sum) == -1 || sum != header->base)) {
+      printf("[DEBUG|ssfs_receive] Current root does not match the base of the stream. Aborting\n");
+      free(sb);
+      return -1;
+   }
+
+   // The state before the stream is kept as a shadow root: what a stream that cannot be applied
+   // rolls back to (its blocks are read-only: the stream's writes all go to new blocks)
+   int before = commit_locked();
+   if(before == -1) {
+      free(sb);
+      return -1;
+   }
+   call_begin();                                   // One call: a crash never leaves half of the stream
+   int res = receive_apply(in_fd, header);
+   call_end();
+   read_super(sb);
+   if(res == 0 && (root_fingerprint(&sb->root, &sum) == -1 || sum != header->result)) res = -1;
+   free(sb);
+   if(res == 0) res = commit_locked();             // Received state becomes a shadow root
+   if(res == -1) {
+      printf("[DEBUG|ssfs_receive] Stream could not be applied. Rolled back\n");
+      restore_locked(before);
+   }
+   snapshot_delete_locked(before);
+   return res;
+}
+
+int receive_apply(int in_fd, stream_header_t *header) {
+   if(header->from == -1 && receive_clear() == -1) return -1; // A full stream is the whole root: no other file stays
+   char *packed = malloc(STREAM_RECORD_SIZE + SEND_BATCH*BLOCK_SIZE); // The only buffer, whatever the size of the stream
+   char *data = packed + STREAM_RECORD_SIZE;
+   int fd = -1;                                    // File of the last REC_FILE record
+   int size = 0;
+   int res = -1;
+   long total = STREAM_HEADER_SIZE;
+   stream_record_t rec;
+   while(total <= STREAM_MAX && read_full(in_fd, packed, STREAM_RECORD_SIZE) == 0) {
+      unpack_record(packed, &rec);
+      int length = rec.type == REC_DATA ? rec.num_blocks*BLOCK_SIZE : 0;
+      if(rec.type == REC_DATA && (fd < 0 || rec.num_blocks <= 0 || rec.num_blocks > SEND_BATCH || rec.first_block < 0
+         || rec.first_block + rec.num_blocks > MAX_FILE_BLOCKS)) break;
+      if((rec.type == REC_FILE || rec.type == REC_DELETE) && (rec.name[0] == 0 || memchr(rec.name, 0, FILENAME_SIZE+1) == NULL)) break;
+      if(rec.type == REC_FILE && (rec.size < 0 || rec.size > MAX_FILE_SIZE)) break;
+      if(rec.type < REC_FILE || rec.type > REC_END) break;
+      if(length > 0 && read_full(in_fd, data, length) == -1) break;
+      put32(packed + STREAM_RECORD_SIZE-4, 0);     // crc field
+      if(crc32c(crc32c(0, packed, STREAM_RECORD_SIZE), data, length) != rec.crc) { // Before it is applied
+         printf("[DEBUG|ssfs_receive] Checksum mismatch. Aborting\n");
+         break;
+      }
+      total += STREAM_RECORD_SIZE + length;
+
+      if(rec.type == REC_END) {                    // Whatever follows is not ours (pipes)
+         res = rec.size == header->to ? 0 : -1;
+         break;
+      } else if(rec.type == REC_FILE) {
+         if(fd >= 0) fclose_locked(fd);
+         fd = receive_file(rec.name, rec.size);
+         size = rec.size;
+         if(fd < 0) break;
+      } else if(rec.type == REC_DATA) {
+         int loc = rec.first_block*BLOCK_SIZE;
+         int bytes = size - loc < length ? size - loc : length; // Last block is only partly used
+         if(bytes > 0 && file_pwrite(fd, data, bytes, loc) != bytes) break;
+      } else if(rec.type == REC_DELETE) {
+         if(fd >= 0) fclose_locked(fd);
+         fd = -1;
+         remove_locked(rec.name);
+      }
+   }
+   if(fd >= 0) fclose_locked(fd);
+   free(packed);
+   if(res == -1) printf("[DEBUG|ssfs_receive] Stream is cut short or malformed. Aborting\n");
+   return res;
+}
+
+int receive_clear() {
+   super_block_t *sb = calloc(BLOCK_SIZE, 1);
+   read_super(sb);
+   dir_entry_t *dir = load_dir(&sb->root);
+   int num = sb->root.size/sizeof(inode_t);
+   free(sb);
+   if(dir == NULL) return -1;
+   for(int i=1; i<num; i++) {
+      char name[FILENAME_SIZE+1] = {0};
+      strncpy(name, dir[i-1].filename, FILENAME_SIZE);
+      if(name[0] != 0) remove_locked(name);
+   }
+   free(dir);
+   return 0;
+}
+
+int receive_file(char *name, int size) {
+   int fd = fopen_locked(name);
+   if(fd < 0 || fd_at(fd)->file->inode.size <= size) return fd;
+   // Shorter than before. Files do not shrink in place: it is written again with its first size bytes.
+   char *head = malloc(size > 0 ? size : 1);
+   int ok = size == 0 || file_pread(fd, head, size, 0) == size;
+   fclose_locked(fd);
+   fd = ok && remove_locked(name) == 0 ? fopen_locked(name) : -1;
+   if(fd >= 0 && size > 0 && file_pwrite(fd, head, size, 0) != size) {
+      fclose_locked(fd);
+      fd = -1;
+   }
+   free(head);
+   return fd;
+}
+
+void mkssfs(int fresh){
+   pthread_once(&locks_once, init_locks);
+   pthread_rwlock_wrlock(&commit_lock);
+   mkssfs_locked(fresh);
+   pthread_rwlock_unlock(&commit_lock);
+   if(flush_background == SSFS_FLUSH_BACKGROUND) pthread_once(&flusher_once, start_flusher);
+}
+
+void mkssfs_locked(int fresh){
+   if(super_image != NULL) log_sync(); // Calls of the previous mount the flusher has not synced yet
+   wait_home_writes();                // Nothing of the previous mount may land on the new one
+   memset(dirty, 0, NUM_BLOCKS);
+   memset(unwritten, 0, NUM_BLOCKS);  // Nothing pending from a previous mount
+   memset(freed, 0, sizeof(freed));
+   reclaim_left = 1;                  // The previous mount may have left some
+   num_snap_blocks = 0;               // Shadow root lookup cache is per disk
+   memset(refcnt, 0, sizeof(refcnt));
+   memset(block_crc, 0, sizeof(block_crc));
+   memset(crc_dirty, 0, CRC_BLOCKS);
+   memset(verified, 0, NUM_BLOCKS);   // First reads after mount are checked (SSFS_VERIFY_FIRST)
+   reclaim_inodes(1);
+   fd_reset();                        // j-node and root dir must land at J_NODE and ROOT_DIR again
+   for(int i=0; i<NUM_BLOCKS; i++) {
+      free(log_cache[i]);             // Logged images belong to the previous disk
+      log_cache[i] = NULL;
+   }
+   if(super_image == NULL) super_image = calloc(BLOCK_SIZE, 1);
+   if(log_buf == NULL) log_buf = calloc(LOG_BLOCKS, BLOCK_SIZE);
+   memset(log_buf, 0, LOG_BLOCKS*BLOCK_SIZE);
+   log_used = 0;
+   log_synced = 0;
+   log_quiet = 0;
+   if(fresh == 1) {              // Fresh disk -> need to perform first time setup
+      if(init_fresh_disk("placeholder", BLOCK_SIZE, NUM_BLOCKS) == -1)
+         exit(-1);
+
+      // Creating superblock
+      super_block_t *sb = calloc(BLOCK_SIZE, 1);   // Allocate a block to hold the superblock (1)
+
+      sb->magic = MAGIC;
+      sb->block_size = BLOCK_SIZE;
+      sb->num_blocks = NUM_BLOCKS;
+      sb->num_inodes = 1;                          // We start with 1 i-node for the root dir
+      sb->root.size = sizeof(inode_t);             // Root is thus of size inode_t ??????
+
+      // Creating root dir inode and placing it in first i-node block
+      inode_block_t *ib = calloc(BLOCK_SIZE, 1);   // Allocate a block for the inodes         (4)
+      ib->inodes[0].d_ptrs[0] = DEFAULT_ROOT_DIR_BLOCK; // inode 0 now points to root dir
+//    ib->inodes[0].size = 0;                           // Not necessary (calloc)
+      write_blocks(DEFAULT_INODE_TABLE_BLOCK, 1, ib);   // Write inode table
+
+      sb->root.d_ptrs[0] = DEFAULT_INODE_TABLE_BLOCK;   // Point to first inode table block
+
+      // Write current root to fdt[0]. It's a special entry, so we don't care if id is 0
+      new_fdt_entry(sb->root, -1, -1);             // Add root in FDT (at index 0)
+
+      new_fdt_entry(ib->inodes[0], 0, -1);         // Add root dir in FDT (at index 1)
+      free(ib);                                    // Free                                    (4)
+
+      sb->fbm_ptr = DEFAULT_FBM_BLOCK;             // No shadow roots yet (num_roots, snap_table = 0)
+      sb->epoch = FIRST_EPOCH;
+      sb->reclaim_cnum = -1;
+      sb->branch = -1;                             // Main line is checked out
+      sb->refcnt_ptr = DEFAULT_REFCNT_BLOCK;
+      write_blocks(DEFAULT_REFCNT_BLOCK, REFCNT_BLOCKS, refcnt); // Nothing referenced yet
+      sb->log_ptr = DEFAULT_LOG_BLOCK;             // Log is all 0s: no record of generation 1
+      sb->log_gen = 1;
+      sb->crc_ptr = DEFAULT_CRC_BLOCK;
+
+      super_seq = 0;
+      super_slot = SUPER_BLOCK_B;                  // First write goes to SUPER_BLOCK (second slot is all 0s)
+      memcpy(super_image, sb, BLOCK_SIZE);
+      flush_super();              // Write the superblock
+      free(sb);                                    // Free                                    (1)
+
+      // Create FBM
+      fbm_t *FBM = calloc(BLOCK_SIZE, 1);          // Allocate a whole block for the FBM      (2)
+
+      memset(FBM->mask, BLOCK_FREE, NUM_BLOCKS);   // Set the whole FBM to 1
+      FBM->mask[SUPER_BLOCK] = BLOCK_OLD;
+      FBM->mask[SUPER_BLOCK_B] = BLOCK_OLD;
+      FBM->mask[DEFAULT_FBM_BLOCK] = BLOCK_OLD;
+      FBM->mask[DEFAULT_INODE_TABLE_BLOCK] = FIRST_EPOCH; // Writable until the first commit
+      FBM->mask[DEFAULT_ROOT_DIR_BLOCK] = FIRST_EPOCH;
+      for(int i=0; i<REFCNT_BLOCKS; i++) FBM->mask[DEFAULT_REFCNT_BLOCK+i] = BLOCK_OLD;
+      for(int i=0; i<LOG_BLOCKS; i++) FBM->mask[DEFAULT_LOG_BLOCK+i] = BLOCK_OLD;
+      for(int i=0; i<CRC_BLOCKS; i++) FBM->mask[DEFAULT_CRC_BLOCK+i] = BLOCK_OLD;
+
+      write_blocks(DEFAULT_FBM_BLOCK, 1, FBM);     // Write the FBM
+
+      char *block = malloc(BLOCK_SIZE);            // Checksum everything laid out above      (3)
+      for(int i=0; i<NUM_BLOCKS; i++) {
+         if(FBM->mask[i] == BLOCK_FREE || !checksummed(i)) continue;
+         read_blocks(i, 1, block);
+         block_crc[i] = crc32c(0, block, BLOCK_SIZE);
+      }
+      write_blocks(DEFAULT_CRC_BLOCK, CRC_BLOCKS, block_crc);
+      free(block);                                 // Free                                    (3)
+      free(FBM);                                   // Free                                    (2)
+
+   } else {                      // Else assume it's already setup
+      if(init_disk("placeholder", BLOCK_SIZE, NUM_BLOCKS) == -1)
+         exit(-1);
+
+      super_block_t *sb = calloc(BLOCK_SIZE, 1);                                             //2
+      if(pick_super(sb) == -1) {                   // Newest slot that checks out
+         printf("[DEBUG|mkssfs] No valid superblock. Aborting\n");
+         free(sb);                                                                           //2
+         return;
+      }
+      memcpy(super_image, sb, BLOCK_SIZE);
+      if(log_replay() > 0)                         // Crashed with metadata only in the log
+         log_checkpoint();
+      read_super(sb);
+      read_blocks(sb->crc_ptr, CRC_BLOCKS, block_crc); // Before anything is verified
+
+      // Write current root to fdt[0]. It's a special entry, so we don't care if id is 0
+      new_fdt_entry(sb->root, -1, -1);             // Add root in FDT (at index 0)
+      load_snap_table(sb);                         // Fill the shadow root lookup cache
+      read_logged(sb->refcnt_ptr, REFCNT_BLOCKS, refcnt);
+
+      // Retrieve root dir inode
+      inode_t *root_dir_inode = calloc(sizeof(inode_t), 1);                                  //1
+      file_pread(J_NODE, (char*) root_dir_inode, sizeof(inode_t), 0);
+
+      new_fdt_entry(*root_dir_inode, 0, -1);       // Add root dir in FDT (at index 1)
+      free(root_dir_inode);                                                                  //1
+      free(sb);                                                                              //2
+   }
+   count_free();                                   // Free blocks of the allocation groups
+}
+
+int ssfs_fopen(char *name){
+   pthread_rwlock_rdlock(&commit_lock);
+   call_begin();
+   int res = fopen_locked(name);
+   call_end();
+   pthread_rwlock_unlock(&commit_lock);
+   call_done();
+   throttle();
+   return res;
+}
+
+int fopen_locked(char *name){
+   if(name == NULL) return -1;
+
+   inode_t *inode = calloc(sizeof(inode_t), 1);    // Initialize an inode                     (7)
+   super_block_t *sb = malloc(BLOCK_SIZE);         // malloc                                  (5)
+   read_super(sb);                // Retrieve super block
+
+   pthread_rwlock_rdlock(&dir_lock);               // Opening a file that exists only reads the dir
+   int inode_id = get_inode_id(name, sb);          // Check if file exists
+   if(inode_id == -1) {                            // Look again as the only writer if it may exist by now
+      int gen = dir_gen;
+      pthread_rwlock_unlock(&dir_lock);
+      pthread_rwlock_wrlock(&dir_lock);
+      if(dir_gen != gen) inode_id = get_inode_id(name, sb);
+   }
+
+   if(inode_id == -1) {                            // If file does not exist
+      b_ptr_t room = get_unused_block(-1);         // Check if there is still room
+      unlock_groups();
+      if(room == -1) {
+         printf("[DEBUG|ssfs_fopen] No more free blocks. Aborting\n");
+         pthread_rwlock_unlock(&dir_lock);
+         free(sb);                                 // Free                                    (5)
+         free(inode);                              // Free                                    (7)
+         return -1;
+      }
+      
+      pthread_mutex_lock(&itable_lock);            // Inode, dir entry and inode count change together
+      inode_id = get_free_inode();                 // Creating a dir entry and an inode. Not allocating any blocks yet
+      if(inode_id == -1)                           // Means inode is appended at the end (num_inodes only counts
+         inode_id = fd_at(J_NODE)->file->inode.size/sizeof(inode_t); // the files in use, a restored root may have holes)
+
+      if(file_pwrite(J_NODE, (char*) inode, sizeof(inode_t), inode_id*sizeof(inode_t)) <= 0) { // Write inode to appropriate block
+         pthread_mutex_unlock(&itable_lock);
+         pthread_rwlock_unlock(&dir_lock);
+         free(sb);                                 // Free                                    (5)
+         free(inode);                              // Free                                    (7)
+         return -1;
+      }
+
+      dir_entry_t *entry = calloc(DIR_ENTRY_SIZE, 1);// Calloc                               (18)
+      entry->inode_id = inode_id;
+      strcpy(entry->filename, name);
+      file_pwrite(ROOT_DIR, (char*) entry, DIR_ENTRY_SIZE, (inode_id-1)*DIR_ENTRY_SIZE); // Appropriate dir entry
+      free(entry);                                 // Free                                   (18)
+      dir_gen++;
+
+      read_super(sb);                              // Writes to other files may have moved the j-node meanwhile
+      sb->num_inodes++;                            // Update inode count
+      sb->root = fd_at(J_NODE)->file->inode; // j-node may have moved blocks (CoW)
+      write_super(sb);
+      pthread_mutex_unlock(&itable_lock);
+   } else {                                        // If file exists
+      file_pread(J_NODE, (char*) inode, sizeof(inode_t), inode_id*sizeof(inode_t));
+   }
+   int fd = new_fdt_entry(*inode, inode_id, -1);   // Create FDT entry
+   pthread_rwlock_unlock(&dir_lock);
+   free(sb);                                       // Free                                    (5)
+   free(inode);                                    // Free                                    (7)
+
+   return fd;
+}
+
+int ssfs_fclose(int fileID){
+   pthread_rwlock_t *lock = lock_file(fileID, 1); // Bounds checking, and no locked call is using the fd
+   if(lock == NULL) return -1;
+   fd_t *fd = fd_at(fileID);
+   __atomic_store_n(&fd->handle, -1, __ATOMIC_RELEASE); // The fd is stale from now on
+   file_t *file = close_file(fd);                  // Still open if other fds are on it
+   unlock_file(lock);
+   wait_readers();                                 // Nor a lock-free one
+   fd_release(fd);
+   if(file != NULL) free_file(file);
+   return 0;
+}
+
+int fclose_locked(int fileID){                     // Commit barrier held exclusively: no call is using the fd
+   fd_t *fd = fileID > ROOT_DIR ? fd_at(fileID) : NULL;
+   if(fd == NULL) return -1;
+   __atomic_store_n(&fd->handle, -1, __ATOMIC_RELEASE);
+   file_t *file = close_file(fd);
+   wait_readers();                                 // Nor a lock-free read
+   fd_release(fd);
+   if(file != NULL) free_file(file);
+   return 0;
+}
+
+int ssfs_frseek(int fileID, int loc){
+   pthread_rwlock_t *lock = lock_file(fileID, 0);
+   if(lock == NULL) return -1;
+   int res = 0;
+   if(get_fd(fileID) == NULL || loc < 0) {         // Bounds checking
+      res = -1;
+   } else if(fd_at(fileID)->file->inode.size < loc-1) { // If seek is too big, seek up to end of file but return -1
+      fd_at(fileID)->read_ptr = bytes_to_virt_addr(fd_at(fileID)->file->inode.size);
+      res = -1;
+   } else {
+      virt_addr_t addr = bytes_to_virt_addr(loc);
+      fd_at(fileID)->read_ptr = addr;
+   }
+   unlock_file(lock);
+   return res;
+}
+
+int ssfs_fwseek(int fileID, int loc){
+   pthread_rwlock_t *lock = lock_file(fileID, 0);
+   if(lock == NULL) return -1;
+   int res = -1;
+   if(get_fd(fileID) != NULL && fd_at(fileID)->file->inode.size >= loc && loc >= 0) { // Bounds checking
+      virt_addr_t addr = bytes_to_virt_addr(loc);
+      fd_at(fileID)->write_ptr = addr;
+      res = 0;
+   }
+   unlock_file(lock);
+   return res;
+}
+
+int ssfs_fwrite(int fileID, char *buf, int length){
+   pthread_rwlock_t *lock = lock_file(fileID, 1);
+   if(lock == NULL) return -1;
+   call_begin();
+   int res = get_fd(fileID) == NULL ? -1 : write_at(fileID, &fd_at(fileID)->write_ptr, buf, length);
+   call_end();
+   if(fd_at(fileID) != NULL) fd_at(fileID)->file->seq = call_seq; // For ssfs_fsync
+   unlock_file(lock);
+   call_done();                                    // Data is on disk: the metadata can follow
+   reclaim_inodes(0);
+   throttle();
+   return res;
+}
+
+int ssfs_pwrite(int fileID, char *buf, int length, int loc){
+   pthread_rwlock_t *lock = lock_file(fileID, 1);
+   if(lock == NULL) return -1;
+   call_begin();
+   int res = file_pwrite(fileID, buf, length, loc);
+   call_end();
+   if(fd_at(fileID) != NULL) fd_at(fileID)->file->seq = call_seq; // For ssfs_fsync
+   unlock_file(lock);
+   call_done();
+   reclaim_inodes(0);
+   throttle();
+   return res;
+}
+
+int file_pwrite(int fileID, char *buf, int length, int loc){
+   if(fileID == J_NODE) pthread_mutex_lock(&itable_lock);
+   int res = -1;
+   if(get_fd(fileID) != NULL && fd_at(fileID)->file->inode.size >= loc && loc >= 0) { // Bounds checking
+      virt_addr_t addr = bytes_to_virt_addr(loc);  // Private pointer: fd's pointers are left alone
+      res = write_at(fileID, &addr, buf, length);
+   }
+   if(fileID == J_NODE) pthread_mutex_unlock(&itable_lock);
+   return res;
+}
+
+int write_at(int fileID, virt_addr_t *wptr, char *buf, int length){
+   struct iovec iov = { .iov_base = buf, .iov_len = length };
+   return write_iov(fileID, wptr, &iov, length);
+}
+
+int write_iov(int fileID, virt_addr_t *wptr, const struct iovec *iov, int length){
+   if(fd_at(fileID)->file->snap != -1) {             // Shadow roots are immutable
+      printf("[DEBUG|write_at] File was opened read-only in shadow root %d. Aborting\n", fd_at(fileID)->file->snap);
+      return -1;
+   }
+   int total_bytes_written = 0;
+
+   super_block_t *sb = malloc(BLOCK_SIZE);         // malloc                                    (10)
+   read_super(sb);                // Retrieve super block: sb
+   fbm_t *map = malloc(BLOCK_SIZE);                // malloc                                    (11)
+   read_logged(sb->fbm_ptr, 1, map); // Retrieve FBM: births tell what is writable
+   cow_batch_t cow = { .FBM = NULL, .ptr_file = NULL }; // FBM is only retrieved by a CoW run
+   iov_cursor_t src = { .iov = iov, .offset = 0 };
+   char *current_block = malloc(BLOCK_SIZE);       // New content of each block                 (9)
+   int inode_id = fd_at(fileID)->file->inode_id;     // Get inode ID
+   b_ptr_t replaced[MAX_FILE_SIZE/BLOCK_SIZE];     // Writable blocks the data moved away from
+   int num_replaced = 0;
+
+   while(length > 0) {                             // While there are bytes to write
+      int *d_ptr_id = &wptr->d_ptr;// Index of direct pointer
+      b_ptr_t b_id;
+      if(cow.ptr_file != NULL && *d_ptr_id >= MAX_DIRECT_PTR && *d_ptr_id < MAX_DIRECT_PTR + BLOCK_SIZE/sizeof(b_ptr_t))
+         b_id = cow.ptr_file->ptrs[*d_ptr_id - MAX_DIRECT_PTR]; // Pointer file is pending in memory
+      else
+         b_id = get_block_id(&fd_at(fileID)->file->inode, *d_ptr_id);// Convert it to block pointer
+      int *offset = &wptr->offset;// Get offset
+      if(b_id == -1) {
+         cow_flush(fd_at(fileID)->file, &cow, sb);
+         free(current_block);                      // Free           (9)
+         free(sb);                                 // Free           (10)
+         free(map);                                // Free           (11)
+         return -1;
+      }
+      // bytes to write = min(length, BLOCK_SIZE - offset of current write pointer)
+      int bytes_to_write = length < BLOCK_SIZE-*offset ? length : BLOCK_SIZE-*offset;
+
+      if(b_id == 0) {                              // This means we need to wrio a new block
+         cow_flush(fd_at(fileID)->file, &cow, sb);   // add_new_block works on the on-disk FBM
+         // Nobody takes the block between the peek and add_new_block: its group stays locked until it is logged.
+         // No itable_lock: add_new_block writes the inode back once the group is released.
+         b_ptr_t new_block = get_unused_block(home_group(fd_at(fileID)->file, 0)); // Get a free block to write the rest
+         b_ptr_t old_i_ptr = fd_at(fileID)->file->inode.i_ptr;
+         if(new_block == -1 || add_new_block(&fd_at(fileID)->file->inode, inode_id, *d_ptr_id, new_block, sb, bytes_to_write) == -1) {
+            unlock_groups();
+            free(current_block);                   // Free           (9)
+            free(sb);                              // Free           (10)
+            free(map);                             // Free           (11)
+            return -1;
+         }
+         map->mask[new_block] = sb->epoch;         // Taken after map was read: born now all the same
+         if(fd_at(fileID)->file->inode.i_ptr != old_i_ptr) map->mask[fd_at(fileID)->file->inode.i_ptr] = sb->epoch;
+         fd_at(fileID)->file->last = new_block;
+         b_id = new_block;
+      }
+      int fresh = unwritten[b_id];
+      if(bytes_to_write < BLOCK_SIZE) {            // The rest of the block is kept
+         if(fresh) memset(current_block, 0, BLOCK_SIZE); // Fresh blocks are all 0s
+         else if(read_logged(b_id, 1, current_block) == -1) { // Corrupted bytes would be kept
+            cow_flush(fd_at(fileID)->file, &cow, sb);
+            free(current_block);                   // Free           (9)
+            free(sb);                              // Free           (10)
+            free(map);                             // Free           (11)
+            return -1;
+         }
+      }
+      iov_copy(&src, &current_block[*offset], bytes_to_write, 1); // Gathered straight into the block
+
+      int owned = is_writable(map, b_id, sb);
+      if(!owned || (fileID > ROOT_DIR && !fresh)) { // Read-only, or file data already on disk: to a new block
+         if(cow_block(fd_at(fileID)->file, *d_ptr_id, b_id, 0, current_block, BLOCK_SIZE, &cow, map, sb) == -1) {
+            cow_flush(fd_at(fileID)->file, &cow, sb);
+            free(current_block);                   // Free           (9)
+            free(sb);                              // Free           (10)
+            free(map);                             // Free           (11)
+            return -1;
+         }
+         if(owned) replaced[num_replaced++] = b_id; // Freed once no read can use it
+      } else {
+         cow_flush(fd_at(fileID)->file, &cow, sb);   // End of the CoW run
+         // Metadata already on disk is overwritten through the log: a crash never leaves half of a write.
+         // File data is never overwritten (only the pointer to its new block is logged). Nothing points at
+         // a fresh block until the next sync, it can go straight to disk.
+         if(!fresh)
+            log_block(b_id, current_block);
+         else
+            write_checked(b_id, 1, current_block);    // Write block to disk
+         if(fresh) unwritten[b_id] = 0;               // Lock-free reads check it
+         cache_update(b_id, current_block);
+      }
+
+      // Need to update offset, block num, length
+      length -= bytes_to_write;                    // Update length of buf
+      total_bytes_written += bytes_to_write;
+
+      // Increment size of file before moving wptr (maximum of filesize and write ptr+bytes written)
+      fd_at(fileID)->file->inode.size = fd_at(fileID)->file->inode.size < virt_addr_to_bytes(*wptr) + bytes_to_write ? virt_addr_to_bytes(*wptr) + bytes_to_write : fd_at(fileID)->file->inode.size;
+      *wptr = bytes_to_virt_addr(virt_addr_to_bytes(*wptr) + bytes_to_write);// move wptr
+   }
+   cow_flush(fd_at(fileID)->file, &cow, sb);
+   if(fileID != J_NODE) {                          // If not the j-node
+      file_pwrite(J_NODE, (char*) &fd_at(fileID)->file->inode, sizeof(inode_t), fd_at(fileID)->file->inode_id*sizeof(inode_t)); // Update inode
+   }
+   if(fileID != J_NODE && fileID != ROOT_DIR)
+      publish_inode(fd_at(fileID)->file);            // Data is on disk: the readers can follow
+   if(num_replaced > 0) {
+      wait_readers();                              // Reads of the old inode copy may still use the old blocks
+      free_replaced(replaced, num_replaced, sb);
+   }
+
+   free(current_block);                            // Free                                      (9)
+   free(sb);                                       // Free                                      (10)
+   free(map);                                      // Free                                      (11)
+   return total_bytes_written;
+}
+
+int ssfs_fread(int fileID, char *buf, int length){
+   struct iovec iov = { .iov_base = buf, .iov_len = length };
+   int res = read_lockless(fileID, -1, &iov, length);
+   if(res != -2) return res;
+   pthread_rwlock_t *lock = lock_file(fileID, 0);  // The fd's inode has to be reloaded first
+   if(lock == NULL) return -1;
+   res = get_fd(fileID) == NULL ? -1 : read_at(&fd_at(fileID)->file->inode, &fd_at(fileID)->read_ptr, buf, length);
+   unlock_file(lock);
+   return res;
+}
+
+int ssfs_pread(int fileID, char *buf, int length, int loc){
+   if(loc < 0) return -1;                          // -1 would be the fd's read pointer to read_lockless
+   struct iovec iov = { .iov_base = buf, .iov_len = length };
+   int res = read_lockless(fileID, loc, &iov, length);
+   if(res != -2) return res;
+   pthread_rwlock_t *lock = lock_file(fileID, 0);  // The fd's inode has to be reloaded first
+   if(lock == NULL) return -1;
+   res = file_pread(fileID, buf, length, loc);
+   unlock_file(lock);
+   return res;
+}
+
+int read_lockless(int fileID, int loc, const struct iovec *iov, int length){
+   if(fileID <= ROOT_DIR) return -1;
+   int idx = read_begin();                         // Blocks are only freed once the reads of the moment are over
+   fd_t *fd = fd_at(fileID);                       // Not reused before read_end
+   int res = -2;
+   if(fd == NULL) {
+      res = -1;
+   } else if(__atomic_load_n(&fd->file->gen, __ATOMIC_ACQUIRE) == __atomic_load_n(fd->file->snap == -1 ? &root_gen : &snap_gen, __ATOMIC_ACQUIRE)) { // Published copy is up to date
+      inode_t *inode = __atomic_load_n(&fd->file->pub, __ATOMIC_SEQ_CST); // One copy of the inode for the whole call
+      virt_addr_t addr = bytes_to_virt_addr(loc);
+      virt_addr_t *rptr = loc == -1 ? &fd->read_ptr : &addr;
+      res = loc < -1 || inode->size < virt_addr_to_bytes(*rptr) ? -1 : read_iov(inode, rptr, iov, length, 0);
+   }
+   read_end(idx);
+   return res;
+}
+
+int file_pread(int fileID, char *buf, int length, int loc){
+   if(fileID == J_NODE) pthread_mutex_lock(&itable_lock);
+   int res = -1;
+   if(get_fd(fileID) != NULL && fd_at(fileID)->file->inode.size >= loc && loc >= 0) { // Bounds checking
+      virt_addr_t addr = bytes_to_virt_addr(loc);  // Private pointer: fd's pointers are left alone
+      res = read_at(&fd_at(fileID)->file->inode, &addr, buf, length);
+   }
+   if(fileID == J_NODE) pthread_mutex_unlock(&itable_lock);
+   return res;
+}
+
+int read_at(inode_t *inode, virt_addr_t *rptr, char *buf, int length){
+   struct iovec iov = { .iov_base = buf, .iov_len = length };
+   return read_iov(inode, rptr, &iov, length, 1);
+}
+
+int read_iov(inode_t *inode, virt_addr_t *rptr, const struct iovec *iov, int length, int logged){
+
+   int total_bytes_read = 0;
+   if(inode->size < virt_addr_to_bytes(*rptr) + length) // Truncate length if length too big
+      length = inode->size - virt_addr_to_bytes(*rptr);
+   if(length <= 0) return 0;
+   b_ptr_t blocks[MAX_FILE_SIZE/BLOCK_SIZE];    // Pointer file is only retrieved once for the whole range (the mapping of the call)
+   int first = rptr->d_ptr;
+   if(map_blocks(inode, first, bytes_to_virt_addr(virt_addr_to_bytes(*rptr) + length - 1).d_ptr - first + 1, blocks) == -1)
+      return -1;
+   iov_cursor_t dst = { .iov = iov, .offset = 0 };
+   char *current_block = malloc(BLOCK_SIZE);    // Malloc                                    (17)
    while(length > 0) {
-      int *d_ptr_id = &fdt[fileID]->read_ptr.d_ptr;// Index of direct pointer
-      b_ptr_t b_id = get_block_id(&fdt[fileID]->inode, *d_ptr_id);// Convert it to block pointer
-      int *offset = &fdt[fileID]->read_ptr.offset;// Get offset
+      b_ptr_t b_id = blocks[rptr->d_ptr - first];
+      int *offset = &rptr->offset;// Get offset
+
+      if(!logged) {                                // File data is never logged: no lock per block for it
+         if(read_data(b_id, current_block) == -1) {
+            free(current_block);                   // Corrupted: do not hand it out          (17)
+            return -1;
+         }
+      } else {
+         pthread_mutex_lock(&meta_lock);
+         int cached = block_cache[b_id] != NULL;
+         if(cached)                                // Pinned by a view: no need to go to disk
+            memcpy(current_block, block_cache[b_id], BLOCK_SIZE);
+         pthread_mutex_unlock(&meta_lock);
+         if(!cached && unwritten[b_id])            // Fresh blocks are all 0s
+            memset(current_block, 0, BLOCK_SIZE);
+         else if(!cached && read_logged(b_id, 1, current_block) == -1) { // Retrieve current_block
+            free(current_block);                   // Corrupted: do not hand it out          (17)
+            return -1;
+         }
+      }
+
+      // bytes to write = min(length, BLOCK_SIZE - offset of current write pointer)
+      int bytes_to_read = length < BLOCK_SIZE-*offset ? length : BLOCK_SIZE-*offset;
+      iov_copy(&dst, &current_block[*offset], bytes_to_read, 0); // Perform read, straight into the iovecs
+
+      length -= bytes_to_read;                     // Update length
+      total_bytes_read += bytes_to_read;           // Increment total bytes read
+
+      *rptr = bytes_to_virt_addr(virt_addr_to_bytes(*rptr) + bytes_to_read);//move rptr
+   }
+   free(current_block);                         // Free                                      (17)
+   return total_bytes_read;
+}
+
+int ssfs_fwritev(int fileID, const struct iovec *iov, int iovcnt){
+   int length = iov_length(iov, iovcnt);
+   if(length < 0) return -1;
+   pthread_rwlock_t *lock = lock_file(fileID, 1);
+   if(lock == NULL) return -1;
+   call_begin();                                   // One call: whole blocks, metadata written once
+   int res = get_fd(fileID) == NULL ? -1 : write_iov(fileID, &fd_at(fileID)->write_ptr, iov, length);
+   call_end();
+   if(fd_at(fileID) != NULL) fd_at(fileID)->file->seq = call_seq; // For ssfs_fsync
+   unlock_file(lock);
+   call_done();
+   reclaim_inodes(0);
+   throttle();
+   return res;
+}
+
+int ssfs_freadv(int fileID, const struct iovec *iov, int iovcnt){
+   int length = iov_length(iov, iovcnt);
+   if(length < 0) return -1;
+   int res = read_lockless(fileID, -1, iov, length);
+   if(res != -2) return res;
+   pthread_rwlock_t *lock = lock_file(fileID, 0);  // The fd's inode has to be reloaded first
+   if(lock == NULL) return -1;
+   res = get_fd(fileID) == NULL ? -1 : read_iov(&fd_at(fileID)->file->inode, &fd_at(fileID)->read_ptr, iov, length, 0);
+   unlock_file(lock);
+   return res;
+}
+
+int ssfs_fread_view(int fileID, int loc, int length, ssfs_view_t *view){
+   pthread_rwlock_t *lock = lock_file(fileID, 0);
+   if(lock == NULL) return -1;
+   int res = fread_view_locked(fileID, loc, length, view);
+   unlock_file(lock);
+   return res;
+}
+
+int fread_view_locked(int fileID, int loc, int length, ssfs_view_t *view){
+   if(get_fd(fileID) == NULL || view == NULL || loc < 0 || length < 0 || fd_at(fileID)->file->inode.size < loc)
+      return -1;
+   memset(view, 0, sizeof(ssfs_view_t));
+   if(fd_at(fileID)->file->inode.size < loc + length) // Truncate length if length too big
+      length = fd_at(fileID)->file->inode.size - loc;
+   if(length == 0) return 0;
+
+   virt_addr_t first = bytes_to_virt_addr(loc);
+   int count = bytes_to_virt_addr(loc + length - 1).d_ptr - first.d_ptr + 1;
+   b_ptr_t *blocks = malloc(count*sizeof(b_ptr_t));// Malloc (freed by ssfs_view_release)
+   if(map_blocks(&fd_at(fileID)->file->inode, first.d_ptr, count, blocks) == -1) {
+      free(blocks);
+      return -1;
+   }
+   struct iovec *iov = malloc(count*sizeof(struct iovec));// Malloc (freed by ssfs_view_release)
+   int offset = first.offset;
+   for(int i=0, left=length; i<count; i++) {
+      int n = left < BLOCK_SIZE-offset ? left : BLOCK_SIZE-offset;
+      iov[i].iov_base = pin_block(blocks[i]) + offset;
+      iov[i].iov_len = n;
+      left -= n;
+      offset = 0;                                  // Only the first segment starts mid-block
+   }
+   view->iov = iov;
+   view->iovcnt = count;
+   view->length = length;
+   view->blocks = blocks;
+   return length;
+}
+
+void ssfs_view_release(ssfs_view_t *view){
+   if(view == NULL || view->blocks == NULL) return;
+   for(int i=0; i<view->iovcnt; i++)
+      unpin_block(view->blocks[i]);
+   free(view->iov);
+   free(view->blocks);
+   memset(view, 0, sizeof(ssfs_view_t));
+}
+
+int ssfs_remove(char *file){
+   pthread_rwlock_rdlock(&commit_lock);
+   call_begin();
+   int res = remove_locked(file);
+   call_end();
+   pthread_rwlock_unlock(&commit_lock);
+   sync_to(call_seq);                              // Freed blocks are only reused once the disk agrees
+   return res;
+}
+
+int remove_locked(char *file){
+   super_block_t *sb = malloc(BLOCK_SIZE);         // malloc                                    //3
+   read_super(sb);
+   pthread_rwlock_wrlock(&dir_lock);
+   int inode_id = get_inode_id(file, sb);
+
+   if(inode_id == -1) {
+      printf("[DEBUG|ssfs_remove] File not found. Aborting\n");
+      pthread_rwlock_unlock(&dir_lock);
+      free(sb);                                                                                 //3
+      return -1;
+   }
+   pthread_rwlock_t *lock = &file_locks[inode_id % FILE_LOCKS];
+   pthread_rwlock_wrlock(lock);                    // Reads and writes in progress on it finish first
+
+   file_t *closed = detach_file(inode_id, -1);     // Closes the fds on our file (not the ones of shadow roots)
+   wait_readers();                                 // Lock-free reads may still use the fds and the blocks
+   if(closed != NULL) free_file(closed);
+
+   inode_t *inode = malloc(sizeof(inode_t));                                                    //6
+   file_pread(J_NODE, (char*) inode, sizeof(inode_t), inode_id*sizeof(inode_t));  // Retrieve inode
+   lock_groups();                                  // Frees blocks anywhere on the disk
+   pthread_mutex_lock(&meta_lock);                 // The FBM record goes to the sync that makes freed[] obsolete
+   fbm_t *FBM = malloc(BLOCK_SIZE);                // Births tell the read-only blocks apart    //4
+   read_logged(sb->fbm_ptr, 1, FBM);
+
+   // Time to free everything we gave to the inode (read-only blocks belong to shadow roots)
+   b_ptr_t *blocks = malloc((MAX_DIRECT_PTR + BLOCK_SIZE/sizeof(b_ptr_t) + 1)*sizeof(b_ptr_t));
+   int num_blocks = inode_blocks(inode, blocks);
+   for(int i=0; i<num_blocks; i++) {
+      ref_live(blocks[i], 0, sb);
+      if(FBM->mask[blocks[i]] == sb->epoch) {
+         FBM->mask[blocks[i]] = BLOCK_FREE;
+         unwritten[blocks[i]] = 0;
+         freed[blocks[i]] = quiet_seq+1;
+      }
+   }
+   free(blocks);
+   log_block(sb->fbm_ptr, FBM);
+   pthread_mutex_unlock(&meta_lock);
+   unlock_groups();
+   free(FBM);                                                                                   //4
+   free(inode);                                                                                 //6
+
+   inode_t *unused_inode = calloc(sizeof(inode_t), 1);                                          //7
+   unused_inode->size = -1;                        // Indicate inode is unused
+
+   pthread_mutex_lock(&itable_lock);
+   file_pwrite(J_NODE, (char*) unused_inode, sizeof(inode_t), inode_id*sizeof(inode_t)); // Delete inode
+   read_super(sb);                                 // Writes to other files may have moved the j-node meanwhile
+   sb->num_inodes--;                               // Update number of inodes
+   sb->root = fd_at(J_NODE)->file->inode; // j-node may have moved blocks (CoW)
+   write_super(sb);
+
+   // Removing directory entry
+   char *empty_array = calloc(DIR_ENTRY_SIZE, 1);                                               //8
+   file_pwrite(ROOT_DIR, empty_array, DIR_ENTRY_SIZE, (inode_id-1)*DIR_ENTRY_SIZE);
+   dir_gen++;
+   pthread_mutex_unlock(&itable_lock);
+   pthread_rwlock_unlock(lock);
+   pthread_rwlock_unlock(&dir_lock);
+
+   free(empty_array);                                                                           //8
+   free(unused_inode);                                                                          //7
+   free(sb);                                                                                    //3
+   return 0;
+}
+
+/**********************************************************************************************/
+
+b_ptr_t get_block_id(inode_t *inode, int d_ptr_id) {
+   if(d_ptr_id < 0 || d_ptr_id >= (MAX_DIRECT_PTR + BLOCK_SIZE/sizeof(b_ptr_t)))
+      return -1;
+
+   if(d_ptr_id >= MAX_DIRECT_PTR) {             // Need to look into indirect ptr
+      b_ptr_t i_ptr = inode->i_ptr;             // Get indirect pointer
+      if(i_ptr == 0) return 0;                  // If indirect pointer not initialized, delegate to caller
+
+      ptr_file_t *ptr_file = malloc(BLOCK_SIZE);// Malloc                                    (13)
+      if(read_logged(i_ptr, 1, ptr_file) == -1) { // Retrieve pointer file
+         free(ptr_file);                        // Corrupted: its pointers cannot be followed (13)
+         return -1;
+      }
+
+      b_ptr_t ptr = ptr_file->ptrs[d_ptr_id - MAX_DIRECT_PTR];
+      free(ptr_file);                           // Free                                      (13)
+      if(ptr > NUM_BLOCKS-1) return -1;
+      return ptr;
+   }
+   if(inode->d_ptrs[d_ptr_id]>NUM_BLOCKS)
+      return -1;
+
+   return inode->d_ptrs[d_ptr_id];
+}
+
+int map_blocks(inode_t *inode, int d_ptr_id, int count, b_ptr_t *blocks) {
+   ptr_file_t *ptr_file = NULL;                 // Only retrieved once, if needed
+   for(int i=0; i<count; i++, d_ptr_id++) {
+      if(d_ptr_id < 0 || d_ptr_id >= (MAX_DIRECT_PTR + BLOCK_SIZE/sizeof(b_ptr_t))) {
+         free(ptr_file);
+         return -1;
+      }
+      if(d_ptr_id < MAX_DIRECT_PTR) {
+         blocks[i] = inode->d_ptrs[d_ptr_id];
+      } else {
+         if(ptr_file == NULL) {
+            ptr_file = malloc(BLOCK_SIZE);      // Malloc                                    (22)
+            if(read_logged(inode->i_ptr, 1, ptr_file) == -1) {
+               free(ptr_file);                  // Free                                      (22)
+               return -1;
+            }
+         }
+         blocks[i] = ptr_file->ptrs[d_ptr_id - MAX_DIRECT_PTR];
+      }
+      if(blocks[i] <= 0 || blocks[i] > NUM_BLOCKS-1) {
+         free(ptr_file);
+         return -1;
+      }
+   }
+   free(ptr_file);                              // Free                                      (22)
+   return 0;
+}
+
+char *pin_block(b_ptr_t block) {                // Pins a block in the block cache
+   pthread_mutex_lock(&meta_lock);
+   if(block_cache[block] == NULL) {             // First pin: retrieve the block
+      block_cache[block] = calloc(BLOCK_SIZE, 1);
+      if(!unwritten[block])                     // Fresh blocks are already 0s (calloc)
+         read_logged(block, 1, block_cache[block]);
+   }
+   block_pins[block]++;
+   char *data = block_cache[block];
+   pthread_mutex_unlock(&meta_lock);
+   return data;
+}
+
+void unpin_block(b_ptr_t block) {
+   pthread_mutex_lock(&meta_lock);
+   if(block_pins[block] > 0 && --block_pins[block] == 0) { // Last view is gone
+      free(block_cache[block]);
+      block_cache[block] = NULL;
+   }
+   pthread_mutex_unlock(&meta_lock);
+}
+
+void cache_update(b_ptr_t block, char *data) {  // Views see writes like a shared mapping would
+   pthread_mutex_lock(&meta_lock);
+   if(block_cache[block] != NULL)
+      memcpy(block_cache[block], data, BLOCK_SIZE);
+   pthread_mutex_unlock(&meta_lock);
+}
+
+b_ptr_t take_unused_block(fbm_t *FBM, int birth) { // Gets an unused block from an in-memory FBM
+   // A freed block with log records is not reused before a checkpoint: replaying them would
+   // overwrite its new content after a crash. Nor is one freed by the operation in progress:
+   // until the next sync, the state on disk still uses it. Nor is a pinned one: the views that
+   // still show it would get the data of its next owner (cache_update).
+   pthread_mutex_lock(&meta_lock);
+   for(int pass=0; pass<2; pass++) {
+      int pending = 0;
+      b_ptr_t block = take_free(FBM, birth, 0, NUM_BLOCKS, &pending);
+      if(block != -1) {
+         pthread_mutex_unlock(&meta_lock);
+         return block;
+      }
+      if(!pending) break;
+      log_checkpoint();                         // Only logged blocks are left: make them reusable
+   }
+   pthread_mutex_unlock(&meta_lock);
+   return -1;
+}
+
+b_ptr_t take_free(fbm_t *FBM, int birth, int first, int count, int *pending) { // First fit
+   for(int i=first; i<first+count; i++) {
+      if(FBM->mask[i] != BLOCK_FREE || freed[i] > synced_seq || block_pins[i] > 0) continue;
+      if(log_cache[i] != NULL) {
+         *pending = 1;
+         continue;
+      }
+      FBM->mask[i] = birth;                     // Mark it used right away
+      return i;
+   }
+   return -1;
+}
+
+b_ptr_t alloc_block(fbm_t *FBM, b_ptr_t fbm_ptr, int birth, int home) {
+   // Tries the home group, then the thread's own one and the ones after it. The segment of FBM of a
+   // group is only up to date while the group is locked: it is read again when the lock is taken. The
+   // group of the block stays locked until the caller logs the FBM (log_groups) and unlocks it.
+   if(thread_group == -1) thread_group = __atomic_fetch_add(&next_group, 1, __ATOMIC_RELAXED) % ALLOC_GROUPS;
+   if(home < 0) home = thread_group;
+   int pending = 0;
+   for(int round=0; round<3; round++) {         // 0: busy groups are skipped, 1: waited for, 2: after a checkpoint
+      if(round == 2) {
+         if(!pending) break;
+         pthread_mutex_lock(&meta_lock);
+         log_checkpoint();                      // Only logged blocks are left: make them reusable
+         pthread_mutex_unlock(&meta_lock);
+      }
+      for(int k=0; k<=ALLOC_GROUPS; k++) {
+         int g = k == 0 ? home : (thread_group + k-1) % ALLOC_GROUPS;
+         if(k > 0 && g == home) continue;
+         int held = (held_groups >> g) & 1;
+         if(!held && __atomic_load_n(&groups[g].free, __ATOMIC_RELAXED) == 0) continue; // Full
+         if(!lock_group(g, round > 0 && (held_groups >> g) == 0)) continue; // Waits only for a group past those held
+         pthread_mutex_lock(&meta_lock);
+         if(!held)
+            memcpy(&FBM->mask[g*GROUP_BLOCKS], &log_image(fbm_ptr)[g*GROUP_BLOCKS], GROUP_BLOCKS);
+         b_ptr_t block = take_free(FBM, birth, g*GROUP_BLOCKS, GROUP_BLOCKS, &pending);
+         pthread_mutex_unlock(&meta_lock);
+         if(block != -1) return block;
+         if(!held) unlock_group(g);
+      }
+   }
+   return -1;
+}
+
+int lock_group(int g, int wait) {
+   if((held_groups >> g) & 1) return 1;
+   if(wait) pthread_mutex_lock(&groups[g].lock);
+   else if(pthread_mutex_trylock(&groups[g].lock) != 0) return 0;
+   held_groups |= 1u << g;
+   return 1;
+}
+
+void unlock_group(int g) {
+   held_groups &= ~(1u << g);
+   pthread_mutex_unlock(&groups[g].lock);
+}
+
+void lock_groups() {                            // Never called with a group held
+   for(int g=0; g<ALLOC_GROUPS; g++) lock_group(g, 1);
+}
+
+void unlock_groups() {
+   for(int g=0; g<ALLOC_GROUPS; g++)
+      if((held_groups >> g) & 1) unlock_group(g);
+}
+
+void log_groups(b_ptr_t fbm_ptr, fbm_t *FBM) {  // The other segments may have changed since FBM was read
+   fbm_t *merged = malloc(BLOCK_SIZE);
+   pthread_mutex_lock(&meta_lock);
+   memcpy(merged, log_image(fbm_ptr), BLOCK_SIZE);
+   for(int g=0; g<ALLOC_GROUPS; g++)
+      if((held_groups >> g) & 1)
+         memcpy(&merged->mask[g*GROUP_BLOCKS], &FBM->mask[g*GROUP_BLOCKS], GROUP_BLOCKS);
+   log_block(fbm_ptr, merged);
+   pthread_mutex_unlock(&meta_lock);
+   free(merged);
+}
+
+void count_free() {                             // log_block keeps the counts up to date afterwards
+   pthread_mutex_lock(&meta_lock);
+   unsigned char *mask = (unsigned char*) log_image(super_image->fbm_ptr);
+   for(int g=0; g<ALLOC_GROUPS; g++) {
+      int count = 0;
+      for(int i=g*GROUP_BLOCKS; i<(g+1)*GROUP_BLOCKS; i++) count += mask[i] == BLOCK_FREE;
+      __atomic_store_n(&groups[g].free, count, __ATOMIC_RELAXED);
+   }
+   pthread_mutex_unlock(&meta_lock);
+}
+
+int home_group(file_t *file, b_ptr_t near) {    // Next to its last block, else near (0: its inode, no group locked)
+   if(file->last > 0) return file->last/GROUP_BLOCKS;
+   if(near > 0) return near/GROUP_BLOCKS;
+   if(file->inode_id < 0) return -1;            // j-node: the thread's group
+   pthread_mutex_lock(&itable_lock);            // Only for a file's first block
+   b_ptr_t table = get_block_id(&fd_at(J_NODE)->file->inode, file->inode_id/(BLOCK_SIZE/sizeof(inode_t)));
+   pthread_mutex_unlock(&itable_lock);
+   // Files of one table block start in different groups from there: written at once, they do not interleave
+   return table > 0 ? (table/GROUP_BLOCKS + file->inode_id) % ALLOC_GROUPS : -1;
+}
+
+int is_writable(fbm_t *FBM, b_ptr_t block, super_block_t *sb) {
+   return FBM->mask[block] == sb->epoch;        // Free blocks are not: nothing of a file should be free
+}
+
+int next_epoch(super_block_t *sb, fbm_t *FBM) { // O(1), except once every LAST_EPOCH-FIRST_EPOCH calls
+   if(sb->epoch < LAST_EPOCH) {
+      sb->epoch++;
+      return 0;
+   }
+   for(int i=0; i<NUM_BLOCKS; i++) {            // Out of epochs: forget all births and start over
+      if(FBM->mask[i] >= FIRST_EPOCH) FBM->mask[i] = BLOCK_OLD;
+   }
+   sb->epoch = FIRST_EPOCH;
+   return 1;
+}
+
+void read_super(super_block_t *sb) {
+   pthread_mutex_lock(&meta_lock);
+   memcpy(sb, super_image, BLOCK_SIZE);
+   pthread_mutex_unlock(&meta_lock);
+}
+
+void write_super(super_block_t *sb) {           // Goes to the log like the other metadata
+   pthread_mutex_lock(&meta_lock);
+   sb->log_gen = super_image->log_gen;          // A checkpoint may have happened since sb was read
+   sb->seq = super_image->seq;
+   sb->crc = super_image->crc;
+   log_block(LOG_SUPER, sb);
+   pthread_mutex_unlock(&meta_lock);
+}
+
+void flush_super() {                            // A torn write only damages the older slot
+   super_image->seq = ++super_seq;
+   super_image->crc = 0;
+   super_image->crc = crc32c(0, super_image, sizeof(super_block_t));
+   super_slot = super_slot == SUPER_BLOCK ? SUPER_BLOCK_B : SUPER_BLOCK;
+   write_blocks(super_slot, 1, super_image);
+}
+
+int pick_super(super_block_t *sb) {             // Returns -1 if neither slot is valid
+   b_ptr_t slots[2] = { SUPER_BLOCK, SUPER_BLOCK_B };
+   super_block_t *slot = malloc(BLOCK_SIZE);
+   int found = -1;
+   for(int i=0; i<2; i++) {
+      read_blocks(slots[i], 1, slot);
+      uint32_t crc = slot->crc;
+      slot->crc = 0;
+      if(slot->magic != MAGIC || crc32c(0, slot, sizeof(super_block_t)) != crc) continue; // Torn or blank
+      if(found != -1 && slot->seq <= sb->seq) continue;
+      slot->crc = crc;
+      memcpy(sb, slot, BLOCK_SIZE);
+      super_slot = slots[i];
+      super_seq = slot->seq;
+      found = 0;
+   }
+   free(slot);
+   return found;
+}
+
+int read_logged(b_ptr_t start, int nblocks, void *buffer) { // Logged images win over the home copies
+   char few[LOG_BLOCKS];                        // Looked up first: a home copy read after that is not behind
+   char *logged = nblocks <= LOG_BLOCKS ? few : malloc(nblocks);
+   pthread_mutex_lock(&meta_lock);
+   for(int i=0; i<nblocks; i++) logged[i] = log_cache[start+i] != NULL;
+   pthread_mutex_unlock(&meta_lock);
+   int res = read_blocks(start, nblocks, buffer);
+   for(int i=0; i<nblocks; i++) {
+      b_ptr_t block = start+i;
+      char *data = (char*) buffer + i*BLOCK_SIZE;
+      pthread_mutex_lock(&meta_lock);
+      if(logged[i] || log_cache[block] != NULL) { // In memory: nothing to verify
+         if(log_cache[block] != NULL)
+            memcpy(data, log_cache[block], BLOCK_SIZE);
+         else                                   // Checkpointed since: the home copy is new now
+            read_blocks(block, 1, data);
+         pthread_mutex_unlock(&meta_lock);
+         continue;
+      }
+      int mode = __atomic_load_n(&verify_mode, __ATOMIC_RELAXED);
+      int check = !(mode == SSFS_VERIFY_SCRUB || (mode == SSFS_VERIFY_FIRST && __atomic_load_n(&verified[block], __ATOMIC_RELAXED)) || !checksummed(block));
+      uint32_t crc = __atomic_load_n(&block_crc[block], __ATOMIC_RELAXED);
+      pthread_mutex_unlock(&meta_lock);
+      if(!check) continue;
+      if(crc32c(0, data, BLOCK_SIZE) != crc) {  // Computed outside the lock
+         pthread_mutex_lock(&meta_lock);         // The block may have been rewritten meanwhile: look again
+         if(log_cache[block] != NULL)
+            memcpy(data, log_cache[block], BLOCK_SIZE);
+         else
+            read_blocks(block, 1, data);
+         int bad = log_cache[block] == NULL && crc32c(0, data, BLOCK_SIZE) != __atomic_load_n(&block_crc[block], __ATOMIC_RELAXED);
+         pthread_mutex_unlock(&meta_lock);
+         if(bad) {
+            printf("[DEBUG|read_logged] Block %d does not match its checksum.\n", block);
+            res = -1;
+            continue;
+         }
+      }
+      __atomic_store_n(&verified[block], 1, __ATOMIC_RELAXED); // Without meta_lock: a later write sets it too
+   }
+   if(logged != few) free(logged);
+   return res;
+}
+
+int read_data(b_ptr_t block, char *data) {      // Blocks of a file are never overwritten once it points at them
+   if(unwritten[block]) {                       // Fresh blocks are all 0s
+      memset(data, 0, BLOCK_SIZE);
+      return 0;
+   }
+   int res = read_blocks(block, 1, data);
+   int mode = __atomic_load_n(&verify_mode, __ATOMIC_RELAXED);
+   if(mode == SSFS_VERIFY_SCRUB || (mode == SSFS_VERIFY_FIRST && __atomic_load_n(&verified[block], __ATOMIC_RELAXED)) || !checksummed(block))
+      return res;
+   if(crc32c(0, data, BLOCK_SIZE) != __atomic_load_n(&block_crc[block], __ATOMIC_RELAXED)) {
+      printf("[DEBUG|read_data] Block %d does not match its checksum.\n", block);
+      return -1;
+   }
+   __atomic_store_n(&verified[block], 1, __ATOMIC_RELAXED);
+   return res;
+}
+
+int write_checked(b_ptr_t start, int nblocks, void *buffer) {
+   int res = write_blocks(start, nblocks, buffer);
+   for(int i=0; i<nblocks; i++) set_crc(start+i, (char*) buffer + i*BLOCK_SIZE);
+   return res;
+}
+
+void set_crc(b_ptr_t block, char *data) {       // The checksum is logged like any other metadata, once per sync point
+   if(!checksummed(block)) return;              // No lock: writes to independent files do not wait for each other
+   __atomic_store_n(&block_crc[block], crc32c(0, data, BLOCK_SIZE), __ATOMIC_RELAXED);
+   __atomic_store_n(&verified[block], 1, __ATOMIC_RELAXED);
+   __atomic_store_n(&crc_dirty[block/CRCS_PER_BLOCK], 1, __ATOMIC_RELEASE); // After the checksum (see take_crcs)
+}
+
+int take_crcs(int table, uint32_t *copy) {
+   // Cleared before the copy: a checksum set meanwhile is either in it or marks the table again
+   if(!__atomic_exchange_n(&crc_dirty[table], 0, __ATOMIC_ACQ_REL)) return 0;
+   for(int i=0; i<CRCS_PER_BLOCK; i++)
+      copy[i] = __atomic_load_n(&block_crc[table*CRCS_PER_BLOCK + i], __ATOMIC_RELAXED);
+   return 1;
+}
+
+void log_crcs() {                               // meta_lock held: same sync as the blocks they describe
+   uint32_t copy[CRCS_PER_BLOCK];
+   for(int table=0; table<CRC_BLOCKS; table++)
+      if(take_crcs(table, copy)) log_block(super_image->crc_ptr + table, copy);
+}
+
+void crcs_home() {                              // meta_lock held
+   uint32_t copy[CRCS_PER_BLOCK];
+   for(int table=0; table<CRC_BLOCKS; table++) {
+      if(!take_crcs(table, copy)) continue;
+      memcpy(log_image(super_image->crc_ptr + table), copy, BLOCK_SIZE);
+      dirty[super_image->crc_ptr + table] = 1;
+   }
+}
+
+int checksummed(b_ptr_t block) {                // Superblocks and log records have their own CRC
+   return block != SUPER_BLOCK && block != SUPER_BLOCK_B
+      && (block < super_image->log_ptr || block >= super_image->log_ptr + LOG_BLOCKS)
+      && (block < super_image->crc_ptr || block >= super_image->crc_ptr + CRC_BLOCKS);
+}
+
+char *log_image(b_ptr_t block) {
+   if(block == LOG_SUPER) return (char*) super_image;
+   if(log_cache[block] == NULL) {
+      log_cache[block] = malloc(BLOCK_SIZE);    // Malloc (freed by log_checkpoint)
+      read_blocks(block, 1, log_cache[block]);
+   }
+   return log_cache[block];
+}
+
+void log_block(b_ptr_t block, void *data) {    // Home copy is only written by the next checkpoint
+   pthread_mutex_lock(&meta_lock);
+   int size = block == LOG_SUPER ? sizeof(super_block_t) : BLOCK_SIZE;
+   char *image = log_image(block);
+   char *bytes = data;
+   int first = 0;
+   int last = size;
+   while(first < size && image[first] == bytes[first]) first++;
+   while(last > first && image[last-1] == bytes[last-1]) last--;
+   if(block == super_image->fbm_ptr) {          // Keep the free counts of the allocation groups in step
+      for(int i=first; i<last; i++) {
+         int change = (bytes[i] == BLOCK_FREE) - (image[i] == BLOCK_FREE);
+         if(change != 0) __atomic_add_fetch(&groups[i/GROUP_BLOCKS].free, change, __ATOMIC_RELAXED);
+      }
+   }
+   memcpy(image + first, bytes + first, last - first);
+   if(block != LOG_SUPER && first < last) dirty[block] = 1;
+
+   for(int pos=first; pos<last; pos+=LOG_PAYLOAD) { // Only the changed range is logged
+      int length = last-pos < LOG_PAYLOAD ? last-pos : LOG_PAYLOAD;
+      if(log_append(block, pos, image + pos, length) == -1) {
+         log_checkpoint();                      // Log is full: the change goes home with the others
+         break;
+      }
+   }
+   // Even if nothing changed: a fresh block may hold what it is given without having a checksum.
+   // Last, as it logs too (image may be gone after a checkpoint).
+   if(block != LOG_SUPER) set_crc(block, bytes);
+   pthread_mutex_unlock(&meta_lock);
+}
+
+int log_append(b_ptr_t block, int offset, char *bytes, int length) {
+   log_record_t rec = { .gen = super_image->log_gen, .block = block, .offset = offset, .length = length, .crc = 0 };
+   int room = BLOCK_SIZE - log_used % BLOCK_SIZE;
+   if(room < sizeof(log_record_t) + length) {   // Does not fit in this log block: go to the next one
+      if(room >= sizeof(log_record_t)) {        // Tell replay to do the same
+         log_record_t pad = { .gen = super_image->log_gen, .block = 0, .offset = 0, .length = 0, .crc = 0 };
+         pad.crc = crc32c(0, &pad, sizeof(log_record_t));
+         memcpy(log_buf + log_used, &pad, sizeof(log_record_t));
+      }
+      log_used += room;
+   }
+   int limit = LOG_BLOCKS*BLOCK_SIZE;           // There is always room left for the commit record (and a pad)
+   if(block != LOG_COMMIT) limit -= 2*sizeof(log_record_t);
+   if(log_used + sizeof(log_record_t) + length > limit) return -1;
+   rec.crc = crc32c(crc32c(0, &rec, sizeof(log_record_t)), bytes, length);
+   memcpy(log_buf + log_used, &rec, sizeof(log_record_t));
+   if(length > 0) memcpy(log_buf + log_used + sizeof(log_record_t), bytes, length);
+   log_used += sizeof(log_record_t) + length;
+   return 0;
+}
+
+void log_sync() {                               // Replay applies all of it or none of it (torn writes included)
+   pthread_mutex_lock(&meta_lock);
+   if(calls_open == 0) log_mark();              // Between calls: everything logged so far
+   if(log_synced < log_quiet) {                 // The records of the calls still open stay in memory
+      int first = log_synced/BLOCK_SIZE;        // Block of the oldest unsynced record (rewritten)
+      int last = (log_quiet-1)/BLOCK_SIZE;
+      write_blocks(super_image->log_ptr + first, last-first+1, log_buf + first*BLOCK_SIZE);
+      log_synced = log_quiet;
+   }
+   synced_seq = quiet_seq;                      // The blocks freed before it are free on disk too
+   // Checkpoints in the middle of an operation would send half of it home: do them here, between
+   // operations, early enough that the next one is unlikely to fill the log
+   if(calls_open == 0 && log_used > LOG_BLOCKS*BLOCK_SIZE/2) log_checkpoint();
+   pthread_mutex_unlock(&meta_lock);
+}
+
+void log_mark() {
+   log_crcs();
+   if(log_used != log_quiet) {
+      log_append(LOG_COMMIT, 0, NULL, 0);
+      log_quiet = log_used;
+   }
+   quiet_seq++;
+   pthread_cond_broadcast(&quiet_cond);         // For sync_to
+}
+
+void log_checkpoint() {                         // Homes first: a crash before the flip replays the same bytes again
+   pthread_mutex_lock(&meta_lock);
+   crcs_home();                                 // Checksums not logged yet go home with the blocks
+   pthread_mutex_lock(&home_lock);              // Waits for the flusher's home writes
+   for(int i=0; i<NUM_BLOCKS; i++) {
+      if(log_cache[i] == NULL) continue;
+      if(dirty[i]) write_blocks(i, 1, log_cache[i]); // The others went home with the flusher
+      dirty[i] = 0;
+      free(log_cache[i]);
+      log_cache[i] = NULL;
+   }
+   pthread_mutex_unlock(&home_lock);
+   super_image->log_gen++;                      // Older records are stale from now on
+   flush_super();
+   memset(log_buf, 0, LOG_BLOCKS*BLOCK_SIZE);
+   log_used = 0;
+   log_synced = 0;
+   log_quiet = 0;
+   pthread_mutex_unlock(&meta_lock);
+}
+
+void log_drop() {
+   pthread_mutex_lock(&meta_lock);
+   for(int i=0; i<NUM_BLOCKS; i++) {
+      free(log_cache[i]);
+      log_cache[i] = NULL;
+   }
+   memset(dirty, 0, NUM_BLOCKS);
+   memset(crc_dirty, 0, CRC_BLOCKS);
+   memset(log_buf, 0, LOG_BLOCKS*BLOCK_SIZE);
+   log_used = 0;
+   log_synced = 0;
+   log_quiet = 0;
+   pthread_mutex_unlock(&meta_lock);
+}
+
+int log_replay() {                              // Returns the number of records applied
+   read_blocks(super_image->log_ptr, LOG_BLOCKS, log_buf);
+   int gen = super_image->log_gen;              // Superblock records never change it
+   int count = 0;
+   int end = 0;                                 // Records after the last commit record are from a sync that did not finish
+   for(int pass=0; pass<2; pass++) {            // Pass 0 finds the end, pass 1 applies the records before it
+      int pos = 0;
+      while(pos + sizeof(log_record_t) <= LOG_BLOCKS*BLOCK_SIZE && (pass == 0 || pos < end)) {
+         int room = BLOCK_SIZE - pos % BLOCK_SIZE;
+         if(room < sizeof(log_record_t)) {      // Too small for a record: next log block
+            pos += room;
+            continue;
+         }
+         log_record_t rec;
+         memcpy(&rec, log_buf + pos, sizeof(log_record_t));
+         uint32_t crc = rec.crc;
+         rec.crc = 0;
+         if(rec.gen != gen || rec.length < 0 || sizeof(log_record_t) + rec.length > room) break; // End of the log
+         if(crc32c(crc32c(0, &rec, sizeof(log_record_t)), log_buf + pos + sizeof(log_record_t), rec.length) != crc) break; // Torn
+         if(rec.block == LOG_COMMIT) {
+            pos += sizeof(log_record_t);
+            if(pass == 0) end = pos;
+            continue;
+         }
+         if(rec.length == 0) {                  // Rest of this log block is unused
+            pos += room;
+            continue;
+         }
+         int size = rec.block == LOG_SUPER ? sizeof(super_block_t) : BLOCK_SIZE;
+         if(rec.block < LOG_SUPER || rec.block >= NUM_BLOCKS || rec.offset < 0 || rec.offset + rec.length > size) break;
+         if(pass == 1) {
+            memcpy(log_image(rec.block) + rec.offset, log_buf + pos + sizeof(log_record_t), rec.length);
+            if(rec.block != LOG_SUPER) dirty[rec.block] = 1;
+            count++;
+         }
+         pos += sizeof(log_record_t) + rec.length;
+      }
+   }
+   memset(log_buf, 0, LOG_BLOCKS*BLOCK_SIZE);   // Appending starts over after the checkpoint
+   return count;
+}
+
+int cow_block(file_t *file, int d_ptr_id, b_ptr_t old_block, int offset, char *buf, int length, cow_batch_t *cow, fbm_t *map, super_block_t *sb) {
+   if(cow->FBM == NULL) {                       // First block of the run: retrieve FBM once
+      cow->FBM = malloc(BLOCK_SIZE);            // Malloc (freed by cow_flush)
+      read_logged(sb->fbm_ptr, 1, cow->FBM);
+   }
+   if(d_ptr_id >= MAX_DIRECT_PTR && cow->ptr_file == NULL) { // Pointer file needs updating too
+      cow->ptr_file = malloc(BLOCK_SIZE);       // Malloc (freed by cow_flush)
+      read_logged(file->inode.i_ptr, 1, cow->ptr_file);
+      if(!is_writable(map, file->inode.i_ptr, sb)) { // Pointer file is read-only as well: copy it too
+         b_ptr_t new_i_ptr = alloc_block(cow->FBM, sb->fbm_ptr, sb->epoch, home_group(file, file->inode.i_ptr));
+         if(new_i_ptr == -1) return -1;
+         ref_live(file->inode.i_ptr, 0, sb);
+         ref_live(new_i_ptr, 1, sb);
+         map->mask[new_i_ptr] = sb->epoch;      // map was read before the run: later blocks of it see the copy
+         file->inode.i_ptr = new_i_ptr;
+      }
+   }
+   b_ptr_t new_block = alloc_block(cow->FBM, sb->fbm_ptr, sb->epoch, home_group(file, old_block)); // Groups stay locked for the run
+   if(new_block == -1) return -1;
+   file->last = new_block;
+
+   if(offset == 0 && length == BLOCK_SIZE) {    // Whole block is overwritten: no need for the old one
+      write_checked(new_block, 1, buf);
+      cache_update(new_block, buf);
+   } else {
+      char *block = calloc(BLOCK_SIZE, 1);      // Calloc                                    (19)
+      if(!unwritten[old_block] && read_logged(old_block, 1, block) == -1) { // Retrieve old block
+         free(block);                           // Corrupted: do not copy it with a fresh checksum
+         cow->FBM->mask[new_block] = BLOCK_FREE;
+         return -1;
+      }
+      memcpy(&block[offset], buf, length);      // Copy on write
+      write_checked(new_block, 1, block);       // Write to new block
+      cache_update(new_block, block);
+      free(block);                              // Free                                      (19)
+   }
+   unwritten[new_block] = 0;
+   ref_live(old_block, 0, sb);
+   ref_live(new_block, 1, sb);
+   map->mask[new_block] = sb->epoch;
+
+   if(d_ptr_id >= MAX_DIRECT_PTR)               // Pointers are only written back by cow_flush
+      cow->ptr_file->ptrs[d_ptr_id - MAX_DIRECT_PTR] = new_block;
+   else
+      file->inode.d_ptrs[d_ptr_id] = new_block;
+   return 0;
+}
+
+void cow_flush(file_t *file, cow_batch_t *cow, super_block_t *sb) {
+   if(cow->FBM == NULL) return;                 // No pending run
+   if(cow->ptr_file != NULL) {
+      log_block(file->inode.i_ptr, cow->ptr_file); // Update pointer file
+      free(cow->ptr_file);
+      cow->ptr_file = NULL;
+   }
+   log_groups(sb->fbm_ptr, cow->FBM);           // Update FBM
+   unlock_groups();
+   free(cow->FBM);
+   cow->FBM = NULL;
+   if(file->inode_id == -1) update_root(&file->inode); // j-node: lives in the superblock
+}
+
+void free_replaced(b_ptr_t *blocks, int count, super_block_t *sb) {
+   for(int g=0; g<ALLOC_GROUPS; g++)            // In order, like alloc_block
+      for(int i=0; i<count; i++)
+         if(blocks[i]/GROUP_BLOCKS == g) {
+            lock_group(g, 1);
+            break;
+         }
+   fbm_t *FBM = malloc(BLOCK_SIZE);             // Malloc                                    (23)
+   pthread_mutex_lock(&meta_lock);              // The FBM record goes to the sync that makes freed[] obsolete
+   read_logged(sb->fbm_ptr, 1, FBM);            // Up to date for the groups held
+   for(int i=0; i<count; i++) {
+      FBM->mask[blocks[i]] = BLOCK_FREE;        // Only the current root had it: cow_block already moved its count
+      unwritten[blocks[i]] = 0;
+      freed[blocks[i]] = quiet_seq+1;
+   }
+   log_groups(sb->fbm_ptr, FBM);
+   pthread_mutex_unlock(&meta_lock);
+   unlock_groups();
+   free(FBM);                                   // Free                                      (23)
+}
+
+void update_root(inode_t *root) {               // Writes the in-memory j-node back to the current root
+   super_block_t *sb = calloc(BLOCK_SIZE, 1);
+   read_super(sb);
+   sb->root = *root;
+   write_super(sb);
+   free(sb);
+}
+
+int load_snap_table(super_block_t *sb) {       // Fills the shadow root lookup cache
+   num_snap_blocks = 0;
+   snap_table_t *table = malloc(BLOCK_SIZE);
+   // Bounded by num_roots: a table block chained by an interrupted commit is not part of the table
+   for(b_ptr_t block = sb->snap_table; block != 0 && num_snap_blocks*SNAPS_PER_BLOCK < sb->num_roots; block = table->next) {
+      if(block < 0 || block > NUM_BLOCKS-1) {   // Broken chain
+         free(table);
+         return -1;
+      }
+      if(num_snap_blocks == snap_blocks_cap) {
+         snap_blocks_cap = snap_blocks_cap == 0 ? 8 : 2*snap_blocks_cap;
+         snap_blocks = realloc(snap_blocks, snap_blocks_cap*sizeof(b_ptr_t));
+      }
+      snap_blocks[num_snap_blocks++] = block;
+      read_logged(block, 1, table);
+   }
+   free(table);
+   return 0;
+}
+
+int get_snapshot(int cnum, snap_entry_t *entry) { // One block read, whatever the number of roots
+   if(cnum < 0 || cnum/SNAPS_PER_BLOCK >= num_snap_blocks) return -1;
+   snap_table_t *table = malloc(BLOCK_SIZE);
+   int res = read_logged(snap_blocks[cnum/SNAPS_PER_BLOCK], 1, table);
+   *entry = table->entries[cnum % SNAPS_PER_BLOCK];
+   free(table);
+   return res == -1 ? -1 : 0;
+}
+
+int set_snapshot_state(int cnum, int state) {
+   if(cnum < 0 || cnum/SNAPS_PER_BLOCK >= num_snap_blocks) return -1;
+   snap_table_t *table = malloc(BLOCK_SIZE);
+   read_logged(snap_blocks[cnum/SNAPS_PER_BLOCK], 1, table);
+   table->entries[cnum % SNAPS_PER_BLOCK].state = state;
+   log_block(snap_blocks[cnum/SNAPS_PER_BLOCK], table);
+   free(table);
+   return 0;
+}
+
+int swap_root(super_block_t *sb, int cnum) {   // Branch gets the current root and vice versa
+   if(cnum < 0 || cnum/SNAPS_PER_BLOCK >= num_snap_blocks) return -1;
+   snap_table_t *table = malloc(BLOCK_SIZE);
+   read_logged(snap_blocks[cnum/SNAPS_PER_BLOCK], 1, table);
+   inode_t root = table->entries[cnum % SNAPS_PER_BLOCK].root;
+   table->entries[cnum % SNAPS_PER_BLOCK].root = sb->root;
+   sb->root = root;
+   log_block(snap_blocks[cnum/SNAPS_PER_BLOCK], table);
+   free(table);
+   return 0;
+}
+
+int inode_blocks(inode_t *inode, b_ptr_t *blocks) { // Returns the number of blocks (-1 on error)
+   int count = (inode->size + BLOCK_SIZE-1)/BLOCK_SIZE;
+   if(inode->size <= 0) return 0;               // Empty or unused inode
+   if(count > MAX_DIRECT_PTR + BLOCK_SIZE/sizeof(b_ptr_t) || map_blocks(inode, 0, count, blocks) == -1)
+      return -1;
+   if(count > MAX_DIRECT_PTR) blocks[count++] = inode->i_ptr;
+   return count;
+}
+
+int walk_root(inode_t *root, int first, int count, void (*visit)(b_ptr_t, void*), void *arg) {
+   int num_inodes = root->size/sizeof(inode_t);
+   b_ptr_t *blocks = malloc((MAX_DIRECT_PTR + BLOCK_SIZE/sizeof(b_ptr_t) + 1)*sizeof(b_ptr_t));
+   inode_block_t *inode_block = malloc(BLOCK_SIZE);
+   int loaded = -1;                             // Index of the inode table block in inode_block
+   int pos = first;
+   for(; pos < first+count && pos < num_inodes; pos++) {
+      inode_t *inode = root;                    // Position -1 is the j-node itself
+      if(pos >= 0) {
+         int table_block = pos/(BLOCK_SIZE/sizeof(inode_t));
+         if(table_block != loaded) {
+            b_ptr_t block;
+            if(map_blocks(root, table_block, 1, &block) == -1 || read_logged(block, 1, inode_block) == -1) {
+               pos = -1;                        // Its inodes cannot be trusted
+               break;
+            }
+            loaded = table_block;
+         }
+         inode = &inode_block->inodes[pos % (BLOCK_SIZE/sizeof(inode_t))];
+      }
+      int n = inode_blocks(inode, blocks);
+      if(n == -1) {                             // Bad size or corrupt pointer file
+         pos = -1;
+         break;
+      }
+      for(int i=0; i<n; i++) visit(blocks[i], arg);
+   }
+   free(blocks);
+   free(inode_block);
+   return pos;                                  // Next position to visit (the visits before a corrupt block were made)
+}
+
+void visit_ref(b_ptr_t block, void *arg) {
+   refcnt[block] += *(int*) arg;
+}
+
+void visit_mark(b_ptr_t block, void *arg) {
+   ((char*) arg)[block] = 1;
+}
+
+void visit_own(b_ptr_t block, void *arg) {
+   char *keep = arg;
+   keep[block] = keep[block] == 0 ? 1 : 3;
+}
+
+void visit_live(b_ptr_t block, void *arg) {   // Walked first: the branches turn it into 3 if they share it
+   ((char*) arg)[block] = 4;
+}
+
+void ref_live(b_ptr_t block, int joins, super_block_t *sb) {
+   if(sb->commits == 0) return;                 // Counts only change once there are shadow roots
+   pthread_mutex_lock(&meta_lock);
+   refcnt[block] += joins ? -sb->commits : sb->commits; // Leaving: the commits made meanwhile reference it
+   int i = block/(BLOCK_SIZE/sizeof(unsigned short));
+   log_block(sb->refcnt_ptr+i, (char*) refcnt + i*BLOCK_SIZE); // Same sync as the pointer that changed
+   pthread_mutex_unlock(&meta_lock);
+}
+
+int swap_counts(inode_t *out, inode_t *in, super_block_t *sb) {
+   if(sb->commits == 0) return 0;               // Counts only change once there are shadow roots
+   while(sb->num_reconcile > RECONCILE_SLOTS-2) // Queue full: the oldest swap is walked now
+      if(reconcile_step(sb) == -1) return -1;
+   reconcile_t *walk = &sb->reconcile[sb->num_reconcile];
+   walk[0].root = *out;                         // Leaving: the commits made meanwhile reference it
+   walk[0].delta = sb->commits;
+   walk[0].pos = -1;
+   walk[1].root = *in;
+   walk[1].delta = -sb->commits;
+   walk[1].pos = -1;
+   sb->num_reconcile += 2;
+   return 0;
+}
+
+void log_refcnt(super_block_t *sb) {
+   for(int i=0; i<REFCNT_BLOCKS; i++)
+      log_block(sb->refcnt_ptr+i, (char*) refcnt + i*BLOCK_SIZE);
+}
+
+void reload_refcnt(super_block_t *sb) {        // Only called with the commit barrier held: nobody else changes them
+   read_logged(sb->refcnt_ptr, REFCNT_BLOCKS, refcnt);
+}
+
+int reconcile_step(super_block_t *sb) {         // Counts and queue go to the same sync
+   reconcile_t *walk = &sb->reconcile[0];
+   int pos = walk_root(&walk->root, walk->pos, RECLAIM_BATCH, visit_ref, &walk->delta);
+   if(pos == -1) {                              // Left to ssfs_fsck, like a corrupt shadow root
+      printf("[DEBUG|reclaim_step] A restored or checked out root is corrupt. Reclamation stopped.\n");
+      reload_refcnt(sb);
+      return -1;
+   }
+   walk->pos = pos;
+   log_refcnt(sb);
+   if(pos >= (int) (walk->root.size/sizeof(inode_t))) { // Done: the next one moves up
+      sb->num_reconcile--;
+      memmove(&sb->reconcile[0], &sb->reconcile[1], sb->num_reconcile*sizeof(reconcile_t));
+      memset(&sb->reconcile[sb->num_reconcile], 0, sizeof(reconcile_t));
+      sb->sweep = 1;                            // What the swap dropped can be freed
+   }
+   write_super(sb);
+   return 0;
+}
+
+int reclaim_step(super_block_t *sb) {           // Returns 1 if there is work left, 0 otherwise
+   // Root swaps first: until their counts are right, the sweep would free blocks in use
+   if(sb->num_reconcile > 0) return reconcile_step(sb) == 0;
+   snap_entry_t entry;
+   if(sb->reclaim_cnum == -1) {                 // Look for the next deleted shadow root
+      for(int i=0; i<sb->num_roots; i++) {
+         if(get_snapshot(i, &entry) == 0 && entry.state == SNAP_DELETED) {
+            sb->reclaim_cnum = i;
+            sb->reclaim_pos = -1;
+            break;
+         }
+      }
+      if(sb->reclaim_cnum == -1) {              // Everything released
+         if(!sb->sweep || sweep_blocks(sb) == -1) return 0;
+         sb->sweep = 0;
+         write_super(sb);
+         return 0;
+      }
+   }
+   if(get_snapshot(sb->reclaim_cnum, &entry) == -1) return 0;
 
-      if(b_id == -1) return -1;
+   int delta = -1;                              // Release the shadow root's references
+   int pos = walk_root(&entry.root, sb->reclaim_pos, RECLAIM_BATCH, visit_ref, &delta);
+   if(pos == -1) {                              // Left to ssfs_fsck: releasing only part of it would free blocks in use
+      printf("[DEBUG|reclaim_step] Shadow root %d is corrupt. Reclamation stopped.\n", sb->reclaim_cnum);
+      reload_refcnt(sb);
+      return 0;
+   }
+   sb->reclaim_pos = pos;
+   log_refcnt(sb);                              // Same sync as the position: counts and position agree
+   if(sb->reclaim_pos < (int) (entry.root.size/sizeof(inode_t))) {
+      write_super(sb);                          // Remember where we are
+      return 1;
+   }
 
-      char *current_block = calloc(BLOCK_SIZE, 1); // Allocate a whole block                    (17) 
-      read_blocks(b_id, 1, current_block);         // Retrieve current_block
+   // Whole tree released. The sweep walks every writable root, so it is done once for all
+   // the shadow roots released in a row (e.g. a merge) rather than once per shadow root.
+   set_snapshot_state(sb->reclaim_cnum, SNAP_RECLAIMED);
+   sb->reclaim_cnum = -1;
+   sb->sweep = 1;
+   write_super(sb);
+   return 1;                                    // Other deleted shadow roots or the sweep are waiting
+}
 
-      // bytes to write = min(length, BLOCK_SIZE - offset of current write pointer)
-      int bytes_to_read = length < BLOCK_SIZE-*offset ? length : BLOCK_SIZE-*offset;
-      memcpy(buf, &current_block[*offset], bytes_to_read);// Perform read
+int sweep_blocks(super_block_t *sb) {           // Frees the read-only blocks nobody references anymore
+   char *keep = calloc(NUM_BLOCKS, 1);          // 1: used by a branch, 4: by the current root, 2: metadata, 3: by several
+   int bad = walk_root(&sb->root, -1, sb->root.size/sizeof(inode_t)+1, visit_live, keep) == -1; // +1: the j-node itself
+   keep[SUPER_BLOCK] = 2;
+   keep[SUPER_BLOCK_B] = 2;
+   for(int i=0; i<REFCNT_BLOCKS; i++) keep[sb->refcnt_ptr+i] = 2;
+   keep[sb->fbm_ptr] = 2;
+   for(int i=0; i<LOG_BLOCKS; i++) keep[sb->log_ptr+i] = 2;
+   for(int i=0; i<CRC_BLOCKS; i++) keep[sb->crc_ptr+i] = 2;
+   for(int i=0; i<num_snap_blocks; i++) keep[snap_blocks[i]] = 2;
+   snap_entry_t other;
+   for(int i=0; i<sb->num_roots; i++) {         // Branches are writable roots too
+      if(get_snapshot(i, &other) == -1)
+         bad = 1;
+      else if(other.state == SNAP_BRANCH && walk_root(&other.root, -1, other.root.size/sizeof(inode_t)+1, visit_own, keep) == -1)
+         bad = 1;
+   }
+   if(bad) {                                    // Blocks it uses would look unused
+      printf("[DEBUG|sweep_blocks] A writable root is corrupt. Nothing freed.\n");
+      free(keep);
+      return -1;
+   }
 
-      length -= bytes_to_read;                     // Update length
-      total_bytes_read += bytes_to_read;           // Increment total bytes read
-      buf = &buf[bytes_to_read];                   // Increment buf pointer
+   wait_readers();                              // Lock-free reads of a deleted or swapped out root may be on its blocks
+   fbm_t *FBM = malloc(BLOCK_SIZE);
+   read_logged(sb->fbm_ptr, 1, FBM);
+   for(int i=0; i<NUM_BLOCKS; i++) {
+      unsigned short refs = keep[i] == 4 ? refcnt[i] + sb->commits : refcnt[i];
+      if(FBM->mask[i] == BLOCK_FREE || FBM->mask[i] == sb->epoch || refs != 0 || keep[i] == 2 || keep[i] == 3) continue;
+      if(keep[i] != 0) {                        // Only one writable root has it: writable in place again
+         FBM->mask[i] = sb->epoch;
+         continue;
+      }
+      FBM->mask[i] = BLOCK_FREE;                // Nobody has it: back to the allocator
+      unwritten[i] = 0;
+      freed[i] = quiet_seq+1;
+   }
+   log_block(sb->fbm_ptr, FBM);
+   free(FBM);
+   free(keep);
+   return 0;
+}
+
+char *fsck_block(char *disk, b_ptr_t block) {  // Logged images win over the home copies, like read_logged
+   return log_cache[block] != NULL ? log_cache[block] : disk + block*BLOCK_SIZE;
+}
 
-      ssfs_frseek(fileID, virt_addr_to_bytes(fdt[fileID]->read_ptr) + bytes_to_read);//move rptr
-      free(current_block);                         // Free                                      (17)
+int fsck_blocks(char *disk, inode_t *inode, b_ptr_t *blocks, int *bad) {
+   // Same as inode_blocks, but every pointer index gets an entry (0 if the pointer is bad) and the
+   // pointer file, if any, comes last. Returns the number of entries and counts bad pointers in *bad.
+   if(inode->size <= 0) return 0;
+   int count = (inode->size + BLOCK_SIZE-1)/BLOCK_SIZE;
+   if(count > MAX_FILE_BLOCKS) {
+      (*bad)++;
+      count = MAX_FILE_BLOCKS;
    }
-   return total_bytes_read;
+   ptr_file_t *ptr_file = NULL;
+   if(count > MAX_DIRECT_PTR) {
+      if(inode->i_ptr <= 0 || inode->i_ptr > NUM_BLOCKS-1)
+         (*bad)++;                              // Indirect blocks are lost
+      else
+         ptr_file = (ptr_file_t*) fsck_block(disk, inode->i_ptr);
+   }
+   for(int i=0; i<count; i++) {
+      blocks[i] = 0;
+      if(i >= MAX_DIRECT_PTR && ptr_file == NULL) continue;
+      b_ptr_t block = i < MAX_DIRECT_PTR ? inode->d_ptrs[i] : ptr_file->ptrs[i - MAX_DIRECT_PTR];
+      if(block <= 0 || block > NUM_BLOCKS-1) {
+         (*bad)++;
+         continue;
+      }
+      blocks[i] = block;
+   }
+   if(ptr_file != NULL) blocks[count++] = inode->i_ptr;
+   return count;
 }
 
-int ssfs_remove(char *file){
-   super_block_t *sb = malloc(BLOCK_SIZE);         // malloc                                    //3
-   read_blocks(SUPER_BLOCK, 1, sb);
-   int inode_id = get_inode_id(file, sb);
+void *fsck_worker(void *arg) {                  // Only reads the image, the jobs it owns and block_crc
+   fsck_worker_t *worker = arg;
+   if(worker->pass == 1) {
+      for(int i=worker->first; i<NUM_BLOCKS; i+=worker->stride) {
+         if(!worker->check[i] || crc32c(0, fsck_block(worker->disk, i), BLOCK_SIZE) == block_crc[i]) continue;
+         printf("[DEBUG|ssfs_fsck] Block %d does not match its checksum.\n", i);
+         worker->check[i] = 2;                  // Only this thread looks at block i
+         worker->problems++;
+      }
+      return NULL;
+   }
+   for(int j=worker->first; j<worker->num_jobs; j+=worker->stride) {
+      fsck_job_t *job = &worker->jobs[j];
+      inode_block_t *table = (inode_block_t*) fsck_block(worker->disk, job->block);
+      for(int k=0; k<job->limit; k++) {
+         inode_t *inode = &table->inodes[k];
+         job->counts[k] = 0;
+         job->status[k] = FSCK_UNUSED;
+         if(inode->size == -1) continue;
+         int bad = inode->size < -1;
+         if(!bad) job->counts[k] = fsck_blocks(worker->disk, inode, job->blocks + k*(MAX_FILE_BLOCKS+1), &bad);
+         job->status[k] = bad ? FSCK_BAD : FSCK_USED;
+         if(bad) {
+            printf("[DEBUG|ssfs_fsck] Inode %d (table block %d) has a bad size or %d bad pointer(s).\n", job->first_id+k, job->block, bad);
+            job->problems++;
+         }
+      }
+   }
+   return NULL;
+}
 
-   if(inode_id == -1) {
-      printf("[DEBUG|ssfs_remove] File not found. Aborting\n");
-      free(sb);                                                                                 //3
-      return -1;
+int fsck_run(fsck_worker_t *workers, int threads, int pass) {
+   int problems = 0;
+   char *started = calloc(threads, 1);
+   for(int i=0; i<threads; i++) {
+      workers[i].pass = pass;
+      workers[i].problems = 0;
+      started[i] = pthread_create(&workers[i].thread, NULL, fsck_worker, &workers[i]) == 0;
+      if(!started[i]) fsck_worker(&workers[i]); // No thread: do its share here
    }
+   for(int i=0; i<threads; i++) {
+      if(started[i]) pthread_join(workers[i].thread, NULL);
+      problems += workers[i].problems;
+   }
+   free(started);
+   return problems;
+}
 
-   for(int i=0; i<NUM_BLOCKS; i++) {               // Starting at 2 since 2 first entries are reserved
-      if(fdt[i] == NULL || i == J_NODE || i == ROOT_DIR) continue; // Ignore if null
-      if(inode_id == fdt[i]->inode_id) ssfs_fclose(i);   // Close if is an entry for our file
+int fsck_dir(char *disk, fsck_root_t *root, fsck_job_t *jobs) { // Entry i-1 belongs to inode i
+   int inodes_per_block = BLOCK_SIZE/sizeof(inode_t);
+   int entries_per_block = BLOCK_SIZE/DIR_ENTRY_SIZE;
+   int num_inodes = root->root.size/sizeof(inode_t);
+   fsck_job_t *job = &jobs[root->jobs[0]];
+   inode_t *dir = &((inode_block_t*) fsck_block(disk, job->block))->inodes[0];
+   int num_entries = dir->size < 0 ? 0 : dir->size/DIR_ENTRY_SIZE;
+   int problems = 0;
+   for(int e=0; e<num_entries || e<num_inodes-1; e++) {
+      int id = e+1;
+      int status = FSCK_UNUSED;
+      if(id < num_inodes) {
+         if(id/inodes_per_block >= root->num_tables || root->jobs[id/inodes_per_block] == -1) continue; // Reported already
+         status = jobs[root->jobs[id/inodes_per_block]].status[id % inodes_per_block];
+      }
+      dir_entry_t *entry = NULL;
+      if(e < num_entries && e/entries_per_block < job->counts[0] && job->blocks[e/entries_per_block] != 0)
+         entry = &((dir_t*) fsck_block(disk, job->blocks[e/entries_per_block]))->files[e % entries_per_block];
+      int named = entry != NULL && entry->filename[0] != 0;
+      if(status == FSCK_UNUSED && named) {
+         printf("[DEBUG|ssfs_fsck] Root %d: directory entry %d has a name but inode %d is not in use.\n", root->cnum, e, id);
+         problems++;
+      } else if(status != FSCK_UNUSED && !named) {
+         printf("[DEBUG|ssfs_fsck] Root %d: inode %d has no directory entry.\n", root->cnum, id);
+         problems++;
+      } else if(named && (entry->inode_id != id || memchr(entry->filename, 0, FILENAME_SIZE+1) == NULL)) {
+         printf("[DEBUG|ssfs_fsck] Root %d: directory entry %d is corrupt.\n", root->cnum, e);
+         problems++;
+      }
    }
+   return problems;
+}
 
-   fbm_t *FBM = malloc(BLOCK_SIZE);                                                             //4
-   wm_t *WM = malloc(BLOCK_SIZE);                  // Necessary for read-only blocks            //5
-   read_blocks(sb->fbm_ptrs[sb->current_root], 1, FBM);
-   read_blocks(sb->wm_ptrs[sb->current_root], 1, WM);
-   ssfs_frseek(J_NODE, inode_id*sizeof(inode_t));
-   inode_t *inode = malloc(sizeof(inode_t));                                                    //6
-   ssfs_fread(J_NODE, (char*) inode, sizeof(inode_t));  // Retrieve inode
+dir_entry_t *load_dir(inode_t *root) {         // Reads the root dir of a (shadow) root
+   if(root->size < sizeof(inode_t))               // Empty root (full send): no entries
+      return calloc(DIR_ENTRY_SIZE, 1);
+   inode_block_t *inode_block = malloc(BLOCK_SIZE);
+   b_ptr_t table;
+   if(map_blocks(root, 0, 1, &table) == -1) {
+      free(inode_block);
+      return NULL;
+   }
+   int res = read_logged(table, 1, inode_block);
+   inode_t dir = inode_block->inodes[0];          // Inode 0 is the root dir
+   free(inode_block);
+   if(res == -1) return NULL;
 
-   // Time to free everything we gave to the inode
-   for(int i=0; i<(inode->size/BLOCK_SIZE); i++) {
-      b_ptr_t block_to_free = get_block_id(inode, i);
-      if(block_to_free == -1) break;
-      if(WM->mask[block_to_free] == 1) FBM->mask[block_to_free] = 1;
+   int count = (dir.size + BLOCK_SIZE-1)/BLOCK_SIZE;
+   int size = count*BLOCK_SIZE;                   // Room for an entry per inode, even past the end
+   if(size < root->size/sizeof(inode_t)*DIR_ENTRY_SIZE) size = root->size/sizeof(inode_t)*DIR_ENTRY_SIZE;
+   dir_entry_t *entries = calloc(size + DIR_ENTRY_SIZE, 1);
+   b_ptr_t *blocks = malloc((count+1)*sizeof(b_ptr_t));
+   if(map_blocks(&dir, 0, count, blocks) == -1) {
+      free(blocks);
+      free(entries);
+      return NULL;
    }
-   if(inode->i_ptr != 0) FBM->mask[inode->i_ptr] = 1;
-   write_blocks(sb->fbm_ptrs[sb->current_root], 1, FBM);
-   free(FBM);                                                                                   //4
-   free(WM);                                                                                    //5
-   free(inode);                                                                                 //6
+   for(int i=0; i<count; i++) {
+      if(read_logged(blocks[i], 1, (char*) entries + i*BLOCK_SIZE) == -1) {
+         free(blocks);
+         free(entries);
+         return NULL;
+      }
+   }
+   free(blocks);
+   return entries;
+}
 
-   inode_t *unused_inode = calloc(sizeof(inode_t), 1);                                          //7
-   unused_inode->size = -1;                        // Indicate inode is unused
+int send_cb(int type, const char *name, int first_block, int num_blocks, void *arg) {
+   send_ctx_t *ctx = arg;
+   if(type == SSFS_DIFF_DELETED) {
+      if(ctx->pass != 0) return 0;
+      stream_record_t rec = { .type = REC_DELETE };
+      strncpy(rec.name, name, FILENAME_SIZE);
+      return send_record(ctx->out_fd, &rec, NULL);
+   }
+   if(ctx->pass != 1) return 0;
 
-   ssfs_fwseek(J_NODE, inode_id*sizeof(inode_t));  // Move write pointer of current root to inode
-   ssfs_fwrite(J_NODE, (char*) unused_inode, sizeof(inode_t)); // Delete inode
-   sb->num_inodes--;                               // Update number of inodes
-   write_blocks(SUPER_BLOCK, 1, sb);
+   if(strncmp(ctx->name, name, FILENAME_SIZE) != 0) { // First range of this file
+      if(find_file(ctx->root, ctx->dir, name, &ctx->inode) == -1) return -1;
+      strncpy(ctx->name, name, FILENAME_SIZE);
+      stream_record_t rec = { .type = REC_FILE, .size = ctx->inode.size };
+      strncpy(rec.name, name, FILENAME_SIZE);
+      if(send_record(ctx->out_fd, &rec, NULL) == -1) return -1;
+   }
 
-   // Removing directory entry
-   char *empty_array = calloc(DIR_ENTRY_SIZE, 1);                                               //8
-   ssfs_fwseek(ROOT_DIR, (inode_id-1)*DIR_ENTRY_SIZE);
-   ssfs_fwrite(ROOT_DIR, empty_array, DIR_ENTRY_SIZE);
+   int count = (ctx->inode.size + BLOCK_SIZE-1)/BLOCK_SIZE; // Blocks past the end are gone: the size says so
+   if(first_block + num_blocks > count) num_blocks = first_block < count ? count - first_block : 0;
+   b_ptr_t blocks[SEND_BATCH];
+   for(int done=0; done<num_blocks; ) {
+      int n = num_blocks-done < SEND_BATCH ? num_blocks-done : SEND_BATCH;
+      if(map_blocks(&ctx->inode, first_block+done, n, blocks) == -1) return -1;
+      for(int i=0; i<n; ) {                     // Read runs of contiguous blocks with one call
+         int run = 1;
+         while(i+run < n && blocks[i+run] == blocks[i]+run) run++;
+         if(read_logged(blocks[i], run, ctx->buf + i*BLOCK_SIZE) == -1) return -1; // Not sent with a fresh checksum
+         i += run;
+      }
+      stream_record_t rec = { .type = REC_DATA, .first_block = first_block+done, .num_blocks = n };
+      if(send_record(ctx->out_fd, &rec, ctx->buf) == -1) return -1;
+      done += n;
+   }
+   return 0;
+}
 
-   free(empty_array);                                                                           //8
-   free(unused_inode);                                                                          //7
-   free(sb);                                                                                    //3
+int send_record(int out_fd, stream_record_t *rec, char *payload) {
+   int length = rec->type == REC_DATA ? rec->num_blocks*BLOCK_SIZE : 0;
+   char packed[STREAM_RECORD_SIZE];
+   rec->crc = 0;
+   pack_record(rec, packed);
+   rec->crc = crc32c(crc32c(0, packed, STREAM_RECORD_SIZE), payload, length);
+   put32(packed + STREAM_RECORD_SIZE-4, rec->crc);
+   if(write_full(out_fd, packed, STREAM_RECORD_SIZE) == -1) return -1;
+   if(length > 0 && write_full(out_fd, payload, length) == -1) return -1;
    return 0;
 }
 
-/**********************************************************************************************/
+void pack_header(stream_header_t *header, char *out) { // The same bytes whatever the host
+   memcpy(out, header->magic, 8);
+   put32(out + 8, header->version);
+   put32(out + 12, header->block_size);
+   put32(out + 16, header->from);
+   put32(out + 20, header->to);
+   put32(out + 24, header->base);
+   put32(out + 28, header->result);
+   put32(out + 32, 0);
+   header->crc = crc32c(0, out, STREAM_HEADER_SIZE);
+   put32(out + 32, header->crc);
+}
 
-b_ptr_t get_block_id(inode_t *inode, int d_ptr_id) {
-   if(d_ptr_id < 0 || d_ptr_id >= (MAX_DIRECT_PTR + BLOCK_SIZE/sizeof(b_ptr_t)))
-      return -1;
+int unpack_header(char *in, stream_header_t *header) {
+   memcpy(header->magic, in, 8);
+   header->version = get32(in + 8);
+   header->block_size = get32(in + 12);
+   header->from = get32(in + 16);
+   header->to = get32(in + 20);
+   header->base = get32(in + 24);
+   header->result = get32(in + 28);
+   header->crc = get32(in + 32);
+   put32(in + 32, 0);
+   return memcmp(header->magic, STREAM_MAGIC, 8) == 0 && header->version == STREAM_VERSION && header->block_size == BLOCK_SIZE
+      && header->from >= -1 && header->to >= 0 && crc32c(0, in, STREAM_HEADER_SIZE) == header->crc ? 0 : -1;
+}
 
-   if(d_ptr_id >= MAX_DIRECT_PTR) {             // Need to look into indirect ptr
-      b_ptr_t i_ptr = inode->i_ptr;             // Get indirect pointer
-      if(i_ptr == 0) return 0;                  // If indirect pointer not initialized, delegate to caller
+void pack_record(stream_record_t *rec, char *out) {
+   put32(out, rec->type);
+   memcpy(out + 4, rec->name, FILENAME_SIZE+2);
+   put32(out + 16, rec->size);
+   put32(out + 20, rec->first_block);
+   put32(out + 24, rec->num_blocks);
+   put32(out + 28, rec->crc);
+}
 
-      ptr_file_t *ptr_file = malloc(BLOCK_SIZE);// Malloc                                    (13)
-      read_blocks(i_ptr, 1, ptr_file);          // Retrieve pointer file
+void unpack_record(char *in, stream_record_t *rec) {
+   rec->type = get32(in);
+   memcpy(rec->name, in + 4, FILENAME_SIZE+2);
+   rec->size = get32(in + 16);
+   rec->first_block = get32(in + 20);
+   rec->num_blocks = get32(in + 24);
+   rec->crc = get32(in + 28);
+}
 
-      b_ptr_t ptr = ptr_file->ptrs[d_ptr_id - MAX_DIRECT_PTR];
-      free(ptr_file);                           // Free                                      (13)
-      if(ptr > NUM_BLOCKS-1) return -1;
-      return ptr;
+void put32(char *out, uint32_t value) {
+   for(int i=0; i<4; i++) out[i] = value >> 8*i;
+}
+
+uint32_t get32(char *in) {
+   uint32_t value = 0;
+   for(int i=0; i<4; i++) value |= (uint32_t) (unsigned char) in[i] << 8*i;
+   return value;
+}
+
+int root_fingerprint(inode_t *root, uint32_t *sum) { // Inode numbers and block addresses left out: same on any disk
+   *sum = 0;                                    // XOR of one CRC32C per file: the order of the files does not matter
+   dir_entry_t *dir = load_dir(root);
+   if(dir == NULL) return -1;
+   b_ptr_t *blocks = malloc(MAX_FILE_BLOCKS*sizeof(b_ptr_t));
+   char *block = malloc(BLOCK_SIZE);
+   int res = 0;
+   for(int i=1; i<root->size/sizeof(inode_t) && res == 0; i++) {
+      if(dir[i-1].filename[0] == 0) continue;   // Free inode
+      inode_t inode;
+      char head[FILENAME_SIZE+4] = {0};         // Name, then size
+      strncpy(head, dir[i-1].filename, FILENAME_SIZE);
+      int count = 0;
+      if(get_root_inode(root, i, &inode) == -1
+         || map_blocks(&inode, 0, count = (inode.size + BLOCK_SIZE-1)/BLOCK_SIZE, blocks) == -1) {
+         res = -1;
+         break;
+      }
+      put32(head + FILENAME_SIZE, inode.size);
+      uint32_t crc = crc32c(0, head, sizeof(head));
+      for(int j=0; j<count; j++) {
+         if(read_logged(blocks[j], 1, block) == -1) {
+            res = -1;
+            break;
+         }
+         int used = inode.size - j*BLOCK_SIZE < BLOCK_SIZE ? inode.size - j*BLOCK_SIZE : BLOCK_SIZE;
+         crc = crc32c(crc, block, used);        // Bytes past the end are not part of the file
+      }
+      *sum ^= crc;
    }
-   if(inode->d_ptrs[d_ptr_id]>NUM_BLOCKS)
-      return -1;
+   free(block);
+   free(blocks);
+   free(dir);
+   return res;
+}
 
-   return inode->d_ptrs[d_ptr_id];
+int snapshot_fingerprint(int cnum, uint32_t *sum) {
+   pthread_rwlock_rdlock(&commit_lock);            // Shadow roots do not change under it
+   snap_entry_t entry;
+   int res = get_snapshot(cnum, &entry) == -1 || entry.state != SNAP_LIVE ? -1 : root_fingerprint(&entry.root, sum);
+   pthread_rwlock_unlock(&commit_lock);
+   return res;
+}
+
+int write_full(int fd, void *buf, int length) { // write() until everything is out (pipes)
+   while(length > 0) {
+      ssize_t n = write(fd, buf, length);
+      if(n <= 0) return -1;
+      buf = (char*) buf + n;
+      length -= n;
+   }
+   return 0;
+}
+
+int read_full(int fd, void *buf, int length) {  // read() until everything is in (pipes)
+   while(length > 0) {
+      ssize_t n = read(fd, buf, length);
+      if(n <= 0) return -1;
+      buf = (char*) buf + n;
+      length -= n;
+   }
+   return 0;
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, int length) { // CRC-32C (Castagnoli)
+   pthread_once(&crc_once, crc32c_init);        // Any thread may be the first one to checksum
+#ifdef CRC32C_HW
+   if(crc_hw) return crc32c_hw(crc, data, length);
+#endif
+   const unsigned char *p = data;
+   crc = ~crc;
+   for(int i=0; i<length; i++) crc = crc_table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+   return ~crc;
+}
+
+void crc32c_init() {
+#ifdef CRC32C_HW
+   crc_hw = crc32c_hw_supported();
+#endif
+   for(uint32_t i=0; i<256; i++) {
+      uint32_t c = i;
+      for(int k=0; k<8; k++) c = c & 1 ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+      crc_table[i] = c;
+   }
+}
+
+#if defined(CRC32C_HW) && defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hw(uint32_t crc, const void *data, int length) { // 8 bytes per instruction
+   const unsigned char *p = data;
+   uint64_t c = ~crc;
+   for(; length >= 8; p += 8, length -= 8) {
+      uint64_t word;
+      memcpy(&word, p, 8);                      // Unaligned safe
+      c = _mm_crc32_u64(c, word);
+   }
+   for(; length > 0; p++, length--) c = _mm_crc32_u8(c, *p);
+   return ~c;
+}
+
+int crc32c_hw_supported() {
+   return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(CRC32C_HW)
+uint32_t crc32c_hw(uint32_t crc, const void *data, int length) {
+   const unsigned char *p = data;
+   crc = ~crc;
+   for(; length >= 8; p += 8, length -= 8) {
+      uint64_t word;
+      memcpy(&word, p, 8);
+      crc = __crc32cd(crc, word);
+   }
+   for(; length > 0; p++, length--) crc = __crc32cb(crc, *p);
+   return ~crc;
+}
+
+int crc32c_hw_supported() {                     // Built for a CPU with the CRC extension
+   return 1;
+}
+#endif
+
+int get_root_inode(inode_t *root, int inode_id, inode_t *inode) { // Reads an inode of any root
+   if(inode_id < 0 || inode_id >= root->size/sizeof(inode_t)) return -1;
+   b_ptr_t table;
+   if(map_blocks(root, inode_id/(BLOCK_SIZE/sizeof(inode_t)), 1, &table) == -1) return -1;
+   inode_block_t *inode_block = malloc(BLOCK_SIZE);
+   int res = read_logged(table, 1, inode_block);
+   *inode = inode_block->inodes[inode_id % (BLOCK_SIZE/sizeof(inode_t))];
+   free(inode_block);
+   return res == -1 || inode->size < 0 ? -1 : 0;
+}
+
+int find_file(inode_t *root, dir_entry_t *dir, const char *name, inode_t *inode) {
+   for(int i=1; i<root->size/sizeof(inode_t); i++) {
+      if(strncmp(dir[i-1].filename, name, FILENAME_SIZE) == 0 && get_root_inode(root, i, inode) == 0)
+         return i;
+   }
+   return -1;
 }
 
 int add_new_block(inode_t *inode, int inode_id, int d_ptr_id, b_ptr_t new_block, super_block_t *sb, int write_size) {
    if(d_ptr_id >= MAX_DIRECT_PTR + BLOCK_SIZE/sizeof(b_ptr_t) || sb == NULL || d_ptr_id < 0)
       return -1;
 
-   char *empty_block = calloc(BLOCK_SIZE, 1);                                             //9
-   write_blocks(new_block, 1, empty_block);     // Wipe out block
-   free(empty_block);                                                                     //9
-   wm_t *FBM = malloc(BLOCK_SIZE);           // malloc                                 (16)
-   read_blocks(sb->fbm_ptrs[sb->current_root], 1, FBM);           // Retrieve FBM
-   FBM->mask[new_block] = 0;                 // Update new block
-   write_blocks(sb->fbm_ptrs[sb->current_root], 1, FBM);          // Update FBM
+   // Both the block and a new pointer file are taken from one copy of the FBM, written once
+   fbm_t *FBM = malloc(BLOCK_SIZE);           // malloc                                 (16)
+   read_logged(sb->fbm_ptr, 1, FBM);           // Retrieve FBM
+   FBM->mask[new_block] = sb->epoch;           // Born now: writable until the next commit
+   b_ptr_t *i_ptr = &inode->i_ptr;             // Get indirect pointer
+   int new_ptr_file = d_ptr_id >= MAX_DIRECT_PTR && (*i_ptr == 0 || d_ptr_id == MAX_DIRECT_PTR);
+   if(new_ptr_file) {                          // If indirect pointer not yet initialized
+      *i_ptr = alloc_block(FBM, sb->fbm_ptr, sb->epoch, new_block/GROUP_BLOCKS); // "create" a new pointer file
+      if(*i_ptr == -1) {
+         free(FBM);                            // Free                                   (16)
+         return -1;
+      }
+      unwritten[*i_ptr] = 1;                   // No stale pointers from a previous owner
+   }
+   log_groups(sb->fbm_ptr, FBM);               // Update FBM (before the j-node writes below allocate too)
+   unlock_groups();                            // They take their own groups (after itable_lock)
+   free(FBM);                                  // Free                                   (16)
+   ref_live(new_block, 1, sb);
+   if(new_ptr_file) ref_live(*i_ptr, 1, sb);
+   unwritten[new_block] = 1;                   // Reads see 0s until the caller writes the data
 
    if(d_ptr_id >= MAX_DIRECT_PTR) {// Need to look into indirect ptr
-      b_ptr_t *i_ptr = &inode->i_ptr;           // Get indirect pointer
-      if(*i_ptr == 0 || d_ptr_id == 14) {       // If indirect pointer not yet initialized
-         *i_ptr = get_unused_block();           // "create" a new pointer file
-         if(*i_ptr == -1) {
-            free(FBM);                          // Free                                   (16)
-            return -1;
-         }
-
-         FBM->mask[*i_ptr] = 0;                 // Update pointer block status
-         write_blocks(sb->fbm_ptrs[sb->current_root], 1, FBM);       // Update FBM
-         inode->i_ptr = *i_ptr;
+      if(new_ptr_file) {
          if(inode_id == -1) {                   // j-node: special procedure
             super_block_t *sb = calloc(BLOCK_SIZE, 1);                                    //10
-            read_blocks(SUPER_BLOCK, 1, sb);
-            sb->roots[sb->current_root].i_ptr = *i_ptr;
-            write_blocks(SUPER_BLOCK, 1, sb);
+            read_super(sb);
+            sb->root.i_ptr = *i_ptr;
+            write_super(sb);
             free(sb);                                                                     //10
-         } else {                               // normal i-node procedure
-            b_ptr_t inode_block_id = get_block_id(&sb->roots[sb->current_root],inode_id/(BLOCK_SIZE/sizeof(inode_t)));
-
-            if(inode_block_id == -1) {
-               free(FBM);                       // Free                                   (16)
-               return -1;
-            }
-            inode_block_t *inode_block = malloc(BLOCK_SIZE);// Malloc                              (15)
-            read_blocks(inode_block_id, 1, inode_block); // Retrieve inode block
-            inode_block->inodes[inode_id % (BLOCK_SIZE/sizeof(inode_t))].i_ptr = inode->i_ptr;
-            inode_block->inodes[inode_id % (BLOCK_SIZE/sizeof(inode_t))].size += write_size;
-            write_blocks(inode_block_id, 1, inode_block);// Update inode block
-            free(inode_block);                           // Free                                   (15)
+         } else {                               // normal i-node procedure (CoW safe: the table block may be read-only)
+            inode_t *inode_to_write_back = calloc(sizeof(inode_t), 1);                    //15
+            *inode_to_write_back = *inode;
+            inode_to_write_back->size += write_size;
+            file_pwrite(J_NODE, (char*) inode_to_write_back, sizeof(inode_t), inode_id*sizeof(inode_t));
+            free(inode_to_write_back);                                                    //15
          }
       }
-      ptr_file_t *ptr_file = malloc(BLOCK_SIZE);// Malloc                                 (14)
-      read_blocks(*i_ptr, 1, ptr_file);         // Retrieve pointer file
+      ptr_file_t *ptr_file = calloc(BLOCK_SIZE, 1);// Calloc                              (14)
+      if(!unwritten[*i_ptr])                    // Fresh pointer files are already 0s (calloc)
+         read_logged(*i_ptr, 1, ptr_file);      // Retrieve pointer file
 
       ptr_file->ptrs[d_ptr_id - MAX_DIRECT_PTR] = new_block; // Update ptr
-      write_blocks(*i_ptr, 1, ptr_file);        // Update pointer file
+      log_block(*i_ptr, ptr_file);              // Update pointer file
+      unwritten[*i_ptr] = 0;
       free(ptr_file);                           // Free                                   (14)
-      free(FBM);                                // Free                                   (16)
 
       return 0;
    }
 
    if(inode_id == -1) {                         // j-node: special procedure
       super_block_t *sb = calloc(BLOCK_SIZE, 1);                                          //11
-      read_blocks(SUPER_BLOCK, 1, sb);
+      read_super(sb);
       
-      sb->roots[sb->current_root].d_ptrs[d_ptr_id] = new_block;
-      write_blocks(SUPER_BLOCK, 1, sb);
-      fbm_t *FBM = malloc(BLOCK_SIZE);                                                    //12
-      read_blocks(sb->fbm_ptrs[sb->current_root], 1, FBM);
-      FBM->mask[new_block] = 0;
-      write_blocks(sb->fbm_ptrs[sb->current_root], 1, FBM);          // Update FBM
-      free(FBM);                                                                          //12
+      sb->root.d_ptrs[d_ptr_id] = new_block;
+      write_super(sb);
       free(sb);                                                                           //11
       inode->d_ptrs[d_ptr_id] = new_block;      // Don't forget to update the in-mem inode
    } else {                                     // normal i-node procedure
-      // Getting the id of the inode table block that contains our inode.
-      // Since int division truncates to 0, we do inode_id/number of inodes in a block
-      b_ptr_t inode_block_id = get_block_id(&sb->roots[sb->current_root],inode_id/(BLOCK_SIZE/sizeof(inode_t)));
-
-      if(inode_block_id == -1) return -1;
       inode->d_ptrs[d_ptr_id] = new_block;      // Don't forget to update the in-mem inode
       inode_t *inode_to_write_back = calloc(sizeof(inode_t), 1);                          //13
       *inode_to_write_back = *inode;
       inode_to_write_back->size += write_size;
 
-      ssfs_fwseek(J_NODE, inode_id*sizeof(inode_t));
-      ssfs_fwrite(J_NODE, (char*) inode_to_write_back, sizeof(inode_t));
+      file_pwrite(J_NODE, (char*) inode_to_write_back, sizeof(inode_t), inode_id*sizeof(inode_t));
       free(inode_to_write_back);                                                          //13
    }
 
-   read_blocks(sb->fbm_ptrs[sb->current_root], 1, FBM);
-   FBM->mask[new_block] = 0;
-   write_blocks(sb->fbm_ptrs[sb->current_root], 1, FBM);             // Update FBM
-   free(FBM);
-
    return 0;
 }
 
+int iov_length(const struct iovec *iov, int iovcnt) { // Total length of an iovec array
+   if(iov == NULL || iovcnt <= 0) return -1;
+   long length = 0;
+   for(int i=0; i<iovcnt; i++) {
+      if(iov[i].iov_base == NULL && iov[i].iov_len > 0) return -1;
+      length += iov[i].iov_len;
+      if(length > MAX_FILE_SIZE) return -1;     // Could never fit in a file anyway
+   }
+   return (int) length;
+}
+
+void iov_copy(iov_cursor_t *cur, char *block, int length, int gather) { // Skips empty iovecs
+   while(length > 0) {
+      int n = (int) cur->iov->iov_len - cur->offset;
+      if(n > length) n = length;
+      char *base = (char*) cur->iov->iov_base + cur->offset;
+      if(gather) memcpy(block, base, n);
+      else memcpy(base, block, n);
+      block += n;
+      length -= n;
+      cur->offset += n;
+      if(cur->offset == (int) cur->iov->iov_len) { // Next iovec
+         cur->iov++;
+         cur->offset = 0;
+      }
+   }
+}
+
 virt_addr_t bytes_to_virt_addr(int bytes) {     // Converts a byte number to a virtual address
    virt_addr_t thingy = { .d_ptr = bytes/BLOCK_SIZE, .offset = bytes%BLOCK_SIZE };
    return thingy;
@@ -632,46 +3652,468 @@ int virt_addr_to_bytes(virt_addr_t addr) {      // ASSUMING OFFSET IS IN BYTES
    return addr.d_ptr*BLOCK_SIZE + addr.offset;
 }
 
-int new_fdt_entry(inode_t inode, int inode_id) {// Creates a new entry in the FDT
-   for(int i=0; i<NUM_BLOCKS-65; i++) {
-      if(fdt[i] == NULL) {
-         fd_t *new_entry = calloc(sizeof(fd_t), 1);
+int new_fdt_entry(inode_t inode, int inode_id, int snap) {// Creates a new entry in the FDT
+   fd_t *new_entry = fd_alloc();
+   if(new_entry == NULL) {
+      printf("[DEBUG|new_fdt_entry] Too many open files. Aborting\n");
+      return -1;
+   }
+   open_file(new_entry, inode, inode_id, snap);
+   new_entry->read_ptr = bytes_to_virt_addr(0);
+   new_entry->write_ptr = bytes_to_virt_addr(inode.size);
 
-         new_entry->inode = inode;
-         new_entry->inode_id = inode_id;        
-//       new_entry->read_ptr = { .d_ptr = 0, offset = 0 };// Unnecessary because of calloc
-         new_entry->write_ptr = bytes_to_virt_addr(inode.size);
+   int handle = new_entry->tag << FD_SLOT_BITS | new_entry->slot;
+   __atomic_store_n(&new_entry->handle, handle, __ATOMIC_RELEASE); // Lock-free reads may find it right away
+   return handle;
+}
 
-         fdt[i] = new_entry;
-         return i;
+int file_hash(int inode_id, int snap) {
+   return (unsigned int) (inode_id*31 + snap) % FILE_BUCKETS;
+}
+
+void open_file(fd_t *fd, inode_t inode, int inode_id, int snap) { // A stale inode gets reloaded by get_fd
+   pthread_mutex_lock(&meta_lock);               // Calls before the open may have written it too
+   int seq = calls_open == 0 ? quiet_seq : quiet_seq+1;
+   pthread_mutex_unlock(&meta_lock);
+   pthread_mutex_lock(&files_lock);
+   file_t **bucket = &files[file_hash(inode_id, snap)];
+   file_t *file = *bucket;
+   while(file != NULL && (file->inode_id != inode_id || file->snap != snap)) file = file->next;
+   if(file == NULL) {                            // First fd on it
+      file = calloc(1, sizeof(file_t));          // Calloc (freed by free_file)
+      file->inode = inode;
+      file->inode_id = inode_id;
+      file->snap = snap;
+      file->gen = snap == -1 ? root_gen : snap_gen;
+      file->seq = seq;
+      publish_inode(file);
+      file->next = *bucket;
+      *bucket = file;
+   }
+   file->refs++;
+   fd->file = file;
+   fd->prev_fd = NULL;
+   fd->next_fd = file->fds;
+   if(file->fds != NULL) file->fds->prev_fd = fd;
+   file->fds = fd;
+   pthread_mutex_unlock(&files_lock);
+}
+
+void unhash_file(file_t *file) {                // files_lock held
+   file_t **link = &files[file_hash(file->inode_id, file->snap)];
+   while(*link != file) link = &(*link)->next;
+   *link = file->next;
+}
+
+file_t *close_file(fd_t *fd) {
+   pthread_mutex_lock(&files_lock);
+   file_t *file = fd->file;
+   if(fd->prev_fd != NULL) fd->prev_fd->next_fd = fd->next_fd;
+   else file->fds = fd->next_fd;
+   if(fd->next_fd != NULL) fd->next_fd->prev_fd = fd->prev_fd;
+   if(--file->refs > 0) file = NULL;
+   else unhash_file(file);
+   pthread_mutex_unlock(&files_lock);
+   return file;
+}
+
+file_t *detach_file(int inode_id, int snap) {   // O(fds on the file)
+   pthread_mutex_lock(&files_lock);
+   file_t *file = files[file_hash(inode_id, snap)];
+   while(file != NULL && (file->inode_id != inode_id || file->snap != snap)) file = file->next;
+   if(file != NULL) {
+      unhash_file(file);
+      for(fd_t *fd = file->fds; fd != NULL; fd = fd->next_fd)
+         __atomic_store_n(&fd->handle, -1, __ATOMIC_RELEASE); // Stale from now on
+   }
+   pthread_mutex_unlock(&files_lock);
+   return file;
+}
+
+void free_file(file_t *file) {                  // Only once no call nor lock-free read can use it
+   for(fd_t *fd = file->fds, *next; fd != NULL; fd = next) {
+      next = fd->next_fd;                       // Gone once it is back on the free list
+      fd_release(fd);
+   }
+   free(file->pub);
+   free(file);                                  // Free (calloc'd by open_file)
+}
+
+fd_t *fd_slot(int slot) {
+   if(slot < 0 || slot/FD_CHUNK >= FD_CHUNKS) return NULL;
+   fd_t *chunk = __atomic_load_n(&fd_chunks[slot/FD_CHUNK], __ATOMIC_ACQUIRE);
+   return chunk == NULL ? NULL : &chunk[slot % FD_CHUNK];
+}
+
+fd_t *fd_at(int fileID) {                       // O(1): a stale fd has the tag of an older generation
+   fd_t *fd = fileID < 0 ? NULL : fd_slot(fileID & FD_SLOT_MASK);
+   return fd != NULL && __atomic_load_n(&fd->handle, __ATOMIC_ACQUIRE) == fileID ? fd : NULL;
+}
+
+fd_t *fd_alloc() {                              // Lock-free: a pop only has to win one compare-and-swap
+   while(1) {
+      uint64_t head = __atomic_load_n(&fd_free, __ATOMIC_ACQUIRE);
+      int slot = (int) (uint32_t) head;
+      if(slot == FD_NONE) {
+         if(fd_grow() == -1) return NULL;
+         continue;
       }
+      fd_t *fd = fd_slot(slot);
+      uint64_t next = ((head >> 32) + 1) << 32 | (uint32_t) __atomic_load_n(&fd->next_free, __ATOMIC_ACQUIRE);
+      if(__atomic_compare_exchange_n(&fd_free, &head, next, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+         return fd;                             // The count changed if the slot went and came back meanwhile
    }
-   return -1;
 }
 
-b_ptr_t get_unused_block() {   // Gets an unused block (according to some strategy)
-   super_block_t *sb = calloc(BLOCK_SIZE, 1);
-   read_blocks(SUPER_BLOCK, 1, sb);
-   wm_t *FBM = malloc(BLOCK_SIZE);
-   read_blocks(sb->fbm_ptrs[sb->current_root], 1, FBM);
-   free(sb);
+void fd_release(fd_t *fd) {                     // Only once no call nor lock-free read can use it
+   fd->file = NULL;
+   fd->tag = (fd->tag + 1) & FD_TAG_MASK;
+   uint64_t head = __atomic_load_n(&fd_free, __ATOMIC_ACQUIRE);
+   do {
+      __atomic_store_n(&fd->next_free, (int) (uint32_t) head, __ATOMIC_RELEASE);
+   } while(!__atomic_compare_exchange_n(&fd_free, &head, (head >> 32) << 32 | (uint32_t) fd->slot, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
 
-   for(int i=0; i<BLOCK_SIZE; i++) {
-      if(FBM->mask[i] == 1) {
-         free(FBM);
-         return i;
+int fd_grow() {
+   pthread_mutex_lock(&fdt_lock);
+   if((int) (uint32_t) __atomic_load_n(&fd_free, __ATOMIC_ACQUIRE) != FD_NONE) { // Another thread grew it
+      pthread_mutex_unlock(&fdt_lock);
+      return 0;
+   }
+   if(num_fd_chunks == FD_CHUNKS) {
+      pthread_mutex_unlock(&fdt_lock);
+      return -1;
+   }
+   fd_t *chunk = calloc(FD_CHUNK, sizeof(fd_t));  // Calloc (never freed: the tags outlive the mount)
+   int first = num_fd_chunks*FD_CHUNK;
+   for(int i=0; i<FD_CHUNK; i++) {               // Chained in order: fds come out lowest first
+      chunk[i].handle = -1;
+      chunk[i].slot = first + i;
+      chunk[i].next_free = i+1 < FD_CHUNK ? first + i+1 : FD_NONE;
+   }
+   __atomic_store_n(&fd_chunks[num_fd_chunks], chunk, __ATOMIC_RELEASE);
+   __atomic_store_n(&num_fd_chunks, num_fd_chunks+1, __ATOMIC_RELEASE);
+   uint64_t head = __atomic_load_n(&fd_free, __ATOMIC_ACQUIRE);
+   do {                                          // Releases may have pushed slots since the check
+      chunk[FD_CHUNK-1].next_free = (int) (uint32_t) head;
+   } while(!__atomic_compare_exchange_n(&fd_free, &head, (head >> 32) << 32 | (uint32_t) first, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+   pthread_mutex_unlock(&fdt_lock);
+   return 0;
+}
+
+void fd_reset() {                               // Every fd becomes stale (calls and reads are locked out)
+   for(int b=0; b<FILE_BUCKETS; b++) {
+      for(file_t *file = files[b], *next; file != NULL; file = next) {
+         next = file->next;
+         free(file->pub);
+         free(file);                             // Free (calloc'd by open_file)
+      }
+      files[b] = NULL;
+   }
+   int num_slots = num_fd_chunks*FD_CHUNK;     // The slab is kept: tags must not start over (fds of the
+   for(int i=0; i<num_slots; i++) {             // previous mount would become valid again)
+      fd_t *fd = fd_slot(i);
+      if(fd->handle != -1 && i > ROOT_DIR) fd->tag = (fd->tag + 1) & FD_TAG_MASK; // Still open
+      fd->handle = -1;
+      fd->file = NULL;
+      fd->next_free = i+1 < num_slots ? i+1 : FD_NONE; // In order: j-node and root dir get slots 0 and 1
+   }
+   fd_free = (fd_free >> 32) << 32 | (uint32_t) (num_slots > 0 ? 0 : FD_NONE);
+}
+
+fd_t *get_fd(int fileID) {                      // Lazy part of ssfs_restore
+   fd_t *fd = fd_at(fileID);
+   if(fd == NULL) return NULL;
+   file_t *file = fd->file;
+   if(file->snap != -1) {                         // Shadow root inodes never change, but the root may get deleted
+      snap_entry_t entry;
+      if(__atomic_load_n(&file->gen, __ATOMIC_ACQUIRE) != snap_gen
+         && (get_snapshot(file->snap, &entry) == -1 || entry.state != SNAP_LIVE))
+         return NULL;
+      __atomic_store_n(&file->gen, snap_gen, __ATOMIC_RELEASE);
+      return fd;
+   }
+   if(__atomic_load_n(&file->gen, __ATOMIC_ACQUIRE) != root_gen) {
+      pthread_mutex_lock(&itable_lock);           // Calls on other fds of the file may reload it at the same time
+      if(file->gen != root_gen) {
+         inode_t inode;
+         virt_addr_t addr = bytes_to_virt_addr(file->inode_id*sizeof(inode_t));
+         if(file->inode_id < 0 || read_at(&fd_at(J_NODE)->file->inode, &addr, (char*) &inode, sizeof(inode_t)) != sizeof(inode_t) || inode.size < 0) {
+            pthread_mutex_unlock(&itable_lock);
+            return NULL;                          // File does not exist in this root
+         }
+         file->inode = inode;
+         publish_inode(file);
+         __atomic_store_n(&file->gen, root_gen, __ATOMIC_RELEASE);
       }
+      pthread_mutex_unlock(&itable_lock);
    }
+   int size = file->inode.size;                   // Another fd on the file may have done the reload
+   if(virt_addr_to_bytes(fd->read_ptr) > size) fd->read_ptr = bytes_to_virt_addr(size);
+   if(virt_addr_to_bytes(fd->write_ptr) > size) fd->write_ptr = bytes_to_virt_addr(size);
+   return fd;
+}
+
+void init_locks() {
+   pthread_mutexattr_t attr;
+   pthread_mutexattr_init(&attr);
+   pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+   pthread_mutex_init(&itable_lock, &attr);
+   pthread_mutex_init(&meta_lock, &attr);
+   pthread_mutexattr_destroy(&attr);
+   for(int i=0; i<FILE_LOCKS; i++) pthread_rwlock_init(&file_locks[i], NULL);
+   for(int g=0; g<ALLOC_GROUPS; g++) pthread_mutex_init(&groups[g].lock, NULL);
+}
+
+pthread_rwlock_t *lock_file(int fileID, int write) {
+   pthread_rwlock_rdlock(&commit_lock);
+   while(1) {
+      int idx = read_begin();                   // The slot is not reused while we peek at it
+      fd_t *fd = fileID > ROOT_DIR ? fd_at(fileID) : NULL;
+      int inode_id = fd != NULL ? fd->file->inode_id : -1;
+      read_end(idx);
+      if(inode_id < 0) {                        // Bad fd (the j-node and root dir are not for users)
+         pthread_rwlock_unlock(&commit_lock);
+         return NULL;
+      }
+      pthread_rwlock_t *lock = &file_locks[inode_id % FILE_LOCKS];
+      if(write) pthread_rwlock_wrlock(lock);
+      else pthread_rwlock_rdlock(lock);
+      if(fd_at(fileID) == fd) return lock;      // Closed (and the slot reused) before we got the lock?
+      pthread_rwlock_unlock(lock);
+   }
+}
+
+void unlock_file(pthread_rwlock_t *lock) {
+   pthread_rwlock_unlock(lock);
+   pthread_rwlock_unlock(&commit_lock);
+}
+
+int read_begin() {
+   int idx = __atomic_load_n(&reader_gen, __ATOMIC_SEQ_CST) & 1;
+   __atomic_fetch_add(&readers[idx], 1, __ATOMIC_SEQ_CST);
+   return idx;
+}
+
+void read_end(int idx) {
+   __atomic_fetch_sub(&readers[idx], 1, __ATOMIC_SEQ_CST);
+}
+
+void wait_readers() {                           // Must not hold a lock a read takes (meta_lock)
+   pthread_mutex_lock(&grace_lock);
+   for(int flip=0; flip<2; flip++) {            // Twice: a read may have counted itself with the old parity late
+      int idx = __atomic_fetch_add(&reader_gen, 1, __ATOMIC_SEQ_CST) & 1;
+      while(__atomic_load_n(&readers[idx], __ATOMIC_SEQ_CST) != 0) sched_yield();
+   }
+   pthread_mutex_unlock(&grace_lock);
+}
+
+void publish_inode(file_t *file) {
+   inode_t *copy = malloc(sizeof(inode_t));    // Malloc (freed by reclaim_inodes, or with the file)
+   *copy = file->inode;
+   inode_t *old = __atomic_exchange_n(&file->pub, copy, __ATOMIC_SEQ_CST);
+   if(old == NULL) return;
+   pthread_mutex_lock(&retire_lock);
+   if(num_retired == RETIRE_BATCH) {            // Full: wait for the readers now (never called with meta_lock held)
+      pthread_mutex_unlock(&retire_lock);
+      reclaim_inodes(1);
+      pthread_mutex_lock(&retire_lock);
+   }
+   retired[num_retired++] = old;
+   pthread_mutex_unlock(&retire_lock);
+}
+
+void reclaim_inodes(int force) {
+   inode_t *batch[RETIRE_BATCH];
+   pthread_mutex_lock(&retire_lock);
+   int count = num_retired;
+   if(count == 0 || (!force && count < RETIRE_BATCH/2)) {
+      pthread_mutex_unlock(&retire_lock);
+      return;
+   }
+   memcpy(batch, retired, count*sizeof(inode_t*));
+   num_retired = 0;
+   pthread_mutex_unlock(&retire_lock);
+   wait_readers();
+   for(int i=0; i<count; i++) free(batch[i]);
+}
+
+void start_flusher() {
+   pthread_t thread;
+   pthread_create(&thread, NULL, flusher, NULL);
+   pthread_detach(thread);
+   atexit(flush_at_exit);
+}
+
+void *flusher(void *arg) {
+   while(1) {
+      struct timespec until;
+      time_after(&until, FLUSH_INTERVAL);
+      pthread_mutex_lock(&flush_lock);
+      pthread_cond_timedwait(&flush_cond, &flush_lock, &until);
+      pthread_mutex_unlock(&flush_lock);
+      flush_step(0);
+   }
+   return NULL;
+}
+
+void flush_step(int forced) {
+   if(__atomic_load_n(&flush_background, __ATOMIC_RELAXED) == SSFS_FLUSH_MANUAL && !forced) return; // Only ssfs_flush runs it
+   struct timespec until;
+   time_after(&until, FLUSH_INTERVAL);
+   if(pthread_rwlock_timedwrlock(&commit_lock, &until) != 0) { // Between calls: the log holds whole calls once synced
+      pthread_rwlock_rdlock(&commit_lock);      // Calls keep it shared: only sync the calls done so far
+      if(flush_background && super_image != NULL) log_sync();
+      pthread_rwlock_unlock(&commit_lock);
+      return;
+   }
+   if(!flush_background || super_image == NULL) {
+      pthread_rwlock_unlock(&commit_lock);
+      return;
+   }
+   if(reclaim_left) {                           // One bounded step per run, synced with the calls
+      super_block_t *sb = calloc(BLOCK_SIZE, 1);
+      read_super(sb);
+      reclaim_left = reclaim_step(sb);
+      free(sb);
+   }
+   pthread_mutex_lock(&meta_lock);
+   log_sync();                                  // Checkpoints too if the log is half full
+   // The images are synced now: they can go home while the calls go on (checkpoints wait for it)
+   pthread_mutex_lock(&home_lock);
+   int count = 0;
+   for(int i=0; i<NUM_BLOCKS; i++) count += dirty[i] && log_cache[i] != NULL;
+   b_ptr_t *blocks = malloc((count+1)*sizeof(b_ptr_t));     // Malloc                       (1)
+   char *images = malloc((count+1)*BLOCK_SIZE);             // Malloc                       (2)
+   for(int i=0, n=0; i<NUM_BLOCKS; i++) {       // In address order
+      if(!dirty[i] || log_cache[i] == NULL) continue;
+      blocks[n] = i;
+      memcpy(images + n*BLOCK_SIZE, log_cache[i], BLOCK_SIZE);
+      dirty[i] = 0;                             // Set again by the next change
+      n++;
+   }
+   pthread_mutex_unlock(&meta_lock);
+   pthread_rwlock_unlock(&commit_lock);
+   for(int i=0; i<count; ) {                    // Contiguous blocks go in one write
+      int run = 1;
+      while(i+run < count && blocks[i+run] == blocks[i]+run) run++;
+      write_blocks(blocks[i], run, images + i*BLOCK_SIZE);
+      i += run;
+   }
+   pthread_mutex_unlock(&home_lock);
+   free(images);                                                                          //2
+   free(blocks);                                                                          //1
+}
+
+void time_after(struct timespec *until, int ms) {
+   clock_gettime(CLOCK_REALTIME, until);
+   until->tv_nsec += ms*1000000L;
+   until->tv_sec += until->tv_nsec/1000000000L;
+   until->tv_nsec %= 1000000000L;
+}
+
+void wait_home_writes() {
+   pthread_mutex_lock(&home_lock);
+   pthread_mutex_unlock(&home_lock);
+}
+
+void flush_at_exit() {
+   pthread_rwlock_wrlock(&commit_lock);
+   if(super_image != NULL) log_sync();
+   pthread_rwlock_unlock(&commit_lock);
+}
+
+void call_begin() {
+   pthread_mutex_lock(&meta_lock);
+   if(quiet_wanted > quiet_seq && calls_open > 0) { // A sync waits for a point: let the open calls drain first.
+      struct timespec until;                    // Bounded: one of them may wait for a lock this call holds.
+      time_after(&until, FLUSH_INTERVAL);
+      while(quiet_wanted > quiet_seq && calls_open > 0 && pthread_cond_timedwait(&quiet_cond, &meta_lock, &until) == 0);
+   }
+   calls_open++;
+   pthread_mutex_unlock(&meta_lock);
+}
+
+void call_end() {
+   pthread_mutex_lock(&meta_lock);
+   if(--calls_open == 0) log_mark();
+   call_seq = calls_open == 0 ? quiet_seq : quiet_seq+1; // Else the next point covers it
+   pthread_mutex_unlock(&meta_lock);
+}
+
+void call_done() {
+   if(!flush_background) {
+      sync_to(call_seq);
+      return;
+   }
+   pthread_mutex_lock(&meta_lock);
+   int wake = log_used - log_synced > FLUSH_BYTES || log_used > LOG_BLOCKS*BLOCK_SIZE/2;
+   pthread_mutex_unlock(&meta_lock);
+   if(wake) {
+      pthread_mutex_lock(&flush_lock);
+      pthread_cond_signal(&flush_cond);
+      pthread_mutex_unlock(&flush_lock);
+   }
+}
+
+void sync_to(int seq) {                         // No commit barrier: new calls hold back until the point is marked
+   pthread_mutex_lock(&meta_lock);
+   while(synced_seq < seq) {
+      if(quiet_seq >= seq) {                    // Marked: the calls of the point are all done
+         pthread_mutex_unlock(&meta_lock);
+         log_sync();
+         pthread_mutex_lock(&meta_lock);
+         continue;
+      }
+      if(quiet_wanted < seq) quiet_wanted = seq; // See call_begin
+      struct timespec until;
+      time_after(&until, FLUSH_INTERVAL);
+      pthread_cond_timedwait(&quiet_cond, &meta_lock, &until);
+   }
+   pthread_mutex_unlock(&meta_lock);
+}
+
+void throttle() {                               // The pause grows with the log, instead of a stop when it is full
+   if(!flush_background) return;
+   pthread_mutex_lock(&meta_lock);
+   int used = log_used;
+   pthread_mutex_unlock(&meta_lock);
+   if(used <= DIRTY_LIMIT) return;
+   if(used >= DIRTY_HARD_LIMIT) {               // The flusher is behind: sync (and checkpoint) here, between calls
+      struct timespec until;
+      time_after(&until, FLUSH_INTERVAL);
+      if(pthread_rwlock_timedwrlock(&commit_lock, &until) != 0) // Readers keep it shared: like flush_step,
+         pthread_rwlock_rdlock(&commit_lock);   // only sync the calls done so far (no checkpoint while one is open)
+      if(super_image != NULL) log_sync();
+      pthread_rwlock_unlock(&commit_lock);
+      return;
+   }
+   if(flush_background == SSFS_FLUSH_MANUAL) return; // No flusher to wait for
+   pthread_mutex_lock(&flush_lock);
+   pthread_cond_signal(&flush_cond);
+   pthread_mutex_unlock(&flush_lock);
+   usleep(MAX_PAUSE*(used - DIRTY_LIMIT)/(DIRTY_HARD_LIMIT - DIRTY_LIMIT));
+}
+
+b_ptr_t get_unused_block(int home) {   // Gets an unused block (home group first, see alloc_block)
+   super_block_t *sb = calloc(BLOCK_SIZE, 1);
+   read_super(sb);
+   fbm_t *FBM = malloc(BLOCK_SIZE);
+   read_logged(sb->fbm_ptr, 1, FBM);
+
+   // Only a peek: this copy is not written back. Still free when the caller takes it, as long as
+   // the caller keeps its group locked (unlock_groups).
+   b_ptr_t block = alloc_block(FBM, sb->fbm_ptr, BLOCK_OLD, home);
+   free(sb);
    free(FBM);
-   return -1;
+   return block;
 }
 
 int get_free_inode() {          // Gets a free inode and returns its ID
    // Look into directory for the first gap. Pick that gap.
    inode_block_t *inode_block = calloc(BLOCK_SIZE, 1);
-   ssfs_frseek(J_NODE, 0);                       // Read from beginning of j-node
-   int d_ptr = 0;
-   while(ssfs_fread(J_NODE, (char*) inode_block, BLOCK_SIZE) > 0) {
+   int d_ptr = 0;                                // Read from beginning of j-node
+   while(file_pread(J_NODE, (char*) inode_block, BLOCK_SIZE, d_ptr*BLOCK_SIZE) > 0) {
       for(int i=0; i<BLOCK_SIZE/sizeof(inode_t); i++) {
          if(inode_block->inodes[i].size == -1) {
             free(inode_block);
@@ -688,15 +4130,14 @@ int get_inode_id(char *name, super_block_t *sb) {
    int inode_id = -1;                              // ID of the inode in the inode list 
    virt_addr_t addr = { .d_ptr = 0, .offset = 0 }; // Offset is in bytes
    int num_entries = BLOCK_SIZE/DIR_ENTRY_SIZE;
+   if(get_fd(ROOT_DIR) == NULL) return -1;
    dir_t *dir_block = calloc(BLOCK_SIZE, 1);       // calloc                                  (6)
 
-   while(addr.d_ptr*num_entries + addr.offset < fdt[ROOT_DIR]->inode.size) {
-      ssfs_frseek(ROOT_DIR, virt_addr_to_bytes(addr));
-
-      if(!(ssfs_fread(ROOT_DIR, (char*) dir_block, BLOCK_SIZE) > 0)) { // If read fails -> end of dir file
+   while(addr.d_ptr*num_entries + addr.offset < fd_at(ROOT_DIR)->file->inode.size) {
+      if(!(file_pread(ROOT_DIR, (char*) dir_block, BLOCK_SIZE, virt_addr_to_bytes(addr)) > 0)) { // If read fails -> end of dir file
          break;
       }
-      while(addr.offset<BLOCK_SIZE && addr.d_ptr*num_entries+addr.offset<fdt[ROOT_DIR]->inode.size) {
+      while(addr.offset<BLOCK_SIZE && addr.d_ptr*num_entries+addr.offset<fd_at(ROOT_DIR)->file->inode.size) {
          if(strncmp(name, dir_block->files[addr.offset/DIR_ENTRY_SIZE].filename, FILENAME_SIZE) == 0) { // Compare filename
             inode_id = dir_block->files[addr.offset/DIR_ENTRY_SIZE].inode_id;
             break;
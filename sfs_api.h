@@ -43,14 +43,85 @@ struct _inode_block_t {
 } inode_block_t;
 */
 
+#include <sys/uio.h>                // struct iovec
+#include <time.h>                   // time_t
 
+typedef struct _ssfs_view_t {       // Zero-copy read view (see ssfs_fread_view)
+   struct iovec *iov;               // Segments of file data, in file order
+   int iovcnt;                      // Number of segments
+   int length;                      // Total number of bytes in the view
+   int *blocks;                     // Pinned blocks (private)
+} ssfs_view_t;
+
+#define SSFS_DIFF_CREATED 1         // File only exists in the second shadow root
+#define SSFS_DIFF_DELETED 2         // File only exists in the first shadow root
+#define SSFS_DIFF_MODIFIED 3        // File exists in both, [first_block, first_block+num_blocks) changed
+
+// Called by ssfs_snapshot_diff for every change. A non-zero return value stops the diff.
+typedef int (*ssfs_diff_cb)(int type, const char *name, int first_block, int num_blocks, void *arg);
+
+// Every call can be made from several threads at once (a fd is not meant to be shared by them).
+// Calls on different files run in parallel. Reads take no lock: they do not wait for the writes to
+// the file (a read sees each block as it was before or after a write). The shadow root calls
+// (commit, restore, clone, ...) wait for the other calls but reads, and run alone.
 void mkssfs(int fresh);
 int ssfs_fopen(char *name);
-int ssfs_fclose(int fileID);
+int ssfs_fopen_at(int cnum, char *name); // Read-only fd on a file of shadow root cnum (no restore)
+int ssfs_fclose(int fileID);         // Calls on a closed fd fail, even once a new fd gets its slot
 int ssfs_frseek(int fileID, int loc);
 int ssfs_fwseek(int fileID, int loc);
 int ssfs_fwrite(int fileID, char *buf, int length);
 int ssfs_fread(int fileID, char *buf, int length);
+int ssfs_pwrite(int fileID, char *buf, int length, int loc);
+int ssfs_pread(int fileID, char *buf, int length, int loc);
+// Points view at the file data in [loc, loc+length) without copying it. The memory stays
+// valid (and keeps the data it was made on) until ssfs_view_release. Returns the view length.
+int ssfs_fread_view(int fileID, int loc, int length, ssfs_view_t *view);
+void ssfs_view_release(ssfs_view_t *view);
+int ssfs_fwritev(int fileID, const struct iovec *iov, int iovcnt);
+int ssfs_freadv(int fileID, const struct iovec *iov, int iovcnt);
 int ssfs_remove(char *file);
 int ssfs_commit();
 int ssfs_restore(int cnum);
+int ssfs_snapshot_delete(int cnum); // Also deletes a branch (unless checked out)
+// Creates a writable branch sharing every block with shadow root cnum and returns its number.
+// ssfs_checkout switches the current root to a branch (-1: back to the main line).
+int ssfs_clone(int cnum);
+int ssfs_checkout(int branch);
+int ssfs_snapshot_diff(int a, int b, ssfs_diff_cb callback, void *arg);
+// Writes the changes from shadow root from_cnum (-1: none) to to_cnum as a checksummed stream
+// on out_fd (same bytes on any host). ssfs_receive applies such a stream to the current root and
+// commits it: an incremental stream needs a current root with the same files as from_cnum, a full
+// one replaces every file. A stream that is cut short, corrupt or does not apply changes nothing.
+// The stream is applied as it is read, with the other calls held off until it is committed.
+int ssfs_send(int from_cnum, int to_cnum, int out_fd);
+int ssfs_receive(int in_fd);
+// Merges the shadow roots in [first, last) into last by deleting them. Their blocks are
+// reclaimed in the background by the flusher (with it off: by ssfs_reclaim and commits).
+// Returns the number merged.
+int ssfs_snapshot_merge(int first, int last);
+// Keeps one shadow root (the newest) per interval seconds among those older than age seconds
+// at time now. Hourly for a day, then daily: ssfs_compact(now, 0, 3600), ssfs_compact(now, 86400, 86400).
+// The roots are gone through a table block at a time: the other calls are only held off for one.
+int ssfs_compact(time_t now, int age, int interval);
+int ssfs_reclaim();                 // One bounded reclamation step. Returns 1 while work is left
+
+#define SSFS_VERIFY_ALWAYS 0        // Every block read from disk is checked against its CRC32C
+#define SSFS_VERIFY_FIRST 1         // Only the first read of each block after mkssfs (default)
+#define SSFS_VERIFY_SCRUB 2         // Blocks are only checked by ssfs_scrub
+#define SSFS_FLUSH_OFF 0            // Every call syncs its own changes
+#define SSFS_FLUSH_BACKGROUND 1     // The flusher thread syncs them (default)
+#define SSFS_FLUSH_MANUAL 2         // Same, but the flusher only runs in ssfs_flush (same writes from run to run)
+// With background flushing (default), writes and opens return before their changes are on disk:
+// a thread syncs them every few milliseconds, and writers are slowed down if it falls behind.
+// ssfs_fsync makes the calls that wrote fileID so far durable. Returns the previous setting.
+int ssfs_set_flush(int background);
+int ssfs_flush();                   // One run of the flusher now (-1 if it is off)
+int ssfs_fsync(int fileID);
+int ssfs_set_verify(int mode);      // Returns the previous mode
+int ssfs_scrub();                   // Checks every block in use. Returns the number of bad blocks
+// Offline check of the disk image in file image (mkssfs has to be called again afterwards). Inode
+// table blocks are split across threads (<= 0: one per CPU). With repair, the FBM and reference
+// counts are fixed. Returns the number of problems found (-1 if the image cannot be checked) and
+// sets *repaired (if not NULL) to the number fixed.
+int ssfs_fsck(char *image, int repair, int threads, int *repaired);
@@ -0,0 +1,256 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sfs_api.h"
+#include "disk_emu.h"
+/*
+Crash-injection test: sfs_crash [ops] [seed]
+Runs a scripted workload once to count its write_blocks calls, then runs it again for every
+crash point, once with the writes dropped from that call on and once with that call torn in half.
+After each crash the disk is remounted with mkssfs(0) and checked:
+  - every shadow root committed before the crash holds exactly what was committed,
+  - the current root is the state after the last call done before the crash, or after the call
+    in progress (never something in between),
+  - ssfs_fsck finds nothing but leaked blocks (which the next sweep reclaims anyway).
+The expected contents come from an in-memory model of the workload.
+It does so twice: with every call syncing its own changes, then with the flusher on. The flusher
+only runs when the workload calls ssfs_flush (SSFS_FLUSH_MANUAL), every FLUSH_EVERY calls, so that
+the writes are the same from run to run. Calls it has not synced yet may be lost: the current root
+may then be the state after any call since the last one that was on disk.
+*/
+
+#define NUM_NAMES 6           // Files the workload plays with
+#define MAX_SIZE 20000        // Past the direct pointers
+#define MAX_OPS 200
+#define FLUSH_EVERY 4         // Flusher pass: calls between two runs of the flusher
+
+#define OP_CREATE 0
+#define OP_APPEND 1
+#define OP_OVERWRITE 2
+#define OP_REMOVE 3
+#define OP_COMMIT 4
+#define OP_RESTORE 5
+
+typedef struct _model_t {     // What the current root should hold
+  int exists[NUM_NAMES];
+  int size[NUM_NAMES];
+  char data[NUM_NAMES][MAX_SIZE];
+} model_t;
+
+typedef struct _op_t {
+  int type;
+  int file;                   // Index of the name (OP_CREATE ... OP_REMOVE)
+  int loc;                    // Where the bytes go (OP_APPEND, OP_OVERWRITE)
+  int length;
+  int cnum;                   // Shadow root (OP_RESTORE)
+  char fill;                  // Byte pattern of the write
+} op_t;
+
+op_t ops[MAX_OPS];
+int num_ops;
+model_t *states;              // states[i]: after the first i calls (what call i sees)
+int *commit_of;               // Shadow root made by call i (-1 if not a commit)
+int ends[MAX_OPS];            // write_blocks calls done by the end of each call
+unsigned int seed = 1;
+int flushing = 0;             // Flusher pass: calls leave their changes to ssfs_flush
+
+int next_rand(){              // Same sequence on every machine
+  seed = seed*1103515245 + 12345;
+  return (seed >> 16) & 0x7fff;
+}
+
+void name_of(int file, char *name){
+  sprintf(name, "crash%d", file);
+}
+
+void apply(model_t *m, op_t *op){  // The model's version of a call (not commit or restore)
+  if(op->type == OP_CREATE){
+    m->exists[op->file] = 1;
+    m->size[op->file] = 0;
+  } else if(op->type == OP_APPEND || op->type == OP_OVERWRITE){
+    memset(m->data[op->file] + op->loc, op->fill, op->length);
+    if(m->size[op->file] < op->loc + op->length) m->size[op->file] = op->loc + op->length;
+  } else if(op->type == OP_REMOVE){
+    m->exists[op->file] = 0;
+    m->size[op->file] = 0;
+  }
+}
+
+void make_ops(int count){     // Picks calls that make sense for the model as it goes
+  states = calloc(count+1, sizeof(model_t));
+  commit_of = malloc(count*sizeof(int));
+  int *committed = malloc(count*sizeof(int)); // Call that made each shadow root
+  int commits = 0;
+  for(num_ops=0; num_ops<count; num_ops++){
+    model_t *m = &states[num_ops];
+    op_t op = { .type = next_rand() % 6, .file = next_rand() % NUM_NAMES, .fill = 'a' + num_ops % 26 };
+    if(op.type == OP_CREATE && m->exists[op.file]) op.type = OP_APPEND;
+    if(op.type != OP_COMMIT && op.type != OP_RESTORE && !m->exists[op.file]) op.type = OP_CREATE;
+    if(op.type == OP_RESTORE && commits == 0) op.type = OP_COMMIT;
+    if(op.type == OP_APPEND){
+      op.loc = m->size[op.file];
+      op.length = 1 + next_rand() % 3000;
+      if(op.loc + op.length > MAX_SIZE) op.length = MAX_SIZE - op.loc;
+      if(op.length == 0) op.type = OP_REMOVE;
+    }
+    if(op.type == OP_OVERWRITE){
+      if(m->size[op.file] == 0){
+        op.type = OP_REMOVE;
+      } else {
+        op.loc = next_rand() % m->size[op.file];
+        op.length = 1 + next_rand() % 1500;
+        if(op.loc + op.length > m->size[op.file]) op.length = m->size[op.file] - op.loc;
+      }
+    }
+    ops[num_ops] = op;
+
+    states[num_ops+1] = *m;
+    commit_of[num_ops] = -1;
+    if(op.type == OP_COMMIT){
+      committed[commits] = num_ops;
+      commit_of[num_ops] = commits++;
+    } else if(op.type == OP_RESTORE){
+      ops[num_ops].cnum = next_rand() % commits;
+      states[num_ops+1] = states[committed[ops[num_ops].cnum]];
+    } else {
+      apply(&states[num_ops+1], &op);
+    }
+  }
+  free(committed);
+}
+
+void run_ops(){               // One API call per op
+  char name[16];
+  char *buf = malloc(MAX_SIZE);
+  for(int i=0; i<num_ops; i++){
+    op_t *op = &ops[i];
+    name_of(op->file, name);
+    if(op->type == OP_COMMIT){
+      ssfs_commit();
+    } else if(op->type == OP_RESTORE){
+      ssfs_restore(op->cnum);
+    } else if(op->type == OP_REMOVE){
+      ssfs_remove(name);
+    } else {
+      int fd = ssfs_fopen(name);
+      if(fd >= 0 && op->type != OP_CREATE){
+        memset(buf, op->fill, op->length);
+        ssfs_pwrite(fd, buf, op->length, op->loc);
+      }
+      if(fd >= 0) ssfs_fclose(fd);
+    }
+    if(flushing && i % FLUSH_EVERY == FLUSH_EVERY-1) ssfs_flush();
+    ends[i] = get_write_calls();
+  }
+  free(buf);
+}
+
+int synced_by(int i){         // Is every call up to call i on disk once it returns?
+  if(!flushing) return 1;     // Commits, restores and removes sync right away with the flusher on too
+  return ops[i].type == OP_COMMIT || ops[i].type == OP_RESTORE || ops[i].type == OP_REMOVE || i % FLUSH_EVERY == FLUSH_EVERY-1;
+}
+
+void crash_now(){             // What is still in memory is lost: its writes are dropped too
+  if(!flushing) return;
+  ssfs_set_flush(SSFS_FLUSH_OFF);
+  ssfs_set_flush(SSFS_FLUSH_MANUAL);
+}
+
+int same(int cnum, model_t *m, char *buf){  // Does shadow root cnum hold what m says?
+  char name[16];
+  for(int f=0; f<NUM_NAMES; f++){
+    name_of(f, name);
+    int fd = ssfs_fopen_at(cnum, name);
+    if(fd < 0){
+      if(m->exists[f]) return 0;
+      continue;
+    }
+    int size = ssfs_pread(fd, buf, MAX_SIZE, 0);
+    ssfs_fclose(fd);
+    if(!m->exists[f] || size != m->size[f] || memcmp(buf, m->data[f], size) != 0) return 0;
+  }
+  return 1;
+}
+
+int check_crash(int point, int torn){  // Returns the number of broken promises
+  int errors = 0;
+  char *buf = malloc(MAX_SIZE);
+  int done = 0;               // Calls whose writes all reached the disk
+  while(done < num_ops && ends[done] <= point) done++;
+  int first = 0;              // Oldest state the current root may be in (later calls were not synced)
+  for(int i=0; i<done; i++) if(synced_by(i)) first = i+1;
+
+  int problems = ssfs_fsck("placeholder", 0, 1, NULL);
+  mkssfs(0);
+
+  int commits = 0;            // Shadow roots that must be there
+  for(int i=0; i<done; i++) if(commit_of[i] != -1) commits++;
+  for(int i=0; i<done; i++){  // states[i]: what commit i saw
+    if(commit_of[i] == -1) continue;
+    if(!same(commit_of[i], &states[i], buf)){
+      printf("crash at write %d%s: shadow root %d changed\n", point, torn ? " (torn)" : "", commit_of[i]);
+      errors++;
+    }
+  }
+
+  int cnum = ssfs_commit();   // Read-only view of the current root
+  if(cnum < commits){
+    printf("crash at write %d%s: commit after remount failed (%d)\n", point, torn ? " (torn)" : "", cnum);
+    errors++;
+  } else {
+    int match = 0;
+    for(int i=first; i<=done+1 && i<=num_ops && !match; i++) match = same(cnum, &states[i], buf);
+    if(!match){
+      printf("crash at write %d%s: current root matches no call from %d to %d\n", point, torn ? " (torn)" : "", first, done+1);
+      errors++;
+    }
+  }
+  if(problems != 0){          // Leaks are the only thing a crash may leave behind
+    int leaked = ssfs_fsck("placeholder", 1, 1, NULL);
+    mkssfs(0);
+    if(leaked == -1 || ssfs_fsck("placeholder", 0, 1, NULL) != 0){
+      printf("crash at write %d%s: fsck found %d problem(s) it could not repair\n", point, torn ? " (torn)" : "", problems);
+      errors++;
+    }
+  }
+  free(buf);
+  return errors;
+}
+
+int run_pass(int flush, int *points){  // Returns the number of errors
+  ssfs_set_flush(flush);
+  flushing = flush == SSFS_FLUSH_MANUAL;
+
+  mkssfs(1);                  // Dry run: how many writes, and does it work at all?
+  set_crash_point(-1, 0);
+  run_ops();
+  int total = get_write_calls();
+  int errors = check_crash(total, 0);
+  printf("%d calls, %d writes%s\n", num_ops, total, flushing ? " (flusher on)" : "");
+
+  for(int point=0; point<total; point++){
+    for(int torn=0; torn<2; torn++){
+      mkssfs(1);
+      set_crash_point(point, torn);
+      run_ops();
+      crash_now();
+      set_crash_point(-1, 0);
+      errors += check_crash(point, torn);
+      (*points)++;
+    }
+  }
+  return errors;
+}
+
+int main(int argc, char **argv){
+  int count = argc > 1 ? atoi(argv[1]) : 60;
+  seed = argc > 2 ? atoi(argv[2]) : 1;
+  if(count < 1 || count > MAX_OPS) count = 60;
+  make_ops(count);
+
+  int points = 0;
+  int errors = run_pass(SSFS_FLUSH_OFF, &points); // Every call syncs its own changes
+  errors += run_pass(SSFS_FLUSH_MANUAL, &points);
+  printf("%d crash points, %d error(s)\n", points, errors);
+  return errors != 0;
+}
@@ -0,0 +1,36 @@
+#include "sfs_api.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/*
+Offline file system check: sfs_fsck [-r] [-j threads] [image]
+-r repairs what can be repaired (FBM and reference counts), -j sets the number of threads
+(default: one per CPU). The image defaults to the one mkssfs uses.
+Exit status: 0 if clean, 1 if every problem was repaired, 4 if problems are left, 8 if the image
+cannot be checked.
+*/
+int main(int argc, char **argv){
+  int repair = 0;
+  int threads = 0;
+  int opt;
+  while((opt = getopt(argc, argv, "rj:")) != -1){
+    if(opt == 'r') repair = 1;
+    else if(opt == 'j') threads = atoi(optarg);
+    else {
+      fprintf(stderr, "usage: %s [-r] [-j threads] [image]\n", argv[0]);
+      return 8;
+    }
+  }
+  char *image = optind < argc ? argv[optind] : "placeholder";
+
+  int repaired = 0;
+  int problems = ssfs_fsck(image, repair, threads, &repaired);
+  if(problems == -1){
+    printf("%s: cannot be checked\n", image);
+    return 8;
+  }
+  printf("%s: %d problem(s) found, %d repaired\n", image, problems, repaired);
+  if(problems == 0) return 0;
+  return repaired >= problems ? 1 : 4;
+}
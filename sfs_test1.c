@@ -63,8 +63,39 @@ int simple_test(){
   return 0;
 }
 
+/*
+Tests of the calls beyond the assignment API (I/O at an offset, views, shadow roots, streams).
+Each test makes a fresh file system.
+*/
+int snapshot_test(){
+  printf("\n-------------------------------\nInitializing Snapshot test.\n--------------------------------\n\n");
+  int err_no = 0;
+
+  test_cow_fast_path(&err_no);
+  test_vector_io(&err_no);
+  test_pread_pwrite(&err_no);
+  test_view_across_remove(&err_no);
+  test_snapshot_delete(&err_no);
+  test_restore_open_fds(&err_no);
+  test_snapshot_diff(&err_no);
+  test_send_receive(&err_no);
+  test_fopen_at(&err_no);
+  test_clone_checkout(&err_no);
+  test_merge_compact_reclaim(&err_no);
+  test_restore_cost(&err_no);
+  test_scrub_corruption(&err_no);
+  test_overwrite_moves_data(&err_no);
+  test_stale_handle(&err_no);
+  test_shared_file(&err_no);
+  test_alloc_groups(&err_no);
+
+  printf("\n-------------------------------\nSnapshot test Finished.\nCurrent Error Num: %d\n--------------------------------\n\n", err_no);
+  return 0;
+}
+
 /* The main testing program
  */
 int main(int argc, char **argv){
   simple_test();
+  snapshot_test();
 }
\ No newline at end of file
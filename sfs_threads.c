@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "sfs_api.h"
+/*
+Scaling benchmark: sfs_threads [ops]
+Every thread opens a file of its own and makes ops calls on it, first reading blocks at random
+(ssfs_pread), then overwriting them (ssfs_pwrite, each to a new block). Prints the calls per second for
+1 to MAX_THREADS threads: reads take no lock on the file, writes to different files only meet in
+the allocator and the metadata log. The last column has every thread read the same hot file
+while another one keeps appending to it. Reads are checked against what the file holds.
+*/
+
+#define MAX_THREADS 32
+#define FILE_BLOCKS 8         // 32 files of 8 blocks fit easily on the disk
+#define IO_SIZE 1024
+#define HOT_BLOCKS 64         // The appender starts over at FILE_BLOCKS past this size
+
+typedef struct _worker_t {
+  pthread_t thread;
+  int id;
+  int fd;
+  int ops;
+  int write;                  // 0: preads, 1: pwrites
+  int hot_fd;                 // Its fd on the hot file
+  int errors;
+} worker_t;
+
+int appending;               // Cleared to stop the appender
+
+void *run_worker(void *arg){
+  worker_t *w = arg;
+  char buf[IO_SIZE];
+  unsigned int seed = w->id + 1;
+  for(int i=0; i<w->ops; i++){
+    int block = rand_r(&seed) % FILE_BLOCKS;
+    if(w->write == 2){
+      if(ssfs_pread(w->hot_fd, buf, IO_SIZE, block*IO_SIZE) != IO_SIZE || buf[0] != 'h' || buf[IO_SIZE-1] != 'h')
+        w->errors++;
+    } else if(w->write){
+      memset(buf, 'a' + w->id % 26, IO_SIZE);
+      if(ssfs_pwrite(w->fd, buf, IO_SIZE, block*IO_SIZE) != IO_SIZE) w->errors++;
+    } else {
+      if(ssfs_pread(w->fd, buf, IO_SIZE, block*IO_SIZE) != IO_SIZE || buf[0] != 'a' + w->id % 26 || buf[IO_SIZE-1] != buf[0])
+        w->errors++;
+    }
+  }
+  return NULL;
+}
+
+void *run_appender(void *arg){
+  int fd = *(int*) arg;
+  int size = FILE_BLOCKS*IO_SIZE;
+  char buf[IO_SIZE];
+  memset(buf, 'z', IO_SIZE);
+  while(__atomic_load_n(&appending, __ATOMIC_SEQ_CST)){
+    if(size == HOT_BLOCKS*IO_SIZE) size = FILE_BLOCKS*IO_SIZE; // Full: start over past what the readers read
+    if(ssfs_pwrite(fd, buf, IO_SIZE, size) != IO_SIZE) break;
+    size += IO_SIZE;
+  }
+  return NULL;
+}
+
+double run(worker_t *workers, int threads, int write){  // Returns the calls per second
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for(int i=0; i<threads; i++){
+    workers[i].write = write;
+    pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+  }
+  for(int i=0; i<threads; i++) pthread_join(workers[i].thread, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)/1e9;
+  return threads*workers[0].ops/seconds;
+}
+
+int main(int argc, char **argv){
+  int ops = argc > 1 ? atoi(argv[1]) : 2000;
+  if(ops < 1) ops = 2000;
+  worker_t workers[MAX_THREADS];
+  char name[16];
+  char *data = malloc(FILE_BLOCKS*IO_SIZE);
+  int errors = 0;
+
+  mkssfs(1);
+  int hot_fd = ssfs_fopen("hot");
+  memset(data, 'h', FILE_BLOCKS*IO_SIZE);
+  ssfs_fwrite(hot_fd, data, FILE_BLOCKS*IO_SIZE);
+  for(int i=0; i<MAX_THREADS; i++){
+    sprintf(name, "thr%d", i);
+    workers[i].id = i;
+    workers[i].hot_fd = ssfs_fopen("hot");
+    workers[i].fd = ssfs_fopen(name);
+    workers[i].ops = ops;
+    memset(data, 'a' + i % 26, FILE_BLOCKS*IO_SIZE);
+    if(workers[i].fd < 0 || ssfs_fwrite(workers[i].fd, data, FILE_BLOCKS*IO_SIZE) != FILE_BLOCKS*IO_SIZE){
+      printf("could not create %s\n", name);
+      return 1;
+    }
+  }
+  ssfs_commit();              // Blocks are read-only now: the first write to each one copies it
+
+  printf("threads    pread/s   pwrite/s  hot pread/s\n");
+  for(int threads=1; threads<=MAX_THREADS; threads*=2){
+    for(int i=0; i<threads; i++) workers[i].errors = 0;
+    double reads = run(workers, threads, 0);
+    double writes = run(workers, threads, 1);
+    pthread_t appender;
+    __atomic_store_n(&appending, 1, __ATOMIC_SEQ_CST);
+    pthread_create(&appender, NULL, run_appender, &hot_fd);
+    double hot = run(workers, threads, 2);
+    __atomic_store_n(&appending, 0, __ATOMIC_SEQ_CST);
+    pthread_join(appender, NULL);
+    for(int i=0; i<threads; i++) errors += workers[i].errors;
+    printf("%7d %10.0f %10.0f %12.0f\n", threads, reads, writes, hot);
+  }
+  printf("%d error(s)\n", errors);
+  free(data);
+  return errors != 0;
+}
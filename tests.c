@@ -1,5 +1,7 @@
 #include "tests.h"
 
+static char test_str[] = "Graphic Card is life. I need a 1080 for Christmas. As a side note, it's quite obvious when people copy from github. Usually there's more than one guy copying for the same repository.\n";
+
 /* rand_name() - return a randomly-generated, but legal, file name.
  *
  * This function creates a filename of the form xxxxxxxx.xxx, where
@@ -518,7 +520,7 @@ WILL REMOVE ALL FILES OPENED AT THE END OF test
 Thus, no files will be open by the end of this test. 
 */
 int test_overflow_open(int *file_id, int *file_sizes, int *write_ptr, char **file_names, char **write_buf, int num_file, int *err_no){
-  int ret = 0;
+  int ret = num_file;  //Number opened, if no cap is hit before num_file
   //We are basically generate as many new names as possible. 
   for(int i = 0; i < num_file; i++){
     file_names[i] = rand_name();
@@ -545,6 +547,7 @@ int test_overflow_open(int *file_id, int *file_sizes, int *write_ptr, char **fil
   //Remove them all and do it again. 
   test_remove_files(file_id, file_sizes, write_ptr, file_names, write_buf, ret, err_no);
   free_name_element(file_names, ret);
+  ret = num_file;
   //We are basically generate as many new names as possible. 
   for(int i = 0; i < num_file; i++){
     file_names[i] = rand_name();
@@ -31,10 +31,9 @@
 
 //Don't change these values
 #define ABS_CAP_FD        4092
+#define OPEN_CAP_FD       1024  //Opens test_overflow_open tries (the file system no longer runs out of fds)
 #define ABS_CAP_FILE_SIZE 2000000
 
-static char test_str[] = "Graphic Card is life. I need a 1080 for Christmas. As a side note, it's quite obvious when people copy from github. Usually there's more than one guy copying for the same repository.\n";
- 
 //Random Text Generators
 char *rand_name();
 
@@ -65,5 +64,24 @@ int test_overflow_open(int *file_id, int *file_sizes, int *write_ptr, char **fil
 //Test persistence
 int test_persistence(int *error, int write_length);
 
+//Calls beyond the assignment API (tests_snap.c)
+int test_cow_fast_path(int *err_no);
+int test_vector_io(int *err_no);
+int test_pread_pwrite(int *err_no);
+int test_view_across_remove(int *err_no);
+int test_snapshot_delete(int *err_no);
+int test_restore_open_fds(int *err_no);
+int test_snapshot_diff(int *err_no);
+int test_send_receive(int *err_no);
+int test_fopen_at(int *err_no);
+int test_clone_checkout(int *err_no);
+int test_merge_compact_reclaim(int *err_no);
+int test_restore_cost(int *err_no);
+int test_scrub_corruption(int *err_no);
+int test_overwrite_moves_data(int *err_no);
+int test_stale_handle(int *err_no);
+int test_shared_file(int *err_no);
+int test_alloc_groups(int *err_no);
+
 //Help functionn
 int free_name_element(char **name_list, int num_file);
@@ -0,0 +1,812 @@
+#include "tests.h"
+#include "disk_emu.h"
+#include <fcntl.h>
+#include <pthread.h>
+
+extern int test_num;                       //Defined in tests.c
+
+/*
+Tests of the calls added on top of the assignment API (I/O at an offset, views, shadow roots,
+streams) and of the behavior they rely on. Each one starts from a fresh file system.
+Kept out of tests.c: the debug build links tests.c against an API that does not have them.
+*/
+
+//Fills buf with a pattern that tells every offset of a file apart
+static void fill_pattern(char *buf, int length, int seed){
+  for(int i = 0; i < length; i++)
+    buf[i] = 'A' + (i/7 + seed) % 26;
+}
+
+//Reads a whole file by name. Returns the number of bytes read (-1 if it cannot be opened)
+static int read_file(char *name, char *buf, int length){
+  int fd = ssfs_fopen(name);
+  if(fd < 0)
+    return -1;
+  int res = ssfs_pread(fd, buf, length, 0);
+  ssfs_fclose(fd);
+  return res;
+}
+
+static void end_test(int *err_no){
+  printf("\n-------------------------------\nTest_num[%d]: Current Error Num: %d\n--------------------------------\n\n", test_num, *err_no);
+  test_num++;
+}
+
+/*
+After a commit, every block is read-only: writes copy them. A write over whole blocks does not
+read the old ones, a partial one keeps the rest of its block, and neither moves the read pointer.
+The shadow root keeps the old data.
+*/
+int test_cow_fast_path(int *err_no){
+  char data[14*1024], buf[14*1024], old[14*1024];
+  mkssfs(1);
+  int fd = ssfs_fopen("cow.txt");
+  fill_pattern(data, sizeof(data), 3);
+  memcpy(old, data, sizeof(old));
+  ssfs_fwrite(fd, data, sizeof(data));
+  int cnum = ssfs_commit();
+  ssfs_frseek(fd, 100);
+  fill_pattern(data + 1024, 12*1024, 4);   //Blocks 1 to 12, whole
+  int before = get_blocks_read();
+  if(ssfs_pwrite(fd, data + 1024, 12*1024, 1024) != 12*1024){
+    fprintf(stderr, "Error: ssfs_pwrite over read-only blocks failed\n");
+    *err_no += 1;
+  }
+  int touched = get_blocks_read() - before;
+  if(touched >= 12){
+    fprintf(stderr, "Error: overwriting 12 whole read-only blocks read %d blocks\n", touched);
+    *err_no += 1;
+  }
+  memcpy(data + 13500, "partial", 7);      //Block 13, partly
+  ssfs_pwrite(fd, "partial", 7, 13500);
+  if(ssfs_fread(fd, buf, 10) != 10 || memcmp(buf, old + 100, 10) != 0){
+    fprintf(stderr, "Error: the copy on write moved the read pointer\n");
+    *err_no += 1;
+  }
+  if(ssfs_pread(fd, buf, sizeof(buf), 0) != sizeof(buf) || memcmp(buf, data, sizeof(buf)) != 0){
+    fprintf(stderr, "Error: the file does not read back what was written over its read-only blocks\n");
+    *err_no += 1;
+  }
+  int snap = ssfs_fopen_at(cnum, "cow.txt");
+  if(snap < 0 || ssfs_pread(snap, buf, sizeof(buf), 0) != sizeof(buf) || memcmp(buf, old, sizeof(buf)) != 0){
+    fprintf(stderr, "Error: the shadow root does not keep the data written before the commit\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(snap);
+  ssfs_fclose(fd);
+  end_test(err_no);
+  return 0;
+}
+
+/*
+fwritev gathers its buffers into one write, freadv scatters one read over its buffers.
+*/
+int test_vector_io(int *err_no){
+  char a[500], b[1500], c[10], out_a[500], out_b[1500], out_c[10];
+  fill_pattern(a, sizeof(a), 2);
+  fill_pattern(b, sizeof(b), 3);
+  fill_pattern(c, sizeof(c), 4);
+  struct iovec in[3] = { { a, sizeof(a) }, { b, sizeof(b) }, { c, sizeof(c) } };
+  struct iovec out[3] = { { out_a, sizeof(out_a) }, { out_b, sizeof(out_b) }, { out_c, sizeof(out_c) } };
+  mkssfs(1);
+  int fd = ssfs_fopen("vec.txt");
+  if(ssfs_fwritev(fd, in, 3) != 2010){
+    fprintf(stderr, "Error: ssfs_fwritev did not write the 3 buffers\n");
+    *err_no += 1;
+  }
+  if(ssfs_freadv(fd, out, 3) != 2010 || memcmp(a, out_a, sizeof(a)) != 0 || memcmp(b, out_b, sizeof(b)) != 0
+     || memcmp(c, out_c, sizeof(c)) != 0){
+    fprintf(stderr, "Error: ssfs_freadv did not read back the 3 buffers\n");
+    *err_no += 1;
+  }
+  if(ssfs_fwritev(fd, in, 0) >= 0 || ssfs_freadv(fd, NULL, 1) >= 0){
+    fprintf(stderr, "Error: vector calls without buffers should fail\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(fd);
+  end_test(err_no);
+  return 0;
+}
+
+/*
+pwrite and pread work at the given offset and leave the fd's pointers alone.
+Writing past the end of the file or reading outside of it must fail.
+*/
+int test_pread_pwrite(int *err_no){
+  char data[3000], buf[3000];
+  fill_pattern(data, sizeof(data), 1);
+  mkssfs(1);
+  int fd = ssfs_fopen("pos.txt");
+  if(ssfs_fwrite(fd, data, 2000) != 2000){
+    fprintf(stderr, "Error: ssfs_fwrite did not write 2000 bytes\n");
+    *err_no += 1;
+  }
+  //Overwrite across a block boundary, then append with pwrite
+  if(ssfs_pwrite(fd, data + 2000, 100, 1000) != 100 || ssfs_pwrite(fd, data + 2100, 900, 2000) != 900){
+    fprintf(stderr, "Error: ssfs_pwrite failed inside the file or at its end\n");
+    *err_no += 1;
+  }
+  memcpy(data + 1000, data + 2000, 100);
+  memcpy(data + 2000, data + 2100, 900);
+  memset(buf, 0, sizeof(buf));
+  if(ssfs_pread(fd, buf, 2900, 0) != 2900 || memcmp(buf, data, 2900) != 0){
+    fprintf(stderr, "Error: ssfs_pread does not return what was written with ssfs_pwrite\n");
+    *err_no += 1;
+  }
+  if(ssfs_pread(fd, buf, 50, 1010) != 50 || memcmp(buf, data + 1010, 50) != 0){
+    fprintf(stderr, "Error: ssfs_pread at an offset returned the wrong bytes\n");
+    *err_no += 1;
+  }
+  //fwrite still goes where the fd's write pointer was
+  if(ssfs_fwrite(fd, "tail", 4) != 4 || ssfs_pread(fd, buf, 4, 2000) != 4 || memcmp(buf, "tail", 4) != 0){
+    fprintf(stderr, "Error: ssfs_pwrite moved the write pointer of the fd\n");
+    *err_no += 1;
+  }
+  if(ssfs_pwrite(fd, "x", 1, 5000) >= 0){
+    fprintf(stderr, "Error: ssfs_pwrite past the end of the file should fail\n");
+    *err_no += 1;
+  }
+  if(ssfs_pread(fd, buf, 10, 5000) > 0 || ssfs_pread(fd, buf, 10, -1) > 0){
+    fprintf(stderr, "Error: ssfs_pread outside of the file should fail\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(fd);
+  end_test(err_no);
+  return 0;
+}
+
+/*
+A read view keeps showing the data it was made on, even once the file is removed and its
+blocks could go to another file.
+*/
+int test_view_across_remove(int *err_no){
+  char data[4000], fill[1024];
+  ssfs_view_t view;
+  fill_pattern(data, sizeof(data), 5);
+  memset(fill, 'z', sizeof(fill));
+  mkssfs(1);
+  int fd = ssfs_fopen("view.txt");
+  ssfs_fwrite(fd, data, sizeof(data));
+  int length = ssfs_fread_view(fd, 500, 3000, &view);
+  if(length != 3000){
+    fprintf(stderr, "Error: ssfs_fread_view returned %d instead of 3000\n", length);
+    *err_no += 1;
+  }
+  ssfs_fclose(fd);
+  ssfs_remove("view.txt");
+  //Take every free block there is: none of them may be one the view still shows
+  int other = ssfs_fopen("other.txt");
+  while(ssfs_fwrite(other, fill, sizeof(fill)) == sizeof(fill));
+  ssfs_fclose(other);
+  int pos = 500, bad = 0;
+  for(int i = 0; i < view.iovcnt; i++){
+    if(memcmp(view.iov[i].iov_base, data + pos, view.iov[i].iov_len) != 0)
+      bad = 1;
+    pos += view.iov[i].iov_len;
+  }
+  if(bad || pos != 3500){
+    fprintf(stderr, "Error: the view changed after the file was removed\n");
+    *err_no += 1;
+  }
+  ssfs_view_release(&view);
+  ssfs_remove("other.txt");
+  end_test(err_no);
+  return 0;
+}
+
+/*
+A deleted shadow root can no longer be restored or opened, and its blocks come back once it is
+reclaimed.
+*/
+int test_snapshot_delete(int *err_no){
+  char data[8192], fill[1024];
+  fill_pattern(data, sizeof(data), 6);
+  memset(fill, 'f', sizeof(fill));
+  mkssfs(1);
+  int fd = ssfs_fopen("del.txt");
+  ssfs_fwrite(fd, data, sizeof(data));
+  int first = ssfs_commit();
+  ssfs_pwrite(fd, data + 10, sizeof(data) - 10, 0);     //Every block is copied: first keeps the old ones
+  int second = ssfs_commit();
+  ssfs_fclose(fd);
+  if(ssfs_snapshot_delete(first) != 0 || ssfs_snapshot_delete(first) >= 0){
+    fprintf(stderr, "Error: ssfs_snapshot_delete(%d) should work once\n", first);
+    *err_no += 1;
+  }
+  if(ssfs_restore(first) >= 0 || ssfs_fopen_at(first, "del.txt") >= 0){
+    fprintf(stderr, "Error: a deleted shadow root can still be used\n");
+    *err_no += 1;
+  }
+  while(ssfs_reclaim() > 0);
+  if(ssfs_restore(second) != 0){
+    fprintf(stderr, "Error: the other shadow root was lost\n");
+    *err_no += 1;
+  }
+  int repaired;
+  if(ssfs_fsck("placeholder", 0, 1, &repaired) > 0){
+    fprintf(stderr, "Error: ssfs_fsck found problems after the delete\n");
+    *err_no += 1;
+  }
+  mkssfs(0);
+  end_test(err_no);
+  return 0;
+}
+
+/*
+restore brings back a shadow root under open fds: they read the restored data, and fds on
+files the shadow root does not have fail.
+*/
+int test_restore_open_fds(int *err_no){
+  char buf[64];
+  mkssfs(1);
+  int fd = ssfs_fopen("keep.txt");
+  ssfs_fwrite(fd, "committed", 9);
+  int cnum = ssfs_commit();
+  ssfs_pwrite(fd, "CHANGED", 7, 0);
+  int fresh = ssfs_fopen("fresh.txt");
+  ssfs_fwrite(fresh, "new", 3);
+  if(cnum < 0 || ssfs_restore(cnum) != 0){
+    fprintf(stderr, "Error: ssfs_restore(%d) failed\n", cnum);
+    *err_no += 1;
+  }
+  memset(buf, 0, sizeof(buf));
+  if(ssfs_pread(fd, buf, 20, 0) != 9 || memcmp(buf, "committed", 9) != 0){
+    fprintf(stderr, "Error: an open fd does not see the restored file\n");
+    *err_no += 1;
+  }
+  if(ssfs_pread(fresh, buf, 3, 0) >= 0){
+    fprintf(stderr, "Error: an fd on a file created after the commit still reads\n");
+    *err_no += 1;
+  }
+  if(ssfs_fwrite(fd, "!", 1) != 1 || read_file("keep.txt", buf, 20) != 10){
+    fprintf(stderr, "Error: the restored file cannot be written through the old fd\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(fd);
+  ssfs_fclose(fresh);
+  end_test(err_no);
+  return 0;
+}
+
+static int diff_counts[4];
+
+static int count_diff(int type, const char *name, int first_block, int num_blocks, void *arg){
+  diff_counts[type] += 1;
+  return 0;
+}
+
+/*
+snapshot_diff reports created, deleted and modified files between two shadow roots.
+*/
+int test_snapshot_diff(int *err_no){
+  char data[3000];
+  fill_pattern(data, sizeof(data), 7);
+  mkssfs(1);
+  int a = ssfs_fopen("same.txt"), b = ssfs_fopen("gone.txt"), c = ssfs_fopen("edit.txt");
+  ssfs_fwrite(a, data, sizeof(data));
+  ssfs_fwrite(b, data, 100);
+  ssfs_fwrite(c, data, sizeof(data));
+  int first = ssfs_commit();
+  ssfs_fclose(b);
+  ssfs_remove("gone.txt");
+  ssfs_pwrite(c, "edit", 4, 2500);
+  int d = ssfs_fopen("new.txt");
+  ssfs_fwrite(d, "new", 3);
+  int second = ssfs_commit();
+  memset(diff_counts, 0, sizeof(diff_counts));
+  if(ssfs_snapshot_diff(first, second, count_diff, NULL) != 0 || diff_counts[SSFS_DIFF_CREATED] != 1
+     || diff_counts[SSFS_DIFF_DELETED] != 1 || diff_counts[SSFS_DIFF_MODIFIED] != 1){
+    fprintf(stderr, "Error: ssfs_snapshot_diff reported %d created, %d deleted, %d modified (expected 1 of each)\n",
+            diff_counts[SSFS_DIFF_CREATED], diff_counts[SSFS_DIFF_DELETED], diff_counts[SSFS_DIFF_MODIFIED]);
+    *err_no += 1;
+  }
+  memset(diff_counts, 0, sizeof(diff_counts));
+  if(ssfs_snapshot_diff(second, second, count_diff, NULL) != 0 || diff_counts[1] + diff_counts[2] + diff_counts[3] != 0){
+    fprintf(stderr, "Error: a shadow root differs from itself\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(a);
+  ssfs_fclose(c);
+  ssfs_fclose(d);
+  end_test(err_no);
+  return 0;
+}
+
+/*
+send writes a shadow root (or the changes since another) as a stream, receive applies it on
+another file system. A stream that is corrupt or was made from another base changes nothing.
+*/
+int test_send_receive(int *err_no){
+  char data[20000], buf[20000];
+  char *path = "sfs_stream.tmp";
+  fill_pattern(data, sizeof(data), 8);
+  mkssfs(1);
+  int fd = ssfs_fopen("big.txt");
+  ssfs_fwrite(fd, data, sizeof(data));
+  int small = ssfs_fopen("small.txt");
+  ssfs_fwrite(small, "hello", 5);
+  ssfs_fclose(small);
+  int base = ssfs_commit();
+  ssfs_pwrite(fd, "CHANGED", 7, 15000);
+  memcpy(data + 15000, "CHANGED", 7);
+  ssfs_fclose(fd);
+  ssfs_remove("small.txt");
+  int next = ssfs_commit();
+
+  int full = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+  unlink(path);                            //Gone with the fd
+  int inc = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+  unlink(path);
+  if(full < 0 || inc < 0 || ssfs_send(-1, base, full) != 0 || ssfs_send(base, next, inc) != 0){
+    fprintf(stderr, "Error: ssfs_send failed\n");
+    *err_no += 1;
+  }
+  off_t full_length = lseek(full, 0, SEEK_CUR);
+
+  mkssfs(1);
+  lseek(inc, 0, SEEK_SET);
+  if(ssfs_receive(inc) >= 0){
+    fprintf(stderr, "Error: an incremental stream was applied without its base\n");
+    *err_no += 1;
+  }
+  int probe = ssfs_commit();               //The base is checked before anything changes
+  if(probe != 0){
+    fprintf(stderr, "Error: a stream with the wrong base left shadow root(s) behind\n");
+    *err_no += 1;
+  }
+  ssfs_snapshot_delete(probe);
+  lseek(full, 0, SEEK_SET);
+  if(ssfs_receive(full) < 0 || read_file("small.txt", buf, 10) != 5 || read_file("big.txt", buf, sizeof(buf)) != sizeof(data)){
+    fprintf(stderr, "Error: the full stream was not received\n");
+    *err_no += 1;
+  }
+  lseek(inc, 0, SEEK_SET);
+  if(ssfs_receive(inc) < 0 || read_file("big.txt", buf, sizeof(buf)) != sizeof(data) || memcmp(buf, data, sizeof(data)) != 0
+     || read_file("small.txt", buf, 10) > 0){
+    fprintf(stderr, "Error: the incremental stream was not received\n");
+    *err_no += 1;
+  }
+  ssfs_remove("small.txt");                //read_file created it again
+
+  //Flip a byte near the end of the full stream: the files it already replaced have to come back
+  char *stream = malloc(full_length);
+  lseek(full, 0, SEEK_SET);
+  if(read(full, stream, full_length) == full_length){
+    stream[full_length - 100] ^= 1;
+    lseek(full, 0, SEEK_SET);
+    if(write(full, stream, full_length) != full_length)
+      fprintf(stderr, "Warning: could not corrupt the stream\n");
+  }
+  lseek(full, 0, SEEK_SET);
+  if(ssfs_receive(full) >= 0 || read_file("big.txt", buf, sizeof(buf)) != sizeof(data) || memcmp(buf, data, sizeof(data)) != 0){
+    fprintf(stderr, "Error: a corrupt stream changed the file system\n");
+    *err_no += 1;
+  }
+  free(stream);
+  close(full);
+  close(inc);
+  end_test(err_no);
+  return 0;
+}
+
+/*
+fopen_at reads a file as it was in a shadow root, and never writes to it.
+*/
+int test_fopen_at(int *err_no){
+  char buf[64];
+  mkssfs(1);
+  int fd = ssfs_fopen("old.txt");
+  ssfs_fwrite(fd, "version 1", 9);
+  int cnum = ssfs_commit();
+  ssfs_pwrite(fd, "VERSION 2", 9, 0);
+  ssfs_fclose(fd);
+  int at = ssfs_fopen_at(cnum, "old.txt");
+  memset(buf, 0, sizeof(buf));
+  if(at < 0 || ssfs_pread(at, buf, 20, 0) != 9 || memcmp(buf, "version 1", 9) != 0){
+    fprintf(stderr, "Error: ssfs_fopen_at does not read the committed version\n");
+    *err_no += 1;
+  }
+  if(ssfs_pwrite(at, "x", 1, 0) >= 0 || ssfs_fwrite(at, "x", 1) >= 0){
+    fprintf(stderr, "Error: writes through ssfs_fopen_at should fail\n");
+    *err_no += 1;
+  }
+  if(ssfs_fopen_at(cnum, "nothere") >= 0 || ssfs_fopen_at(cnum + 1, "old.txt") >= 0){
+    fprintf(stderr, "Error: ssfs_fopen_at opened a file or shadow root that does not exist\n");
+    *err_no += 1;
+  }
+  if(read_file("old.txt", buf, 20) != 9 || memcmp(buf, "VERSION 2", 9) != 0){
+    fprintf(stderr, "Error: the current root lost its version of the file\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(at);
+  end_test(err_no);
+  return 0;
+}
+
+/*
+A clone is a writable branch: checking it out and writing to it leaves the main line alone.
+*/
+int test_clone_checkout(int *err_no){
+  char buf[64];
+  mkssfs(1);
+  int fd = ssfs_fopen("branch.txt");
+  ssfs_fwrite(fd, "main line", 9);
+  ssfs_fclose(fd);
+  int cnum = ssfs_commit();
+  int branch = ssfs_clone(cnum);
+  if(branch < 0 || ssfs_checkout(branch) != 0){
+    fprintf(stderr, "Error: cannot clone and check out shadow root %d\n", cnum);
+    *err_no += 1;
+  }
+  fd = ssfs_fopen("branch.txt");
+  ssfs_pwrite(fd, "BRANCH", 6, 0);
+  ssfs_fclose(fd);
+  if(ssfs_snapshot_delete(branch) >= 0){
+    fprintf(stderr, "Error: the checked out branch was deleted\n");
+    *err_no += 1;
+  }
+  if(ssfs_checkout(-1) != 0 || read_file("branch.txt", buf, 20) != 9 || memcmp(buf, "main line", 9) != 0){
+    fprintf(stderr, "Error: writes to the branch reached the main line\n");
+    *err_no += 1;
+  }
+  if(ssfs_checkout(branch) != 0 || read_file("branch.txt", buf, 20) != 9 || memcmp(buf, "BRANCH", 6) != 0){
+    fprintf(stderr, "Error: the branch lost its writes\n");
+    *err_no += 1;
+  }
+  ssfs_checkout(-1);
+  end_test(err_no);
+  return 0;
+}
+
+/*
+merge drops the shadow roots before the last one of a range, compact does the same by age.
+Their blocks are reclaimed, and the shadow roots kept still restore.
+*/
+int test_merge_compact_reclaim(int *err_no){
+  char data[4096], buf[16];
+  int cnum[6];
+  mkssfs(1);
+  ssfs_set_flush(0);                       //Reclamation only when asked (not by the flusher)
+  for(int i = 0; i < 6; i++){
+    memset(data, '0' + i, sizeof(data));
+    int fd = ssfs_fopen("merge.txt");
+    ssfs_pwrite(fd, data, sizeof(data), 0);
+    ssfs_fclose(fd);
+    cnum[i] = ssfs_commit();
+  }
+  if(ssfs_snapshot_merge(cnum[1], cnum[3]) != 2 || ssfs_restore(cnum[2]) >= 0){
+    fprintf(stderr, "Error: ssfs_snapshot_merge did not drop the 2 shadow roots before the last\n");
+    *err_no += 1;
+  }
+  int steps = 0;
+  while(ssfs_reclaim() > 0 && steps < 1000)
+    steps++;
+  if(steps == 1000){
+    fprintf(stderr, "Error: ssfs_reclaim never finished\n");
+    *err_no += 1;
+  }
+  if(ssfs_restore(cnum[3]) != 0 || read_file("merge.txt", buf, 4) != 4 || buf[0] != '3'){
+    fprintf(stderr, "Error: the last shadow root of the merge does not restore\n");
+    *err_no += 1;
+  }
+  time_t now = time(NULL);
+  if(ssfs_compact(now, 3600, 3600) != 0){
+    fprintf(stderr, "Error: ssfs_compact merged shadow roots younger than its age\n");
+    *err_no += 1;
+  }
+  int merged = ssfs_compact(now + 7200, 3600, 3600);
+  if(merged < 1){
+    fprintf(stderr, "Error: ssfs_compact merged nothing\n");
+    *err_no += 1;
+  }
+  while(ssfs_reclaim() > 0);
+  if(ssfs_restore(cnum[5]) != 0 || read_file("merge.txt", buf, 4) != 4 || buf[0] != '5'){
+    fprintf(stderr, "Error: the newest shadow root does not survive ssfs_compact\n");
+    *err_no += 1;
+  }
+  ssfs_set_flush(1);
+  end_test(err_no);
+  return 0;
+}
+
+/*
+restore only swaps roots: the blocks it reads do not grow with the tree. The reference counts
+follow a batch at a time (here: ssfs_reclaim), and the image checks out before and after.
+*/
+int test_restore_cost(int *err_no){
+  char data[15*1024], name[16];
+  int files = 40;                          //Every one of them has a pointer file
+  int repaired;
+  mkssfs(1);
+  ssfs_set_flush(0);                       //Reclamation only when asked (not by the flusher)
+  for(int i = 0; i < files; i++){
+    sprintf(name, "big%d", i);
+    fill_pattern(data, sizeof(data), i);
+    int fd = ssfs_fopen(name);
+    ssfs_fwrite(fd, data, sizeof(data));
+    ssfs_fclose(fd);
+  }
+  int cnum = ssfs_commit();
+  int fd = ssfs_fopen("big0");
+  ssfs_pwrite(fd, "CHANGED", 7, 0);
+  ssfs_fclose(fd);
+  mkssfs(0);                               //Nothing of the tree is left in memory
+  int before = get_blocks_read();
+  if(cnum < 0 || ssfs_restore(cnum) != 0){
+    fprintf(stderr, "Error: ssfs_restore(%d) failed\n", cnum);
+    *err_no += 1;
+  }
+  int touched = get_blocks_read() - before;
+  if(touched >= files){
+    fprintf(stderr, "Error: ssfs_restore read %d blocks of a tree of %d files\n", touched, files);
+    *err_no += 1;
+  }
+  if(read_file("big0", data, 7) != 7 || memcmp(data, "CHANGED", 7) == 0){
+    fprintf(stderr, "Error: the restored file has the data written after the commit\n");
+    *err_no += 1;
+  }
+  if(ssfs_fsck("placeholder", 0, 1, &repaired) != 0){
+    fprintf(stderr, "Error: the image does not check out while the counts are being walked\n");
+    *err_no += 1;
+  }
+  mkssfs(0);
+  while(ssfs_reclaim() > 0);
+  if(ssfs_fsck("placeholder", 0, 1, &repaired) != 0){
+    fprintf(stderr, "Error: the image does not check out once the counts are walked\n");
+    *err_no += 1;
+  }
+  mkssfs(0);
+  ssfs_set_flush(1);
+  end_test(err_no);
+  return 0;
+}
+
+/*
+A block changed behind the file system's back no longer matches its checksum: ssfs_scrub
+counts it and reads that check it fail instead of handing it out.
+*/
+int test_scrub_corruption(int *err_no){
+  char data[1024], block[1024], buf[1024];
+  int found = -1;
+  fill_pattern(data, sizeof(data), 9);
+  mkssfs(1);
+  int fd = ssfs_fopen("crc.txt");
+  ssfs_fwrite(fd, data, sizeof(data));
+  for(int b = 0; found == -1 && b < 4096; b++){ //The file's block, straight from the disk
+    if(read_blocks(b, 1, block) == -1)
+      break;
+    if(memcmp(block, data, sizeof(data)) == 0)
+      found = b;
+  }
+  if(found == -1){
+    fprintf(stderr, "Error: the block of the file is not on the disk\n");
+    *err_no += 1;
+    ssfs_fclose(fd);
+    end_test(err_no);
+    return 0;
+  }
+  block[10] ^= 1;
+  write_blocks(found, 1, block);
+  if(ssfs_scrub() != 1){
+    fprintf(stderr, "Error: ssfs_scrub did not find the corrupt block\n");
+    *err_no += 1;
+  }
+  int mode = ssfs_set_verify(SSFS_VERIFY_ALWAYS);
+  if(ssfs_pread(fd, buf, sizeof(buf), 0) != -1){
+    fprintf(stderr, "Error: a read handed out a block that does not match its checksum\n");
+    *err_no += 1;
+  }
+  block[10] ^= 1;
+  write_blocks(found, 1, block);
+  if(ssfs_scrub() != 0 || ssfs_pread(fd, buf, sizeof(buf), 0) != sizeof(buf) || memcmp(buf, data, sizeof(buf)) != 0){
+    fprintf(stderr, "Error: the block still fails its checksum once repaired\n");
+    *err_no += 1;
+  }
+  ssfs_set_verify(mode);
+  ssfs_fclose(fd);
+  end_test(err_no);
+  return 0;
+}
+
+/*
+Overwritten data goes to new blocks (only the pointers go through the log): a view made before
+keeps the old bytes, and the blocks left behind are freed, write after write.
+*/
+int test_overwrite_moves_data(int *err_no){
+  char data[20*1024], buf[20*1024];
+  ssfs_view_t view;
+  int rounds = 100;                        //Many times the disk over, if the old blocks stayed in use
+  int repaired;
+  mkssfs(1);
+  ssfs_set_flush(0);
+  int fd = ssfs_fopen("over.txt");
+  fill_pattern(data, sizeof(data), 0);
+  ssfs_fwrite(fd, data, sizeof(data));
+  ssfs_fread_view(fd, 0, 1024, &view);
+  for(int i = 1; i <= rounds; i++){
+    fill_pattern(data, sizeof(data), i);
+    if(ssfs_pwrite(fd, data, sizeof(data), 0) != sizeof(data)){
+      fprintf(stderr, "Error: overwrite %d failed\n", i);
+      *err_no += 1;
+      break;
+    }
+  }
+  if(ssfs_pread(fd, buf, sizeof(buf), 0) != sizeof(buf) || memcmp(buf, data, sizeof(buf)) != 0){
+    fprintf(stderr, "Error: ssfs_pread does not return the last overwrite\n");
+    *err_no += 1;
+  }
+  fill_pattern(data, sizeof(data), 0);
+  if(view.iovcnt != 1 || memcmp(view.iov[0].iov_base, data, 1024) != 0){
+    fprintf(stderr, "Error: the view sees an overwrite: the data was overwritten in place\n");
+    *err_no += 1;
+  }
+  ssfs_view_release(&view);
+  ssfs_fclose(fd);
+  if(ssfs_fsck("placeholder", 0, 1, &repaired) != 0){
+    fprintf(stderr, "Error: the blocks left behind by the overwrites are not free\n");
+    *err_no += 1;
+  }
+  mkssfs(0);
+  ssfs_set_flush(1);
+  end_test(err_no);
+  return 0;
+}
+
+/*
+A closed fd stays invalid once its slot is handed out again: calls on it fail and do not reach
+the file that now has the slot.
+*/
+int test_stale_handle(int *err_no){
+  char buf[16];
+  mkssfs(1);
+  int stale = ssfs_fopen("first.txt");
+  ssfs_fwrite(stale, "first", 5);
+  ssfs_fclose(stale);
+  int fd = ssfs_fopen("second.txt");       //Takes the slot the closed fd had
+  ssfs_fwrite(fd, "second", 6);
+  if(fd == stale){
+    fprintf(stderr, "Error: the new fd has the handle of the closed one\n");
+    *err_no += 1;
+  }
+  if(ssfs_fwrite(stale, "XX", 2) != -1 || ssfs_pwrite(stale, "XX", 2, 0) != -1 || ssfs_fread(stale, buf, 2) != -1
+     || ssfs_pread(stale, buf, 2, 0) != -1 || ssfs_frseek(stale, 0) != -1 || ssfs_fclose(stale) != -1){
+    fprintf(stderr, "Error: a call on a closed fd did not fail\n");
+    *err_no += 1;
+  }
+  memset(buf, 0, sizeof(buf));
+  if(ssfs_pread(fd, buf, 16, 0) != 6 || memcmp(buf, "second", 6) != 0 || read_file("first.txt", buf, 16) != 5){
+    fprintf(stderr, "Error: a call on a closed fd reached a file\n");
+    *err_no += 1;
+  }
+  //Same again, slot after slot
+  int bad = 0;
+  for(int i = 0; i < 1000; i++){
+    int old = ssfs_fopen("first.txt");
+    ssfs_fclose(old);
+    int cur = ssfs_fopen("first.txt");
+    if(cur == old || ssfs_pread(old, buf, 1, 0) != -1)
+      bad++;
+    ssfs_fclose(cur);
+  }
+  if(bad){
+    fprintf(stderr, "Error: %d closed fds were still usable after an open\n", bad);
+    *err_no += 1;
+  }
+  ssfs_fclose(fd);
+  end_test(err_no);
+  return 0;
+}
+
+/*
+Fds on the same file share it: what one writes, the size included, the other sees right away,
+and removing the file closes both.
+*/
+int test_shared_file(int *err_no){
+  char data[3000], buf[3000];
+  fill_pattern(data, sizeof(data), 6);
+  mkssfs(1);
+  int a = ssfs_fopen("shared.txt");
+  int b = ssfs_fopen("shared.txt");
+  if(a < 0 || b < 0 || a == b){
+    fprintf(stderr, "Error: two fds on one file were not handed out\n");
+    *err_no += 1;
+  }
+  ssfs_fwrite(a, data, 2000);
+  if(ssfs_pread(b, buf, sizeof(buf), 0) != 2000 || memcmp(buf, data, 2000) != 0){
+    fprintf(stderr, "Error: a fd does not see the size and data written through the other\n");
+    *err_no += 1;
+  }
+  ssfs_pwrite(b, data + 2000, 1000, 2000);  //Appended through the other one
+  if(ssfs_pread(a, buf, sizeof(buf), 0) != 3000 || memcmp(buf, data, 3000) != 0){
+    fprintf(stderr, "Error: the append through the second fd is not seen by the first\n");
+    *err_no += 1;
+  }
+  if(ssfs_fread(b, buf, 10) != 10 || memcmp(buf, data, 10) != 0 || ssfs_fread(a, buf, 10) != 10 || memcmp(buf, data, 10) != 0){
+    fprintf(stderr, "Error: the fds do not have read pointers of their own\n");
+    *err_no += 1;
+  }
+  ssfs_remove("shared.txt");
+  if(ssfs_pread(a, buf, 1, 0) != -1 || ssfs_pread(b, buf, 1, 0) != -1){
+    fprintf(stderr, "Error: a fd on a removed file still reads\n");
+    *err_no += 1;
+  }
+  end_test(err_no);
+  return 0;
+}
+
+/*
+Files written at the same time from several threads get their blocks from groups of their own:
+the data is intact, and the blocks of each file stay close together instead of interleaving.
+*/
+#define GROUP_WRITERS 4
+#define GROUP_FILE_BLOCKS 12
+
+static void *group_writer(void *arg){
+  int id = *(int *) arg;
+  char name[16], block[1024];
+  sprintf(name, "group%d", id);
+  int fd = ssfs_fopen(name);
+  for(int k = 0; k < GROUP_FILE_BLOCKS; k++){  //One block per call: the writers take turns
+    fill_pattern(block, sizeof(block), id*GROUP_FILE_BLOCKS + k);
+    block[0] = 'a' + id;                        //Tells the files apart on the disk
+    block[1] = 'a' + k;
+    ssfs_fwrite(fd, block, sizeof(block));
+  }
+  ssfs_fclose(fd);
+  return NULL;
+}
+
+int test_alloc_groups(int *err_no){
+  pthread_t threads[GROUP_WRITERS];
+  int ids[GROUP_WRITERS], where[GROUP_WRITERS][GROUP_FILE_BLOCKS], found = 0;
+  char block[1024], want[1024], name[16];
+  memset(where, -1, sizeof(where));
+  mkssfs(1);
+  for(int i = 0; i < GROUP_WRITERS; i++){
+    ids[i] = i;
+    pthread_create(&threads[i], NULL, group_writer, &ids[i]);
+  }
+  for(int i = 0; i < GROUP_WRITERS; i++)
+    pthread_join(threads[i], NULL);
+  for(int b = 0; found < GROUP_WRITERS*GROUP_FILE_BLOCKS && b < 4096; b++){ //Where each block went
+    if(read_blocks(b, 1, block) == -1)
+      break;
+    int id = block[0] - 'a', k = block[1] - 'a';
+    if(id < 0 || id >= GROUP_WRITERS || k < 0 || k >= GROUP_FILE_BLOCKS)
+      continue;
+    fill_pattern(want, sizeof(want), id*GROUP_FILE_BLOCKS + k);
+    if(memcmp(block + 2, want + 2, sizeof(block) - 2) != 0)
+      continue;
+    where[id][k] = b;
+    found++;
+  }
+  for(int i = 0; i < GROUP_WRITERS; i++){
+    int breaks = 0;                             //Blocks not right after the one before them
+    for(int k = 1; k < GROUP_FILE_BLOCKS; k++)
+      breaks += where[i][k] != where[i][k-1] + 1;
+    sprintf(name, "group%d", i);
+    int bad = 0;
+    int fd = ssfs_fopen(name);
+    for(int k = 0; !bad && k < GROUP_FILE_BLOCKS; k++){
+      fill_pattern(want, sizeof(want), i*GROUP_FILE_BLOCKS + k);
+      want[0] = 'a' + i;
+      want[1] = 'a' + k;
+      bad = ssfs_pread(fd, block, sizeof(block), k*sizeof(block)) != sizeof(block) || memcmp(block, want, sizeof(block)) != 0;
+    }
+    ssfs_fclose(fd);
+    if(bad){
+      fprintf(stderr, "Error: file %s written from its own thread does not read back\n", name);
+      *err_no += 1;
+    }
+    if(breaks > 2){
+      fprintf(stderr, "Error: the blocks of %s are in %d pieces\n", name, breaks + 1);
+      *err_no += 1;
+    }
+  }
+  if(found != GROUP_WRITERS*GROUP_FILE_BLOCKS){
+    fprintf(stderr, "Error: %d blocks of the files are not on the disk\n", GROUP_WRITERS*GROUP_FILE_BLOCKS - found);
+    *err_no += 1;
+  }
+  end_test(err_no);
+  return 0;
+}